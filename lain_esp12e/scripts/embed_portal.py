@@ -0,0 +1,60 @@
+"""
+Gzips portal/index.html into include/portal_html.h as a PROGMEM byte array.
+
+Runs before every PlatformIO build (extra_scripts = pre:...) and can also be
+run by hand: python scripts/embed_portal.py
+The header is only rewritten when the page changed, so it doesn't force a
+rebuild of main.cpp on every run.
+"""
+
+import gzip
+import os
+import zlib
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO/SCons
+    PROJECT_DIR = env["PROJECT_DIR"]  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+SOURCE = os.path.join(PROJECT_DIR, "portal", "index.html")
+TARGET = os.path.join(PROJECT_DIR, "include", "portal_html.h")
+
+
+def render(html):
+    # mtime=0 keeps the output (and the ETag) identical for identical input
+    data = gzip.compress(html, compresslevel=9, mtime=0)
+    etag = "%08x" % (zlib.crc32(html) & 0xFFFFFFFF)
+
+    lines = [
+        "// Generated by scripts/embed_portal.py from portal/index.html - do not edit",
+        "#pragma once",
+        "",
+        "#include <Arduino.h>",
+        "",
+        "// %d bytes gzipped from %d" % (len(data), len(html)),
+        '#define PORTAL_HTML_ETAG "\\"%s\\""' % etag,
+        "const size_t PORTAL_HTML_GZ_LEN = %d;" % len(data),
+        "const uint8_t PORTAL_HTML_GZ[] PROGMEM = {",
+    ]
+    for i in range(0, len(data), 16):
+        lines.append("  " + ", ".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+    lines.append("};")
+    return "\n".join(lines) + "\n"
+
+
+def main():
+    with open(SOURCE, "rb") as f:
+        header = render(f.read())
+
+    if os.path.exists(TARGET):
+        with open(TARGET) as f:
+            if f.read() == header:
+                return
+
+    with open(TARGET, "w") as f:
+        f.write(header)
+    print("embed_portal: wrote %s" % os.path.relpath(TARGET, PROJECT_DIR))
+
+
+main()
@@ -0,0 +1,157 @@
+"""
+Per-symbol IRAM / DRAM / flash usage of the firmware ELF.
+
+Runs after the link in [env:esp12e_perf] (extra_scripts = post:...) and
+writes <build dir>/size_report.txt and size_report.csv. It can also be run
+by hand, optionally against another build to see what moved:
+
+    python scripts/size_report.py .pio/build/esp12e_perf/firmware.elf \
+        --baseline .pio/build/esp12e/firmware.elf
+
+Under PlatformIO the toolchain's nm is found on the build PATH; pass
+--nm when running standalone if xtensa-lx106-elf-nm isn't on PATH.
+"""
+
+import argparse
+import csv
+import glob
+import os
+import shutil
+import subprocess
+import sys
+
+NM_NAME = "xtensa-lx106-elf-nm"
+TOP_SYMBOLS = 25
+
+# ESP8266 address map. DRAM holds .data, .rodata and .bss; PROGMEM data
+# and cached code share the flash window.
+REGIONS = [
+    ("iram", 0x40100000, 0x40110000),
+    ("dram", 0x3FFE8000, 0x40000000),
+    ("flash", 0x40200000, 0x40400000),
+]
+# Usable size per region with the default 32KB cache / 32KB IRAM split
+REGION_LIMITS = {"iram": 32768, "dram": 81920, "flash": 1044464}
+
+
+def find_nm(explicit=None):
+    if explicit:
+        return explicit
+    found = shutil.which(NM_NAME)
+    if found:
+        return found
+    pattern = os.path.expanduser("~/.platformio/packages/toolchain-xtensa*/bin/" + NM_NAME)
+    matches = sorted(glob.glob(pattern))
+    if matches:
+        return matches[-1]
+    sys.exit("size_report: %s not found, pass --nm" % NM_NAME)
+
+
+def region_of(address):
+    for name, start, end in REGIONS:
+        if start <= address < end:
+            return name
+    return None
+
+
+def read_symbols(elf, nm):
+    """Returns {(region, name): (size, kind)}; kind is nm's type letter."""
+    out = subprocess.run([nm, "-S", "-C", "--size-sort", elf],
+                         check=True, capture_output=True, text=True).stdout
+    symbols = {}
+    for line in out.splitlines():
+        parts = line.split(None, 3)
+        if len(parts) < 4:
+            continue
+        address, size, kind, name = parts
+        region = region_of(int(address, 16))
+        if region is None:
+            continue
+        key = (region, name)
+        size = int(size, 16)
+        if key in symbols:
+            size += symbols[key][0]  # Same name in several sections
+        symbols[key] = (size, kind)
+    return symbols
+
+
+def totals(symbols):
+    result = {name: 0 for name, _, _ in REGIONS}
+    for (region, _), (size, _) in symbols.items():
+        result[region] += size
+    return result
+
+
+def render(symbols, baseline=None, top=TOP_SYMBOLS):
+    lines = []
+    sums = totals(symbols)
+    base_sums = totals(baseline) if baseline else None
+
+    lines.append("%-6s %10s %10s %7s" % ("region", "bytes", "limit", "used"))
+    for name, _, _ in REGIONS:
+        row = "%-6s %10d %10d %6.1f%%" % (name, sums[name], REGION_LIMITS[name],
+                                         100.0 * sums[name] / REGION_LIMITS[name])
+        if base_sums:
+            row += "  %+d vs baseline" % (sums[name] - base_sums[name])
+        lines.append(row)
+
+    for name, _, _ in REGIONS:
+        entries = sorted(((size, sym, kind) for (region, sym), (size, kind) in symbols.items()
+                          if region == name), reverse=True)
+        lines.append("")
+        lines.append("== %s: top %d of %d symbols ==" % (name, min(top, len(entries)), len(entries)))
+        for size, sym, kind in entries[:top]:
+            lines.append("%8d  %s  %s" % (size, kind, sym))
+
+    if baseline:
+        moved = []
+        for key in set(symbols) | set(baseline):
+            delta = symbols.get(key, (0, ""))[0] - baseline.get(key, (0, ""))[0]
+            if delta:
+                moved.append((abs(delta), delta, key))
+        moved.sort(reverse=True)
+        lines.append("")
+        lines.append("== largest changes vs baseline ==")
+        for _, delta, (region, sym) in moved[:top]:
+            lines.append("%+8d  %-5s  %s" % (delta, region, sym))
+
+    return "\n".join(lines) + "\n"
+
+
+def write_csv(path, symbols):
+    with open(path, "w", newline="") as f:
+        writer = csv.writer(f)
+        writer.writerow(["region", "size", "type", "symbol"])
+        for (region, sym), (size, kind) in sorted(symbols.items(), key=lambda kv: (kv[0][0], -kv[1][0])):
+            writer.writerow([region, size, kind, sym])
+
+
+def report(elf, nm, baseline_elf=None, out_dir=None, top=TOP_SYMBOLS):
+    symbols = read_symbols(elf, nm)
+    baseline = read_symbols(baseline_elf, nm) if baseline_elf else None
+    text = render(symbols, baseline, top)
+    print(text)
+    if out_dir:
+        with open(os.path.join(out_dir, "size_report.txt"), "w") as f:
+            f.write(text)
+        write_csv(os.path.join(out_dir, "size_report.csv"), symbols)
+
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO/SCons
+
+    def after_link(target, source, env):
+        elf = target[0].get_abspath()
+        report(elf, find_nm(env.WhereIs(NM_NAME)), out_dir=os.path.dirname(elf))
+
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", after_link)  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+        parser.add_argument("elf")
+        parser.add_argument("--baseline", help="second ELF to diff against")
+        parser.add_argument("--nm", help="path to " + NM_NAME)
+        parser.add_argument("--top", type=int, default=TOP_SYMBOLS)
+        parser.add_argument("--out", help="directory for size_report.txt/.csv")
+        args = parser.parse_args()
+        report(args.elf, find_nm(args.nm), args.baseline, args.out, args.top)
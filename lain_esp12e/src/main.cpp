@@ -9,9 +9,23 @@
 #include <ESP8266WiFi.h>
 #include <PubSubClient.h>
 #include <ESP8266WebServer.h>
+#include <WiFiUdp.h>
+#include <ESP8266mDNS.h>
 #include <EEPROM.h>
 #include <ArduinoJson.h>
 #include <Servo.h>
+#include <bearssl/bearssl.h>  // HMAC-SHA256 from the core's BearSSL
+#include "portal_html.h"  // Generated by scripts/embed_portal.py
+
+// ==================== BUILD PROFILE ====================
+// [env:esp12e_perf] defines CARBOT_PERF_BUILD: the command and motor path
+// tagged CARBOT_HOT then runs from IRAM instead of through the flash cache.
+// scripts/size_report.py shows what that costs after each build.
+#ifdef CARBOT_PERF_BUILD
+#define CARBOT_HOT IRAM_ATTR
+#else
+#define CARBOT_HOT
+#endif
 
 // ==================== HARDWARE PIN DEFINITIONS ====================
 const int ENA_PIN = 2;      // Left motor speed (PWM)
@@ -34,65 +48,1085 @@ bool configMode = false;
 int wifiConnectionAttempts = 0;
 const int MAX_WIFI_ATTEMPTS = 5;
 
-const char* mqtt_server = "broker.emqx.io";
+// Portal network scan (see handleScan)
+const unsigned long WIFI_SCAN_CACHE_MS = 15000;
+bool wifiScanRunning = false;
+bool wifiScanValid = false;
+int wifiScanCount = 0;
+unsigned long wifiScanCompletedAt = 0;
+
+// ==================== WIFI FAST CONNECT ====================
+// Last good AP and DHCP lease, kept in RTC user memory across resets
+// (cleared on power loss). Tried first so boot skips scan and DHCP.
+struct WifiFastCache {
+  uint32_t crc;          // CRC32 over everything after this field
+  uint32_t ssidHash;     // Invalidates the cache when credentials change
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t reserved;
+};
+const uint32_t RTC_WIFI_CACHE_OFFSET = 0;  // In 4-byte RTC blocks
+const unsigned long WIFI_FAST_TIMEOUT_MS = 3000;
+const unsigned long WIFI_FULL_TIMEOUT_MS = 10000;
+
+WifiFastCache wifiCache;
+bool wifiReady = false;
+bool wifiFastAttempt = false;      // Current attempt uses the cache
+bool wifiFastConnected = false;    // Connected through the cache this boot
+unsigned long wifiAttemptStart = 0;
+unsigned long bootToMqttMs = 0;    // millis() at first MQTT connect
+
+const char* mqtt_server = "broker.emqx.io";   // Default for broker slot 0
 const int mqtt_port = 1883;
 const char* mqtt_user = "";
 const char* mqtt_password = "";
-const char* command_topic = "carbot/command";
-const char* status_topic = "carbot/status";
-const char* sensor_topic = "carbot/sensors";  // NEW: Sensor alerts
+
+// ==================== FLEET TOPICS ====================
+// Each bot uses carbot/<device>/{command,status,sensors,metrics,auth,macro,
+// flight,latency}, where <device> is the provisioned name or cb-<chip id>.
+// Broadcasts go to carbot/all/command and carbot/group/<group>/command, and
+// a bot only subscribes to its own command topic, "all" and the groups it
+// joined. Each of those topics keeps its own seq and clock state.
+// {"fleet": {"name": "bot7", "groups": ["lab", "red"]}} (persisted; an
+// empty name goes back to the chip ID).
+const int DEVICE_NAME_LEN = 24;
+const int FLEET_GROUP_LEN = 16;
+const int FLEET_MAX_GROUPS = 3;
+const int MQTT_TOPIC_LEN = 48;
+
+char deviceId[DEVICE_NAME_LEN];
+char command_topic[MQTT_TOPIC_LEN];
+char status_topic[MQTT_TOPIC_LEN];
+char sensor_topic[MQTT_TOPIC_LEN];   // Sensor alerts and sample batches
+char metrics_topic[MQTT_TOPIC_LEN];  // Loop/handler timing
+char auth_topic[MQTT_TOPIC_LEN];     // Session handshake replies
+char macro_topic[MQTT_TOPIC_LEN];    // Macro progress
+char flight_topic[MQTT_TOPIC_LEN];   // Flight recorder dumps
+char latency_topic[MQTT_TOPIC_LEN];  // Command echoes for latency benches
+char broadcast_topic[MQTT_TOPIC_LEN];
+char group_topics[FLEET_MAX_GROUPS][MQTT_TOPIC_LEN];
+bool commandFromGroup = false;       // Set while a broadcast is handled
+uint32_t groupCommandsReceived = 0;
+
+// ==================== MQTT RECONNECT BACKOFF ====================
+const unsigned long MQTT_BACKOFF_MIN_MS = 500;
+const unsigned long MQTT_BACKOFF_MAX_MS = 30000;
+const uint16_t MQTT_SOCKET_TIMEOUT_S = 2;  // CONNACK wait once TCP is up
+const uint16_t MQTT_MOVING_SOCKET_TIMEOUT_S = 1;  // Same, while the bot drives itself
+const unsigned long MQTT_CONNECT_TIMEOUT_MS = 1000;  // TCP connect, espClient.setTimeout()
+const uint32_t MQTT_DNS_TIMEOUT_MS = 1500;  // Only while parked, see useBroker()
+
+unsigned long mqttBackoffMs = MQTT_BACKOFF_MIN_MS;
+unsigned long mqttNextAttempt = 0;
+unsigned long mqttOutageStart = 0;        // When the current outage began
+bool mqttOutage = true;                   // Not connected yet at boot
+bool mqttEverConnected = false;
+uint16_t mqttReconnectCount = 0;
+uint16_t mqttFailedAttempts = 0;
+unsigned long mqttLastReconnectMs = 0;    // Duration of the last outage
+
+// ==================== BROKER SELECTION ====================
+// Up to three brokers from the portal or {"brokers": {"list": [...]}}, plus
+// one found on the LAN as _mqtt._tcp over mDNS. The last broker that
+// connected is tried first after an outage (sticky, saved in EEPROM); on
+// failure the others follow, fastest measured connect first. Backoff only
+// starts once every candidate failed in a round. A fallback that connects
+// clearly faster than the preferred one takes over the preference.
+const int MQTT_BROKER_SLOTS = 3;
+const int MQTT_BROKER_MDNS = MQTT_BROKER_SLOTS;       // Index of the mDNS broker
+const int MQTT_BROKER_COUNT = MQTT_BROKER_SLOTS + 1;
+const uint8_t MQTT_BROKER_NONE = 0xFF;
+const unsigned long MDNS_REDISCOVER_MS = 60000;
+
+struct BrokerEntry {
+  char host[40];          // Empty = unused slot
+  uint16_t port;
+};
+
+struct BrokerStats {
+  uint32_t latencyMs;     // Smoothed connect time, 0 = never connected
+  uint16_t failures;
+  IPAddress ip;           // Resolved once, cleared after a failed round
+};
+BrokerStats brokerStats[MQTT_BROKER_COUNT];
+uint8_t brokerRoundTried = 0;             // Bitmask of brokers tried this round
+int currentBroker = -1;
+IPAddress mdnsBrokerIp;
+uint16_t mdnsBrokerPort = 0;              // 0 = nothing discovered
+bool mdnsStarted = false;
+unsigned long lastMdnsQuery = 0;
 
 const int EEPROM_MAGIC = 0xAB12;
 
+// ==================== BINARY COMMAND FRAME ====================
+// Fixed 12-byte alternative to the JSON command, told apart by its first
+// byte (JSON always starts with '{' or whitespace). Little-endian:
+//   [0] magic 0xC5  [1] version  [2..3] seq  [4] left  [5] right
+//   [6] servo  [7] flags  [8..11] tag = HMAC-SHA256(control password, bytes 0..7)[0..3]
+// The 4-byte tag only stops casual forgery; replays are left to the seq
+// checks and anything stronger to the session frames.
+// Version 2 is the session-authenticated form, see SESSION AUTH.
+const uint8_t CMD_FRAME_MAGIC = 0xC5;
+const uint8_t CMD_FRAME_VERSION = 1;
+const uint8_t CMD_FRAME_VERSION_SESSION = 2;
+
+const uint8_t CMD_FLAG_MOTORS = 0x01;      // left/right are valid
+const uint8_t CMD_FLAG_SERVO = 0x02;       // servo is valid
+const uint8_t CMD_FLAG_AUTO_SET = 0x04;    // autonomous bit is valid
+const uint8_t CMD_FLAG_AUTO_ON = 0x08;     // autonomous mode value
+const uint8_t CMD_FLAG_STOP = 0x10;        // stop motors (wins over MOTORS)
+const uint8_t CMD_FLAG_STREAM = 0x20;      // setpoint is part of a stream
+
+struct __attribute__((packed)) CommandFrame {
+  uint8_t magic;
+  uint8_t version;
+  uint16_t seq;
+  int8_t left;      // -100 to +100
+  int8_t right;     // -100 to +100
+  uint8_t servo;    // 60 to 180
+  uint8_t flags;
+  uint32_t tag;
+};
+
+// ==================== SESSION AUTH ====================
+// One handshake per controller, without the password on the wire:
+//   -> command topic   {"auth": {"hello": "<16 hex client nonce>"}}
+//   <- carbot/<id>/auth  {"sid": N, "nonce": "<16 hex>", "proof": "<16 hex>", "salt": "<16 hex>"}
+// secret = a 32-byte key provisioned with POST /sessionkey (no "salt" in
+//          the reply), else PBKDF2-HMAC-SHA256(password, salt, 4096) - run
+//          once whenever the password is saved, so a recorded proof costs
+//          an attacker 4096 HMACs per password guess
+// key    = HMAC-SHA256(secret, "carbot-session" + client nonce + bot nonce + device ID)
+// proof  = HMAC(key, "carbot-bot")[0..7], so the controller can check the bot
+// Up to AUTH_PENDING_SLOTS hellos wait for their first frame at once. A
+// pending slot is only reused once it expires, so a stranger's hellos
+// can't evict a controller that is mid-handshake.
+// Commands then carry an 8-byte truncated HMAC under that key:
+//   motor frame v2 (17 bytes): v1 bytes 0..7, [8] sid, [9..16] tag
+//   sealed JSON: [0] 0xC6 [1] sid [2..3] seq, JSON body (no password), tag
+// Tags cover the seq epoch (u16 LE, counts seq wraps) followed by every
+// byte before the tag. seq must increase within a session, so replays and
+// frames from before a wrap never verify. A new session takes over on its
+// first valid frame, so a stray hello can't knock the operator off.
+// {"auth": {"require": true}} refuses the password and v1 frames (persisted),
+// except a tagged v1 frame carrying only CMD_FLAG_STOP. Session keys are per
+// bot, so that stop is the one command a group or broadcast topic can still
+// deliver; anything else sent to a fleet needs auth.require off.
+const uint8_t SEALED_FRAME_MAGIC = 0xC6;
+const size_t SEALED_HEADER_LEN = 4;
+const size_t AUTH_NONCE_LEN = 8;
+const size_t AUTH_TAG_LEN = 8;
+const size_t AUTH_KEY_LEN = 32;
+const size_t AUTH_SALT_LEN = 8;
+const uint32_t AUTH_KDF_ITERATIONS = 4096;  // About half a second on the ESP
+const int AUTH_PENDING_SLOTS = 4;           // Also bounds HMAC work per TTL
+const unsigned long AUTH_PENDING_TTL_MS = 5000;
+const uint8_t SESSION_SECRET_NONE = 0;      // Config from before v7
+const uint8_t SESSION_SECRET_PASSWORD = 1;
+const uint8_t SESSION_SECRET_PROVISIONED = 2;
+
+struct __attribute__((packed)) SessionFrame {
+  uint8_t magic;
+  uint8_t version;
+  uint16_t seq;
+  int8_t left;
+  int8_t right;
+  uint8_t servo;
+  uint8_t flags;
+  uint8_t sid;
+  uint8_t tag[AUTH_TAG_LEN];
+};
+
+struct AuthSession {
+  bool valid;
+  uint8_t id;
+  bool seqValid;
+  uint32_t lastSeq;                 // epoch << 16 | seq
+  br_hmac_key_context key;          // Pads precomputed once per session
+  unsigned long issuedMs;
+  uint8_t clientNonce[AUTH_NONCE_LEN];
+};
+AuthSession activeSession = {};
+AuthSession pendingSessions[AUTH_PENDING_SLOTS] = {};  // Issued, not used yet
+uint8_t nextSessionId = 1;
+uint32_t authHellosRefused = 0;     // Every pending slot still live
+bool commandSealed = false;         // Set while a sealed body is handled
+uint32_t authHandshakes = 0;
+uint32_t authFailures = 0;
+uint32_t authReplays = 0;
+uint32_t authLegacyRefused = 0;
+
+// ==================== COMMAND ORDERING ====================
+// Optional "seq" (16-bit, wraps) and "ts" (sender millis) reject replayed
+// backlog after a WiFi hiccup. PubSubClient's loop() reads one packet per
+// call, so taskMqtt() drains up to MQTT_MAX_PACKETS_PER_PASS of them and
+// only the newest setpoint of the pass is applied.
+const int MQTT_MAX_PACKETS_PER_PASS = 8;
+const int16_t SEQ_REORDER_WINDOW = 64;            // Older than this = sender restart
+const unsigned long SEQ_SESSION_TIMEOUT_MS = 3000;
+const int32_t COMMAND_MAX_AGE_MS = 300;
+
+// One per sender: broadcasters number (and clock) their own stream
+struct CommandStream {
+  uint16_t lastSeq;
+  bool seqValid;
+  unsigned long lastMs;           // Last sequenced command
+  int32_t clockOffset;            // Smallest (now - ts) seen
+  bool clockValid;
+};
+CommandStream directCommands = {};
+CommandStream groupCommands[1 + FLEET_MAX_GROUPS] = {};  // [0] = "all"
+CommandStream* commandStream = &directCommands;          // Topic being handled
+uint32_t cmdDroppedOutOfOrder = 0;
+uint32_t cmdDroppedStale = 0;
+uint32_t cmdCoalesced = 0;
+
+// ==================== LAN CONTROL (UDP) ====================
+// Same payloads as the MQTT command topic (binary frame preferred) sent
+// straight to UDP_CONTROL_PORT from a controller on the LAN. Goes through
+// handleCommandPayload(), so auth, seq and staleness are shared - a
+// controller may send on both paths and duplicates are dropped.
+// Off by default; {"udp": true} enables it (persisted).
+const uint16_t UDP_CONTROL_PORT = 4210;
+const int UDP_MAX_PACKETS_PER_PASS = 8;
+const size_t UDP_PACKET_MAX = 256;
+
+bool udpControlActive = false;
+uint32_t udpPackets = 0;
+uint32_t udpOversize = 0;
+
+struct PendingCommand {
+  bool hasMotors;
+  int left;
+  int right;
+  bool hasServo;
+  int servo;
+  bool hasSeq;       // Only tracked while the latency echo is on
+  uint16_t seq;
+  uint32_t rxUs;
+};
+PendingCommand pendingCommand = {};
+
+br_hmac_key_context controlFrameKey;  // Pads for the v1 frame tag, from the password
+
 WiFiClient espClient;
 PubSubClient mqttClient(espClient);
+WiFiUDP controlUdp;
 ESP8266WebServer server(80);
 Servo servoMotor;
 
 // ==================== MOTOR STATE ====================
-int leftSpeed = 0;      // -100 to +100 (negative = reverse)
-int rightSpeed = 0;     // -100 to +100 (negative = reverse)
+int leftSpeed = 0;      // -100 to +100 (negative = reverse), as driven now
+int rightSpeed = 0;     // -100 to +100 (negative = reverse), as driven now
 int servoAngle = 90;
 
+// ==================== MOTOR DRIVER ====================
+// Speed 0-100 -> PWM duty through a per-motor table. Tables start from the
+// compile-time default and are rebuilt only when a deadband is calibrated
+// with {"motor_cal": {"left_min": N, "right_min": N}}.
+const int MOTOR_LEFT = 0;
+const int MOTOR_RIGHT = 1;
+const int MOTOR_DEFAULT_MIN_DUTY = 85;  // Below this the gearmotors stall
+const uint32_t MOTOR_DIR_MASK = bit(IN1_PIN) | bit(IN2_PIN) | bit(IN3_PIN) | bit(IN4_PIN);
+
+struct DutyTable {
+  uint8_t duty[101];
+};
+
+constexpr DutyTable makeDutyTable(int minDuty) {
+  DutyTable table = {};
+  for (int speed = 1; speed <= 100; speed++) {
+    table.duty[speed] = (uint8_t)(minDuty + (speed - 1) * (255 - minDuty) / 99);
+  }
+  return table;
+}
+
+constexpr DutyTable DEFAULT_DUTY_TABLE = makeDutyTable(MOTOR_DEFAULT_MIN_DUTY);
+static_assert(DEFAULT_DUTY_TABLE.duty[1] == 85 && DEFAULT_DUTY_TABLE.duty[100] == 255,
+              "duty table must match map(speed, 1, 100, 85, 255)");
+
+DutyTable motorDuty[2] = { DEFAULT_DUTY_TABLE, DEFAULT_DUTY_TABLE };
+int motorMinDuty[2] = { MOTOR_DEFAULT_MIN_DUTY, MOTOR_DEFAULT_MIN_DUTY };
+
+// Last state written to the H-bridge; setup() leaves everything low
+struct BridgeState {
+  uint32_t highPins;      // Direction pins currently high (bit = GPIO)
+  uint8_t leftDuty;
+  uint8_t rightDuty;
+  uint32_t pinUpdates;
+  uint32_t pwmUpdates;
+};
+BridgeState bridge = {};
+
+// ==================== MOTOR RAMP ====================
+// setMotorSpeeds() only sets the targets; the ramp task walks the driven
+// speed toward them at accel/brake %/s. Speeding up uses the accel rate,
+// slowing down (or crossing zero) uses the brake rate. Changed at runtime
+// with {"ramp": {"accel": N, "brake": N}}.
+const uint32_t MOTOR_RAMP_INTERVAL_MS = 10;
+const unsigned long MOTOR_RAMP_MAX_STEP_MS = 50;  // Cap after a stalled pass
+const unsigned long MOTOR_BRAKE_HOLD_MS = 150;    // Brake-now at high speed
+
+int leftTarget = 0;
+int rightTarget = 0;
+long leftRampMilli = 0;     // Driven speed in 1/1000 %
+long rightRampMilli = 0;
+int motorAccelRate = 600;   // %/s, 0 -> full speed in ~170ms
+int motorBrakeRate = 1000;  // %/s
+bool motorBrakeActive = false;   // H-bridge shorted by brakeNow()
+unsigned long lastRampStep = 0;
+uint16_t motorBrakeNowCount = 0;
+
+// ==================== SERVO PROFILE ====================
+// updateServo() only sets servoAngle; the servo task moves the pulse
+// toward it with a trapezoid profile (accel up to the max speed, brake in
+// time to stop on target) in 1/1000 degree steps. Once the head has held
+// still for the detach time the pulse train stops, which frees the timer
+// for analogWrite and ends the holding jitter; the next target reattaches.
+// Changed at runtime with {"servo_profile": {"speed": deg/s,
+// "accel": deg/s^2, "detach_ms": N}} (detach_ms 0 keeps it attached).
+const uint32_t SERVO_INTERVAL_MS = 20;            // One pulse frame
+const unsigned long SERVO_MAX_STEP_MS = 60;       // Cap after a stalled pass
+const int SERVO_MIN_ANGLE = 60;
+const int SERVO_MAX_ANGLE = 180;
+const int SERVO_MIN_PULSE_US = 544;               // 0 and 180 degrees; passed to attach()
+const int SERVO_MAX_PULSE_US = 2400;
+
+long servoPosMilli = 90000;       // Driven angle in 1/1000 degree
+long servoVelMilli = 0;           // 1/1000 degree/s, signed
+int servoMaxSpeed = 240;          // deg/s
+int servoAccel = 1200;            // deg/s^2, 0 -> full speed in 200ms
+unsigned long servoDetachMs = 400;
+bool servoSettled = true;
+unsigned long servoSettledSince = 0;
+unsigned long lastServoStep = 0;
+int servoPulseUs = -1;            // Last pulse written, -1 = none
+uint16_t servoDetaches = 0;
+
 // ==================== SENSOR STATE ====================
 bool irLeftBlocked = false;
 bool irRightBlocked = false;
 bool autonomousMode = false;
-unsigned long lastSensorCheck = 0;
+volatile bool irRightEdgePending = false;  // Latched by GPIO3 interrupt
+bool irSampleDue = false;                  // Fresh A0 sample not yet acted on
 unsigned long lastStatusTime = 0;
 unsigned long lastObstacleAction = 0;  
 const unsigned long OBSTACLE_COOLDOWN = 1000; 
 
+// ==================== OBSTACLE MANEUVER STATE ====================
+enum ManeuverStep {
+  MANEUVER_IDLE,
+  MANEUVER_BRAKE,      // Short-brake the H-bridge to kill momentum
+  MANEUVER_SETTLE,     // Motors off, let the chassis stabilize
+  MANEUVER_BACK_UP,    // Both edges: reverse away
+  MANEUVER_TURN,       // One edge: pivot away from it
+  MANEUVER_FORWARD     // Drive clear after the pivot
+};
+ManeuverStep maneuverStep = MANEUVER_IDLE;
+unsigned long maneuverStepStart = 0;
+unsigned long maneuverBrakeMs = 0;
+bool maneuverLeftEdge = false;
+bool maneuverRightEdge = false;
+
+const unsigned long MANEUVER_BRAKE_MS = 100;
+const unsigned long MANEUVER_SETTLE_MS = 70;
+const unsigned long MANEUVER_BACK_UP_MS = 500;
+const unsigned long MANEUVER_TURN_MS = 400;
+const unsigned long MANEUVER_FORWARD_MS = 400;
+
 bool serialEnabled = true;
 
+// ==================== MOTION MACROS ====================
+// {"macro": {"segments": [[left, right, servo, ms], ...], "repeat": N}}
+// uploads up to MACRO_MAX_SEGMENTS segments and runs them from the motion
+// task; servo 0 leaves the head where it is, repeat 0 loops until stopped.
+// {"macro": {"start": true}} reruns the stored program, {"macro": "stop"}
+// ends it. Each deadline is the previous one plus the segment duration,
+// so a run takes the same time however late the task gets to it. Any
+// drive command cancels the macro and an edge maneuver preempts it.
+// Progress goes to carbot/<device>/macro whenever the segment changes.
+enum MacroState : uint8_t {
+  MACRO_IDLE,
+  MACRO_RUNNING,
+  MACRO_DONE,
+  MACRO_CANCELLED,     // Operator drive command or stop
+  MACRO_PREEMPTED,     // Edge maneuver took over
+  MACRO_STATE_COUNT
+};
+const char* const MACRO_STATE_NAMES[MACRO_STATE_COUNT] = {"idle", "running", "done", "cancelled", "preempted"};
+
+const int MACRO_MAX_SEGMENTS = 32;
+const uint16_t MACRO_MIN_SEGMENT_MS = 10;
+const uint16_t MACRO_MAX_SEGMENT_MS = 60000;
+
+struct MacroSegment {
+  int8_t left;
+  int8_t right;
+  uint8_t servo;          // 0 = keep
+  uint16_t durationMs;
+};
+MacroSegment macroProgram[MACRO_MAX_SEGMENTS];
+uint8_t macroLength = 0;
+uint8_t macroRepeat = 1;         // Runs, 0 = until stopped
+uint8_t macroSegment = 0;
+uint16_t macroLoop = 0;          // Completed runs
+MacroState macroState = MACRO_IDLE;
+unsigned long macroSegmentStart = 0;
+unsigned long macroStartMs = 0;
+bool macroReportPending = false;
+uint32_t macroRejected = 0;
+
+// ==================== FLIGHT RECORDER ====================
+// The newest FLIGHT_EVENTS events, kept in RTC user memory after the WiFi
+// cache so a watchdog or exception reset keeps them (power loss doesn't).
+// An event is one 4-byte block: type, two args and the time since the
+// previous event in 10ms ticks; longer gaps get a FLIGHT_GAP first. A
+// repeated command source or overrunning task bumps a counter in one of
+// the newest two events instead of taking a slot, and keeps the time of
+// the first. A setpoint right after another one overwrites it, so a
+// stream takes two slots (the command count and the newest setpoint) and
+// so does a deadman decay. Nothing records from an ISR - the RTC calls
+// live in flash. {"flight": "dump"} publishes the ring to
+// carbot/<device>/flight, {"flight": "clear"} empties it, and the portal
+// serves the same dump at /flight.
+enum FlightEventType : uint8_t {
+  FLIGHT_NONE,
+  FLIGHT_BOOT,       // a = reset reason, b = exception cause
+  FLIGHT_GAP,        // a | b << 8 = gap in 100ms units, dt = remainder
+  FLIGHT_COMMAND,    // a = FlightSource, b = repeats after the first
+  FLIGHT_SETPOINT,   // a = left, b = right (int8)
+  FLIGHT_SERVO,      // a = target angle
+  FLIGHT_IR,         // a = bit 0 left blocked, bit 1 right blocked
+  FLIGHT_MANEUVER,   // a = ManeuverStep
+  FLIGHT_MACRO,      // a = MacroState, b = segment
+  FLIGHT_LINK,       // a = FlightLink, b = WiFi channel, broker or MQTT state
+  FLIGHT_OVERRUN     // a = task slot | repeats << 4, b = longest run in ms (255 = more)
+};
+enum FlightSource : uint8_t {
+  FLIGHT_SRC_JSON = 0,
+  FLIGHT_SRC_FRAME = 1,
+  FLIGHT_SRC_GROUP = 0x80   // Or'd in for broadcasts
+};
+enum FlightLink : uint8_t { FLIGHT_WIFI_UP, FLIGHT_MQTT_UP, FLIGHT_MQTT_LOST };
+
+struct alignas(4) FlightEvent {
+  uint8_t type;
+  uint8_t a;
+  uint8_t b;
+  uint8_t dt;      // 10ms ticks since the previous event
+};
+struct FlightHeader {
+  uint16_t magic;
+  uint16_t boots;          // Resets survived since the ring was created
+  uint8_t head;            // Next slot
+  uint8_t count;
+  uint8_t resetReason;     // This boot's rst_info.reason
+  uint8_t reserved;
+  uint32_t lastEventMs;    // millis() of the newest event, tick aligned
+};
+const uint32_t RTC_FLIGHT_OFFSET = (sizeof(WifiFastCache) + 3) / 4;  // In 4-byte RTC blocks
+const uint32_t RTC_FLIGHT_EVENTS_OFFSET = RTC_FLIGHT_OFFSET + sizeof(FlightHeader) / 4;
+const int FLIGHT_EVENTS = 112;
+static_assert(RTC_FLIGHT_EVENTS_OFFSET + FLIGHT_EVENTS <= 128, "RTC user memory is 128 blocks");
+const uint16_t FLIGHT_MAGIC = 0xF17E;
+const unsigned long FLIGHT_TICK_MS = 10;
+const int FLIGHT_FOLD_DEPTH = 2;      // Newest events a repeat may fold into
+
+// Dump: [0] 0xF1 [1] version [2] count [3] reset reason [4..5] boots
+// [6..9] ms since the newest event [10] capacity [11] 0, then the events
+// oldest first
+const uint8_t FLIGHT_DUMP_MAGIC = 0xF1;
+const uint8_t FLIGHT_DUMP_VERSION = 1;
+const size_t FLIGHT_DUMP_HEADER = 12;
+const int FLIGHT_CHUNK_EVENTS = 16;   // Per HTTP chunk
+
+FlightHeader flightHeader;
+FlightEvent flightRecent[FLIGHT_FOLD_DEPTH];  // [0] newest, for folding repeats
+uint8_t flightIrBits = 0;          // Last recorded states, for transitions
+ManeuverStep flightManeuver = MANEUVER_IDLE;
+bool flightDumpPending = false;
+
+// ==================== LATENCY ECHO ====================
+// {"bench": {"echo": true}} makes every applied command that carries a seq
+// send a frame to carbot/<device>/latency, so a host can time publish to
+// actuation (see latency_bench.py). 16 bytes, little-endian:
+//   [0] 0xE1  [1] version  [2..3] seq  [4..7] micros() at apply
+//   [8..11] receive to apply in us  [12..13] commands received
+//   [14..15] commands applied, both counted since the echo was enabled
+// Received minus applied is what coalescing and the seq checks absorbed;
+// the host's sent count minus received is what the network lost. Off by
+// default and after a reboot.
+const uint8_t LATENCY_ECHO_MAGIC = 0xE1;
+const uint8_t LATENCY_ECHO_VERSION = 1;
+const size_t LATENCY_ECHO_LEN = 16;
+
+bool latencyEcho = false;
+uint32_t latencyRxUs = 0;          // micros() when the current command arrived
+uint16_t latencyReceived = 0;
+uint16_t latencyApplied = 0;
+
 // ==================== IR SENSOR THRESHOLD ====================
 const float IR_THRESHOLD_VOLTAGE = 0.45;  // 0.45V threshold
 const int IR_THRESHOLD_ADC = (int)(IR_THRESHOLD_VOLTAGE / 3.3 * 1023);  // ~140
+const int IR_HYSTERESIS_ADC = 20;         // Must fall this far to clear
+
+// ==================== IR FILTER & CALIBRATION ====================
+// Each sample averages IR_OVERSAMPLE reads, takes the median of the last
+// three (drops single spikes) and feeds a 1/4 IIR kept in 1/16 ADC counts.
+// Blocked above the surface's on threshold, clear again below off.
+// Thresholds per surface: {"ir_cal": {"surface": N, "point": "floor"|"edge"}}
+// captures the current reading, {"ir_cal": {"surface": N, "on": a, "off": b}}
+// sets them directly and {"ir_surface": N} picks the active one.
+const int IR_OVERSAMPLE = 4;
+const int IR_FILTER_SHIFT = 2;
+const int IR_FILTER_SCALE = 16;
+const int IR_CAL_SAMPLES = 32;
+const int IR_SURFACE_COUNT = 4;
+
+struct IrSurface {
+  uint16_t floorAdc;    // Reading over this surface (0 = not captured)
+  uint16_t edgeAdc;     // Reading with nothing under the sensor
+  uint16_t onAdc;
+  uint16_t offAdc;
+};
+
+uint16_t irRecent[3] = {0, 0, 0};   // Last oversampled readings
+uint8_t irRecentIndex = 0;
+int32_t irFiltered = 0;             // 1/16 ADC counts
+bool irFilterSeeded = false;
+int irOnThreshold = IR_THRESHOLD_ADC;
+int irOffThreshold = IR_THRESHOLD_ADC - IR_HYSTERESIS_ADC;
+
+// ==================== STORED CONFIG ====================
+// Everything persistent lives in one struct at EEPROM offset 0, read and
+// written with a single get/put. The CRC covers the first `size` bytes
+// after the header, so a blob saved by older firmware still validates and
+// fields it didn't have yet keep their defaults. To add a field: append
+// it at the end, set its default in defaultConfig() and bump the version.
+const uint16_t CONFIG_MAGIC = 0xCB07;
+const uint8_t CONFIG_VERSION = 7;
+const int CONFIG_EEPROM_ADDR = 0;
+const size_t CONFIG_EEPROM_SIZE = 512;  // Flash sector mirror passed to EEPROM.begin()
+const int LEGACY_MAGIC_ADDR = 200;   // v3.0 byte-by-byte layout
+
+struct ConfigHeader {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t reserved;
+  uint16_t size;          // Payload bytes covered by crc
+  uint16_t reserved2;
+  uint32_t crc;
+};
+
+struct StoredConfig {
+  ConfigHeader header;
+  // v1
+  char ssid[33];
+  char wifiPassword[65];
+  char controlPassword[50];
+  uint8_t irActiveSurface;
+  IrSurface irSurfaces[IR_SURFACE_COUNT];
+  uint8_t motorMinDuty[2];
+  // v2
+  uint8_t udpControl;     // LAN command listener enabled
+  // v3
+  BrokerEntry brokers[MQTT_BROKER_SLOTS];
+  uint8_t preferredBroker;  // Sticky pick, MQTT_BROKER_NONE = none yet
+  uint8_t mdnsDiscovery;
+  // v4
+  uint16_t idleTimeoutS;    // 0 = never sleep
+  uint16_t wakeLatencyMs;
+  uint8_t lightSleep;
+  // v5
+  char deviceName[DEVICE_NAME_LEN];   // Empty = cb-<chip id>
+  char groups[FLEET_MAX_GROUPS][FLEET_GROUP_LEN];
+  // v6
+  uint8_t requireSession;   // Refuse password / v1 frame commands, bar stop-only frames
+  // v7
+  uint8_t sessionSecretSource;  // SESSION_SECRET_*
+  uint8_t sessionSalt[AUTH_SALT_LEN];
+  uint8_t sessionSecret[AUTH_KEY_LEN];
+};
+static_assert(CONFIG_EEPROM_ADDR + sizeof(StoredConfig) <= CONFIG_EEPROM_SIZE,
+              "StoredConfig no longer fits EEPROM.begin(CONFIG_EEPROM_SIZE)");
+StoredConfig config;
+uint16_t configCommits = 0;
+
+// ==================== STREAMING TELEOP ====================
+// Entered with {"stream": {"rate_hz": N, "timeout_ms": T}} (or the binary
+// STREAM flag). The last setpoint is held across short gaps, decays to
+// zero after that and the motors stop once timeout_ms passes silently.
+enum StreamState {
+  STREAM_OFF,
+  STREAM_LIVE,       // Setpoints arriving on time
+  STREAM_HOLD,       // Short gap - keep last setpoint
+  STREAM_DECAY,      // Longer gap - ramp toward zero
+  STREAM_STOPPED     // Deadman tripped
+};
+const int STREAM_DEFAULT_RATE_HZ = 20;
+const unsigned long STREAM_DEFAULT_TIMEOUT_MS = 500;
+const int STREAM_HOLD_PERIODS = 2;  // Missed packets tolerated before decay
+
+StreamState streamState = STREAM_OFF;
+int streamRateHz = STREAM_DEFAULT_RATE_HZ;
+unsigned long streamTimeoutMs = STREAM_DEFAULT_TIMEOUT_MS;
+unsigned long lastStreamSetpoint = 0;
+int streamLeft = 0;
+int streamRight = 0;
+uint16_t streamDeadmanTrips = 0;
+unsigned long streamMaxGapMs = 0;
+
+// ==================== STATUS PUBLISH POLICY ====================
+// Changes are published at once as deltas; a full snapshot goes out on
+// the (slow) heartbeat. All limits can be changed with "status_cfg".
+const uint8_t STATUS_FIELD_SPEED = 0x01;
+const uint8_t STATUS_FIELD_SERVO = 0x02;
+const uint8_t STATUS_FIELD_IR = 0x04;
+const uint8_t STATUS_FIELD_MODE = 0x08;
+const uint8_t STATUS_FIELD_ALL = 0x0F;
+const unsigned long STATUS_CHECK_INTERVAL_MS = 50;
+
+unsigned long statusHeartbeatMs = 10000;    // Full snapshot interval
+unsigned long statusMinIntervalMs = 100;    // Rate limit for deltas
+int statusSpeedDelta = 5;                   // Speed change worth reporting
+int statusServoDelta = 3;                   // Servo change worth reporting
+
+struct StatusSnapshot {
+  int leftSpeed;
+  int rightSpeed;
+  int servoAngle;
+  bool irLeftBlocked;
+  bool irRightBlocked;
+  bool autonomousMode;
+  StreamState streamState;
+};
+StatusSnapshot lastPublished;
+unsigned long lastFullStatusTime = 0;
+
+// ==================== SENSOR RECORDING ====================
+// {"record": {"on": true, "flush_ms": N}} (or {"record": bool}) captures
+// every 5ms IR sample with the driven speeds into a ring and publishes
+// them as binary batches on sensor_topic (alerts stay JSON, so the first
+// byte tells them apart). Batch, little-endian:
+//   [0] magic 0xD1  [1] version  [2] count  [3] dropped since last batch
+//   [4..7] millis() of the first sample, then per sample:
+//   varint ms since previous sample, u16 level (bits 0-9 filtered A0,
+//   bit 10 left blocked, bit 11 GPIO3 level, bit 12 right blocked),
+//   i8 left speed, i8 right speed
+// Batches wait while the TCP send buffer can't take them; once the ring
+// is full the oldest samples are overwritten and counted as dropped.
+const uint8_t SENSOR_BATCH_MAGIC = 0xD1;
+const uint8_t SENSOR_BATCH_VERSION = 1;
+const int SENSOR_RING_SIZE = 256;                 // ~1.3 s at 5ms
+const size_t SENSOR_BATCH_BYTES = 640;
+const size_t SENSOR_BATCH_HEADER = 8;
+const size_t SENSOR_SAMPLE_MAX_BYTES = 9;         // 5-byte varint + 4
+const uint32_t SENSOR_FLUSH_CHECK_MS = 10;
+const unsigned long SENSOR_DEFAULT_FLUSH_MS = 250;
+const uint16_t SENSOR_LEVEL_LEFT_BLOCKED = 0x0400;
+const uint16_t SENSOR_LEVEL_RIGHT_PIN = 0x0800;
+const uint16_t SENSOR_LEVEL_RIGHT_BLOCKED = 0x1000;
+
+struct __attribute__((packed)) SensorSample {
+  uint32_t ms;
+  uint16_t level;
+  int8_t left;
+  int8_t right;
+};
+SensorSample sensorRing[SENSOR_RING_SIZE];
+uint16_t sensorRingHead = 0;                      // Oldest sample
+uint16_t sensorRingCount = 0;
+uint8_t sensorBatch[SENSOR_BATCH_BYTES];
+
+bool sensorRecording = false;
+unsigned long sensorFlushMs = SENSOR_DEFAULT_FLUSH_MS;
+unsigned long lastSensorFlush = 0;
+uint32_t sensorSamplesDropped = 0;                // Total, for status
+uint8_t sensorDroppedSinceBatch = 0;              // Saturates at 255
+uint32_t sensorBatchesSent = 0;
+uint32_t sensorBackpressureWaits = 0;
+
+// ==================== SENSOR ALERT QUEUE ====================
+// The maneuver path and the GPIO3 ISR only push a 5-byte event; the
+// publisher task drains them, folds repeats of one type into a single
+// alert per ALERT_COALESCE_MS and publishes when the socket has room.
+// Each producer owns one single-producer ring, so neither ever locks:
+// the producer alone moves head, the publisher alone moves tail.
+enum AlertType : uint8_t {
+  ALERT_NO_FORWARD_PATH,
+  ALERT_NO_SURFACE_LEFT,
+  ALERT_NO_SURFACE_RIGHT,
+  ALERT_IR_EDGE_RIGHT,     // Raw GPIO3 edge, from the ISR
+  ALERT_TYPE_COUNT
+};
+
+struct AlertInfo {
+  const char* type;
+  const char* side;
+};
+const AlertInfo ALERT_INFO[ALERT_TYPE_COUNT] = {
+  {"no_forward_path", "both"},
+  {"no_surface_left", "left"},
+  {"no_surface_right", "right"},
+  {"ir_edge", "right"},
+};
+
+const uint8_t ALERT_QUEUE_SIZE = 8;               // Power of two
+const unsigned long ALERT_COALESCE_MS = 1000;     // At most one alert per type
+const uint32_t ALERT_PUBLISH_INTERVAL_MS = 20;
+const size_t ALERT_MIN_SEND_ROOM = 160;           // Topic + JSON alert
+
+struct AlertEvent {
+  uint8_t type;
+  uint32_t ms;
+};
+
+struct AlertQueue {
+  AlertEvent events[ALERT_QUEUE_SIZE];
+  uint8_t head;                                   // Written by the producer
+  uint8_t tail;                                   // Written by the publisher
+  uint16_t dropped;
+};
+AlertQueue loopAlerts = {};
+AlertQueue isrAlerts = {};
+
+// Pending alert per type, built up between publishes
+struct AlertSlot {
+  uint16_t count;
+  uint32_t firstMs;
+  uint32_t lastMs;
+  uint32_t lastPublishMs;
+  bool everPublished;
+};
+AlertSlot alertSlots[ALERT_TYPE_COUNT];
+uint32_t alertsPublished = 0;
+uint32_t alertsCoalesced = 0;                     // Events folded into another
+uint32_t alertBackpressureWaits = 0;
+unsigned long lastAlertPublish = 0;
+
+// ==================== POWER MANAGEMENT ====================
+// Parked (motors stopped, no autonomy/stream/recording, no command for
+// idle_s) the radio drops to modem sleep - or light sleep with "light" -
+// waking every listen interval (in 102.4ms beacons) to catch buffered
+// frames, and loop() sleeps between passes. Both waits are held to half
+// of latency_ms each, so a command is handled within that budget. The
+// MQTT keepalive is far longer, so the session stays up while idle.
+// {"power": {"idle_s": N, "latency_ms": M, "light": bool}} (persisted).
+enum PowerState : uint8_t {
+  POWER_ACTIVE,
+  POWER_MODEM_SLEEP,
+  POWER_LIGHT_SLEEP,
+  POWER_STATE_COUNT
+};
+const char* const POWER_STATE_NAMES[POWER_STATE_COUNT] = {"active", "modem", "light"};
+
+const uint16_t POWER_DEFAULT_IDLE_S = 60;
+const uint16_t POWER_DEFAULT_LATENCY_MS = 500;
+const uint16_t POWER_MIN_LATENCY_MS = 210;        // One beacon + one loop wait
+const uint16_t POWER_MAX_LATENCY_MS = 2000;
+const uint32_t BEACON_INTERVAL_MS = 102;          // 100 TU
+const uint8_t MAX_LISTEN_INTERVAL = 10;           // SDK limit
+const uint32_t POWER_CHECK_INTERVAL_MS = 100;
+
+PowerState powerState = POWER_ACTIVE;
+unsigned long lastActivityMs = 0;
+unsigned long powerStateSince = 0;
+uint32_t powerStateMs[POWER_STATE_COUNT] = {};    // Closed dwell periods
+uint32_t powerWakes = 0;
+
+// ==================== TASK SCHEDULER ====================
+// Fixed-rate cooperative tasks run from loop(). When several are due in
+// the same pass they run in priority order (0 first). A task that starts
+// a full period late or runs longer than its period counts an overrun.
+typedef void (*TaskFunction)();
+
+struct Task {
+  const char* name;
+  TaskFunction run;
+  uint32_t periodUs;      // 0 = every pass
+  uint8_t priority;
+  uint32_t nextRunUs;
+  uint32_t lastDurationUs;
+  uint32_t maxDurationUs;
+  uint16_t overruns;
+};
+const int MAX_TASKS = 16;
+static_assert(MAX_TASKS <= 16, "FLIGHT_OVERRUN keeps the task slot in 4 bits");
+Task tasks[MAX_TASKS];
+int taskCount = 0;
+
+const uint32_t IR_SAMPLE_INTERVAL_MS = 5;
+const uint32_t MOTION_INTERVAL_MS = 5;
+const uint32_t WIFI_POLL_INTERVAL_MS = 50;
+const uint32_t WEB_SERVER_INTERVAL_MS = 10;
+
+// ==================== TIMING METRICS ====================
+// Cycle-counter durations folded into log2 microsecond histograms
+// (bucket b = values with bit length b). Reset after every publish.
+enum MetricId {
+  METRIC_LOOP,
+  METRIC_CALLBACK,
+  METRIC_OBSTACLES,
+  METRIC_STATUS,
+  METRIC_WEB,
+  METRIC_COUNT
+};
+const char* const METRIC_NAMES[METRIC_COUNT] = {"loop", "callback", "obstacles", "status", "web"};
+const int HIST_BUCKETS = 21;  // Up to ~1 s; the last bucket is open-ended
+
+struct LatencyHistogram {
+  uint32_t count;
+  uint32_t maxUs;
+  uint32_t buckets[HIST_BUCKETS];
+};
+LatencyHistogram metrics[METRIC_COUNT];
+
+const uint32_t LOOP_BUDGET_US = 5000;          // One control tick
+const uint32_t METRICS_INTERVAL_MS = 10000;
+uint32_t cyclesPerUs = 80;
+uint32_t loopOverBudget = 0;                  // Since boot
+uint32_t metricsWindowStart = 0;
+
+// ==================== TELEMETRY BUFFERS ====================
+// Outgoing JSON is built in a static arena and serialized into a static
+// buffer, so status and alert publishing never touch the heap. The full
+// status goes out as two messages (state + "health" counters) so each
+// stays under the buffer with every counter at its widest; a document
+// that would not fit is dropped and counted, never sent truncated.
+const size_t TELEMETRY_ARENA_SIZE = 3072;
+const size_t TELEMETRY_BUFFER_SIZE = 1408;  // Worst-case health section is ~1150 bytes
+const uint16_t MQTT_BUFFER_SIZE = 1536;  // Topic + header + telemetry payload
+static_assert(MQTT_BUFFER_SIZE >= TELEMETRY_BUFFER_SIZE + 96, "MQTT buffer must hold a full telemetry payload plus topic and header");
+
+class TelemetryArena : public ArduinoJson::Allocator {
+ public:
+  void* allocate(size_t size) override {
+    size_t total = HEADER_SIZE + alignUp(size);
+    if (used + total > sizeof(pool)) {
+      overflows++;
+      return nullptr;  // JsonDocument reports overflowed()
+    }
+    uint8_t* block = pool + used;
+    *(size_t*)block = size;
+    used += total;
+    return block + HEADER_SIZE;
+  }
+  
+  void deallocate(void*) override {}  // Released all at once by reset()
+  
+  void* reallocate(void* ptr, size_t newSize) override {
+    uint8_t* block = (uint8_t*)ptr - HEADER_SIZE;
+    size_t oldSize = *(size_t*)block;
+    
+    // Last block can grow or shrink in place
+    if (block + HEADER_SIZE + alignUp(oldSize) == pool + used) {
+      size_t offset = block - pool;
+      if (offset + HEADER_SIZE + alignUp(newSize) > sizeof(pool)) {
+        overflows++;
+        return nullptr;
+      }
+      used = offset + HEADER_SIZE + alignUp(newSize);
+      *(size_t*)block = newSize;
+      return ptr;
+    }
+    if (newSize <= oldSize) return ptr;
+    
+    void* moved = allocate(newSize);
+    if (moved) memcpy(moved, ptr, oldSize);
+    return moved;
+  }
+  
+  void reset() { used = 0; }
+  
+  uint16_t overflows = 0;
+  
+ private:
+  static const size_t HEADER_SIZE = sizeof(void*) > sizeof(size_t) ? sizeof(void*) : sizeof(size_t);
+  static size_t alignUp(size_t size) { return (size + HEADER_SIZE - 1) & ~(HEADER_SIZE - 1); }
+  
+  alignas(HEADER_SIZE) uint8_t pool[TELEMETRY_ARENA_SIZE];
+  size_t used = 0;
+};
+
+TelemetryArena telemetryArena;
+char telemetryBuffer[TELEMETRY_BUFFER_SIZE];
+uint16_t telemetryOversize = 0;  // Documents dropped for not fitting the buffer
 
 // ==================== FUNCTION DECLARATIONS ====================
 void clearEEPROM();
+StoredConfig defaultConfig();
+bool loadConfig();
+bool saveConfig();
+bool loadLegacyConfig();
+void applyConfig();
 void loadCredentials();
 void saveCredentials(String ssid, String password);
 void saveControlPassword(String password);
-bool validateControlPassword(String password);
-bool connectToWiFi();
+bool validateControlPassword(const char* password);
+bool constantTimeEquals(const uint8_t* a, const uint8_t* b, size_t length);
+bool parseHexBytes(const char* hex, uint8_t* out, size_t length);
+void formatHex(const uint8_t* data, size_t length, char* out);
+void pbkdf2Sha256(const void* password, size_t passwordLength, const uint8_t* salt, size_t saltLength,
+                 uint32_t iterations, uint8_t* out);
+void deriveSessionSecret();
+bool setSessionSecret(const char* keyHex);
+void clearAuthSessions();
+void startAuthSession(const char* clientNonceHex);
+AuthSession* findAuthSession(uint8_t sid);
+bool verifySessionTag(AuthSession& session, uint16_t seq, const uint8_t* data, size_t length, const uint8_t* tag);
+void handleSealedCommand(const byte* payload, unsigned int length);
+void applyCommandFrame(uint8_t flags, int left, int right, int servo);
+void updateControlFrameKey();
+uint32_t computeFrameTag(const byte* frame);
+void handleBinaryCommand(const byte* payload, unsigned int length);
+bool acceptCommandSequence(bool hasSeq, uint16_t seq, bool hasTs, uint32_t ts);
+void queueMotorCommand(int left, int right);
+void queueServoCommand(int angle);
+void applyPendingCommand();
+void startStreaming(int rateHz, unsigned long timeoutMs);
+void stopStreaming();
+void updateStreamDeadman();
+const char* streamStateName(StreamState state);
+uint32_t crc32(const uint8_t* data, size_t length);
+bool loadWifiCache();
+void saveWifiCache();
+void beginWiFiConnect(bool useCache);
+void updateWiFiConnection();
+void onWiFiConnected();
 void startConfigMode();
 void handleRoot();
 void handleScan();
+void updateWifiScan();
+void jsonEscape(const char* in, char* out, size_t outSize);
 void handleConnect();
 void handleSetPassword();
+void handleSessionKey();
 void setupWebServer();
 void setupMQTT();
 void reconnectMQTT();
+bool brokerAvailable(int broker);
+bool staticBrokerConfigured();
+int nextBrokerCandidate();
+bool useBroker(int broker);
+void recordBrokerResult(int broker, bool connected, uint32_t latencyMs);
+bool discoverMqttBroker();
+bool parseBrokerEntry(const String& text, BrokerEntry& entry);
+void applyBrokerConfig(JsonObject cfg);
+void handleBrokers();
 void mqttCallback(char* topic, byte* payload, unsigned int length);
+void startUdpControl();
+void stopUdpControl();
+void pollUdpControl();
+void handleCommandPayload(const byte* payload, unsigned int length);
+void noteAuthenticatedCommand(uint8_t source);
 void publishStatus();
-void publishSensorAlert(String alertType, String side);
+void publishStatusHealth();
+void publishStatusDelta(uint8_t fields);
+uint8_t changedStatusFields();
+void recordPublishedStatus(uint8_t fields);
+void updateStatusPublisher();
+void applyStatusConfig(JsonObject cfg);
+bool pushAlert(AlertQueue& queue, AlertType type);
+void queueSensorAlert(AlertType type);
+void drainAlertQueue(AlertQueue& queue);
+void publishSensorAlert(AlertType type, const AlertSlot& slot);
+void publishPendingAlerts();
+void setSensorRecording(bool on, unsigned long flushMs);
+void recordSensorSample();
+size_t encodeSensorBatch(uint16_t& samplesUsed);
+void flushSensorBatch();
+bool publishTelemetry(const char* topic, JsonDocument& doc);
 void readIRSensors();
+void sampleLeftIR();
+int readLeftIROversampled();
+void selectIrSurface(int surface);
+void applyIrCalibration(JsonObject cfg);
+void onIrRightChange();
+void attachIrRightInterrupt();
+bool edgeChecksActive();
 void handleObstacles();
+void beginManeuverStep(ManeuverStep step, int left, int right);
+void updateManeuver();
+bool cancelManeuver();
 void setMotorSpeeds(int left, int right);
+void writeMotorOutputs(int left, int right);
+void applyBridgeState(uint32_t highPins, uint8_t leftDuty, uint8_t rightDuty);
+void setMotorDeadband(int motor, int minDuty);
+void applyMotorCalibration(JsonObject cfg);
+void updateMotorRamp();
+void brakeNow();
+void applyRampConfig(JsonObject cfg);
 void stopMotors();
 void updateServo(int angle);
+void updateServoProfile();
+void writeServoPulse();
+void applyServoProfileConfig(JsonObject cfg);
 void disableSerial();
+bool registerTask(const char* name, TaskFunction run, uint32_t periodMs, uint8_t priority);
+void runScheduler();
+uint32_t totalTaskOverruns();
+void setupTasks();
+void taskMqtt();
+void taskUdpControl();
+void taskIrSampler();
+void taskSensorFlush();
+void taskAlerts();
+void taskObstacles();
+void taskMotion();
+void taskMotorRamp();
+void taskServo();
+void taskStatus();
+void taskWiFi();
+void taskWebServer();
+void taskMetrics();
+uint32_t metricStart();
+uint32_t recordMetric(MetricId id, uint32_t startCycles);
+uint32_t histogramPercentile(const LatencyHistogram& hist, uint32_t percent);
+void publishMetrics();
+bool isValidFleetName(const char* name, size_t maxLen);
+void buildFleetTopics();
+void subscribeFleetTopics();
+void unsubscribeFleetTopics();
+bool setFleetIdentity(const char* name, const char* const* groups, int groupCount);
+void applyFleetConfig(JsonObject cfg);
+void handleFleet();
+bool loadMacro(JsonArray segments);
+void applyMacroCommand(JsonVariant cmd);
+void startMacro();
+void beginMacroSegment();
+void endMacro(MacroState reason);
+void updateMacro();
+void publishMacroProgress();
+void loadFlightRecorder();
+void writeFlightHeader();
+void appendFlightEvent(FlightEvent event);
+void recordFlightEvent(uint8_t type, uint8_t a, uint8_t b);
+void rewriteRecentFlightEvent(int age);
+void recordFlightCommand(uint8_t source);
+void recordFlightSetpoint(int left, int right);
+void recordFlightOverrun(uint8_t slot, uint32_t runUs);
+void watchFlightState();
+bool readFlightEvent(int index, FlightEvent* event);
+size_t writeFlightDumpHeader(uint8_t* out);
+void clearFlightRecorder();
+void publishFlightDump();
+void handleFlight();
+void setLatencyEcho(bool on);
+void noteCommandSeq(uint16_t seq);
+void publishLatencyEcho(uint32_t applyUs);
+void notePowerActivity();
+bool powerIdleAllowed();
+void setPowerState(PowerState state);
+uint8_t powerListenInterval();
+uint32_t powerLoopSleepMs();
+uint32_t powerDwellMs(PowerState state);
+void applyPowerConfig(JsonObject cfg);
+void updatePowerState();
+void taskPower();
 
 // ==================== SERIAL HELPER ====================
 void disableSerial() {
@@ -106,637 +1140,2524 @@ void disableSerial() {
 
 // ==================== IR SENSOR READING ====================
 void readIRSensors() {
-  // Read LEFT sensor (A0 - analog)
-  int leftValue = analogRead(IR_LEFT_PIN);
-  float leftVoltage = (leftValue / 1023.0) * 3.3;
-  irLeftBlocked = (leftVoltage > IR_THRESHOLD_VOLTAGE);  // HIGH = obstacle/no surface
+  sampleLeftIR();
   
   // Read RIGHT sensor (GPIO3 - digital)
   irRightBlocked = digitalRead(IR_RIGHT_PIN);  // HIGH = obstacle/no surface
 }
 
+int CARBOT_HOT readLeftIROversampled() {
+  int sum = 0;
+  for (int i = 0; i < IR_OVERSAMPLE; i++) {
+    sum += analogRead(IR_LEFT_PIN);
+  }
+  return sum / IR_OVERSAMPLE;
+}
+
+void CARBOT_HOT sampleLeftIR() {
+  // Read LEFT sensor (A0 - analog), integer only
+  uint16_t raw = readLeftIROversampled();
+  
+  if (!irFilterSeeded) {
+    irRecent[0] = irRecent[1] = irRecent[2] = raw;
+    irFiltered = raw * IR_FILTER_SCALE;
+    irFilterSeeded = true;
+  }
+  irRecent[irRecentIndex] = raw;
+  irRecentIndex = (irRecentIndex + 1) % 3;
+  
+  uint16_t a = irRecent[0], b = irRecent[1], c = irRecent[2];
+  uint16_t median = max(min(a, b), min(max(a, b), c));
+  irFiltered += ((int32_t)median * IR_FILTER_SCALE - irFiltered) >> IR_FILTER_SHIFT;
+  
+  // HIGH = obstacle/no surface
+  int level = irFiltered / IR_FILTER_SCALE;
+  if (irLeftBlocked) {
+    irLeftBlocked = level > irOffThreshold;
+  } else {
+    irLeftBlocked = level > irOnThreshold;
+  }
+}
+
+// ==================== IR CALIBRATION ====================
+void selectIrSurface(int surface) {
+  config.irActiveSurface = constrain(surface, 0, IR_SURFACE_COUNT - 1);
+  irOnThreshold = config.irSurfaces[config.irActiveSurface].onAdc;
+  irOffThreshold = config.irSurfaces[config.irActiveSurface].offAdc;
+}
+
+void applyIrCalibration(JsonObject cfg) {
+  int index = constrain(cfg["surface"] | (int)config.irActiveSurface, 0, IR_SURFACE_COUNT - 1);
+  IrSurface& surface = config.irSurfaces[index];
+  
+  String point = cfg["point"] | "";
+  if (point == "floor" || point == "edge") {
+    // Sensor held over the surface (or over nothing) while this runs
+    long sum = 0;
+    for (int i = 0; i < IR_CAL_SAMPLES; i++) {
+      sum += readLeftIROversampled();
+    }
+    uint16_t level = sum / IR_CAL_SAMPLES;
+    if (point == "floor") surface.floorAdc = level;
+    else surface.edgeAdc = level;
+    
+    // Trip halfway between floor and edge, clear a third of the way up
+    if (surface.floorAdc && surface.edgeAdc > surface.floorAdc) {
+      int span = surface.edgeAdc - surface.floorAdc;
+      surface.onAdc = surface.floorAdc + span / 2;
+      surface.offAdc = surface.floorAdc + span / 3;
+    } else if (surface.floorAdc) {
+      surface.onAdc = min(surface.floorAdc + 2 * IR_HYSTERESIS_ADC, 1023);
+      surface.offAdc = surface.floorAdc + IR_HYSTERESIS_ADC;
+    }
+  }
+  if (cfg["on"].is<int>()) {
+    surface.onAdc = constrain(cfg["on"].as<int>(), 1, 1023);
+  }
+  if (cfg["off"].is<int>()) {
+    surface.offAdc = constrain(cfg["off"].as<int>(), 0, 1023);
+  }
+  surface.offAdc = min(surface.offAdc, surface.onAdc);
+  
+  selectIrSurface(index);
+  saveConfig();
+}
+
+// GPIO3 pin-change ISR: latch a lost surface so loop() reacts on its next pass
+void IRAM_ATTR onIrRightChange() {
+  if ((autonomousMode || macroState == MACRO_RUNNING) && digitalRead(IR_RIGHT_PIN)) {
+    irRightEdgePending = true;
+    pushAlert(isrAlerts, ALERT_IR_EDGE_RIGHT);
+  }
+}
+
+// GPIO3 doubles as UART RX - only call once Serial has been released
+void attachIrRightInterrupt() {
+  pinMode(IR_RIGHT_PIN, INPUT);
+  attachInterrupt(digitalPinToInterrupt(IR_RIGHT_PIN), onIrRightChange, CHANGE);
+}
+
 // ==================== OBSTACLE AVOIDANCE (WITH COOLDOWN) ====================
-void handleObstacles() {
-  if (!autonomousMode) return;  // Only act if autonomous mode enabled
+// A macro drives blind, so its edges are watched in manual mode too
+bool CARBOT_HOT edgeChecksActive() {
+  return autonomousMode || macroState == MACRO_RUNNING;
+}
+
+void CARBOT_HOT handleObstacles() {
+  if (!edgeChecksActive()) return;
+  if (maneuverStep != MANEUVER_IDLE) {
+    irRightEdgePending = false;
+    return;  // Maneuver already running
+  }
   
   // ========== COOLDOWN CHECK - Prevent re-triggering ==========
-  if (millis() - lastObstacleAction < OBSTACLE_COOLDOWN) {
+  // (maneuvers only; a macro restarted at the edge must still stop)
+  if (autonomousMode && millis() - lastObstacleAction < OBSTACLE_COOLDOWN) {
+    irRightEdgePending = false;
     return;  // Still in cooldown period, skip
   }
   
-  readIRSensors();
+  // A0 comes from the 5ms sampler task; GPIO3 counts if it is high now
+  // or went high since the last pass
+  irRightBlocked = irRightEdgePending || digitalRead(IR_RIGHT_PIN);
+  irRightEdgePending = false;
   
   // ==================== ANY SENSOR DETECTS EDGE ====================
   if (irLeftBlocked || irRightBlocked) {
     
     // Set cooldown IMMEDIATELY before maneuver starts
     lastObstacleAction = millis();
+    endMacro(MACRO_PREEMPTED);
     
-    // ========== CALCULATE AVERAGE SPEED ==========
-    int avgSpeed = (abs(leftSpeed) + abs(rightSpeed)) / 2;
-    
-    // ========== SMART BRAKING - Speed-dependent multiplier ==========
-    float brakeMultiplier = (avgSpeed > 65) ? 1.5 : 1.0;
+    // Manual mode: just stop at the edge, the operator takes it from there
+    if (!autonomousMode) {
+      brakeNow();
+      return;
+    }
     
-    int brakeLeft = constrain((int)(-leftSpeed * brakeMultiplier), -100, 100);
-    int brakeRight = constrain((int)(-rightSpeed * brakeMultiplier), -100, 100);
+    // Remember which edge triggered - the response is chosen after braking
+    maneuverLeftEdge = irLeftBlocked;
+    maneuverRightEdge = irRightBlocked;
     
-    setMotorSpeeds(brakeLeft, brakeRight);
-    delay(100);  // Brake for 100ms
-    stopMotors();
-    delay(70);   // Stabilization 70ms
+    // ========== SMART BRAKING - hold longer when fast ==========
+    int avgSpeed = (abs(leftSpeed) + abs(rightSpeed)) / 2;
+    maneuverBrakeMs = (avgSpeed > 65) ? MOTOR_BRAKE_HOLD_MS : MANEUVER_BRAKE_MS;
     
-    // ==================== DETERMINE RESPONSE ====================
-    if (irLeftBlocked && irRightBlocked) {
-      // ========== BOTH EDGES DETECTED ==========
-      publishSensorAlert("no_forward_path", "both");
-      
-      // Continue backing up
-      setMotorSpeeds(-60, -60);
-      delay(500);
-      stopMotors();
+    // Bypasses the ramp - the edge is right there
+    maneuverStep = MANEUVER_BRAKE;
+    maneuverStepStart = millis();
+    brakeNow();
+  }
+}
+
+// ==================== OBSTACLE MANEUVER (NON-BLOCKING) ====================
+// Each step drives the motors once and is advanced by updateManeuver()
+// from loop(), so MQTT keeps being serviced while the bot backs off.
+void beginManeuverStep(ManeuverStep step, int left, int right) {
+  maneuverStep = step;
+  maneuverStepStart = millis();
+  setMotorSpeeds(left, right);
+}
+
+void updateManeuver() {
+  if (maneuverStep == MANEUVER_IDLE) return;
+  
+  unsigned long elapsed = millis() - maneuverStepStart;
+  
+  switch (maneuverStep) {
+    case MANEUVER_BRAKE:
+      if (elapsed >= maneuverBrakeMs) {
+        beginManeuverStep(MANEUVER_SETTLE, 0, 0);  // Stabilization
+      }
+      break;
       
-    } else if (irLeftBlocked && !irRightBlocked) {
-      // ========== LEFT EDGE DETECTED ==========
-      publishSensorAlert("no_surface_left", "left");
+    case MANEUVER_SETTLE:
+      if (elapsed < MANEUVER_SETTLE_MS) break;
       
-      // Turn away: left 60% forward, right 40% backward (differential 20)
-      setMotorSpeeds(60, -40);
-      delay(400);
-      stopMotors();
+      // ==================== DETERMINE RESPONSE ====================
+      if (maneuverLeftEdge && maneuverRightEdge) {
+        // ========== BOTH EDGES DETECTED - back up ==========
+        queueSensorAlert(ALERT_NO_FORWARD_PATH);
+        beginManeuverStep(MANEUVER_BACK_UP, -60, -60);
+        
+      } else if (maneuverLeftEdge) {
+        // ========== LEFT EDGE DETECTED ==========
+        // Turn away: left 60% forward, right 40% backward (differential 20)
+        queueSensorAlert(ALERT_NO_SURFACE_LEFT);
+        beginManeuverStep(MANEUVER_TURN, 60, -40);
+        
+      } else {
+        // ========== RIGHT EDGE DETECTED ==========
+        // Turn away: right 60% forward, left 40% backward (differential 20)
+        queueSensorAlert(ALERT_NO_SURFACE_RIGHT);
+        beginManeuverStep(MANEUVER_TURN, -40, 60);
+      }
+      break;
       
-      // Move forward 400ms
-      setMotorSpeeds(60, 60);
-      delay(400);
-      stopMotors();
+    case MANEUVER_BACK_UP:
+      if (elapsed >= MANEUVER_BACK_UP_MS) {
+        maneuverStep = MANEUVER_IDLE;
+        stopMotors();
+      }
+      break;
       
-    } else if (!irLeftBlocked && irRightBlocked) {
-      // ========== RIGHT EDGE DETECTED ==========
-      publishSensorAlert("no_surface_right", "right");
+    case MANEUVER_TURN:
+      if (elapsed >= MANEUVER_TURN_MS) {
+        beginManeuverStep(MANEUVER_FORWARD, 60, 60);  // Move clear of the edge
+      }
+      break;
       
-      // Turn away: right 60% forward, left 40% backward (differential 20)
-      setMotorSpeeds(-40, 60);
-      delay(400);
-      stopMotors();
+    case MANEUVER_FORWARD:
+      if (elapsed >= MANEUVER_FORWARD_MS) {
+        maneuverStep = MANEUVER_IDLE;
+        stopMotors();
+      }
+      break;
       
-      // Move forward 400ms
-      setMotorSpeeds(60, 60);
-      delay(400);
-      stopMotors();
-    }
-    
-    return;  // Keep monitoring
+    default:
+      break;
   }
 }
 
+// Operator took over mid-maneuver. Leaves the motors to the caller and
+// re-arms edge detection so a still-present edge triggers again at once.
+bool cancelManeuver() {
+  if (maneuverStep == MANEUVER_IDLE) return false;
+  maneuverStep = MANEUVER_IDLE;
+  lastObstacleAction = millis() - OBSTACLE_COOLDOWN;
+  return true;
+}
 
-// ==================== MOTOR CONTROL ====================
-void setMotorSpeeds(int left, int right) {
-  leftSpeed = constrain(left, -100, 100);
-  rightSpeed = constrain(right, -100, 100);
+
+// ==================== MOTION MACROS ====================
+// All-or-nothing: a bad segment leaves the stored program untouched
+bool loadMacro(JsonArray segments) {
+  MacroSegment program[MACRO_MAX_SEGMENTS];
+  int count = 0;
   
-  // ========== LEFT MOTOR ==========
-  int leftPWM;
-  if (leftSpeed > 0) {
-    // Forward - apply minimum threshold + scaling
-    // Map 1-100 to 85-255 (minimum 85 PWM)
-    leftPWM = map(leftSpeed, 1, 100, 85, 255);
-    digitalWrite(IN1_PIN, LOW);
-    digitalWrite(IN2_PIN, HIGH);
-    analogWrite(ENA_PIN, leftPWM);
-    
-  } else if (leftSpeed < 0) {
-    // Backward - apply minimum threshold + scaling
-    // Map -1 to -100 to 85-255 (minimum 85 PWM)
-    leftPWM = map(abs(leftSpeed), 1, 100, 85, 255);
-    digitalWrite(IN1_PIN, HIGH);
-    digitalWrite(IN2_PIN, LOW);
-    analogWrite(ENA_PIN, leftPWM);
-    
-  } else {
-    // Stop (speed = 0)
-    digitalWrite(IN1_PIN, LOW);
-    digitalWrite(IN2_PIN, LOW);
-    analogWrite(ENA_PIN, 0);
-  }
-  
-  // ========== RIGHT MOTOR ==========
-  int rightPWM;
-  if (rightSpeed > 0) {
-    // Forward - apply minimum threshold + scaling
-    rightPWM = map(rightSpeed, 1, 100, 85, 255);
-    digitalWrite(IN3_PIN, HIGH);
-    digitalWrite(IN4_PIN, LOW);
-    analogWrite(ENB_PIN, rightPWM);
-    
-  } else if (rightSpeed < 0) {
-    // Backward - apply minimum threshold + scaling
-    rightPWM = map(abs(rightSpeed), 1, 100, 85, 255);
-    digitalWrite(IN3_PIN, LOW);
-    digitalWrite(IN4_PIN, HIGH);
-    analogWrite(ENB_PIN, rightPWM);
-    
-  } else {
-    // Stop (speed = 0)
-    digitalWrite(IN3_PIN, LOW);
-    digitalWrite(IN4_PIN, LOW);
-    analogWrite(ENB_PIN, 0);
+  for (JsonVariant seg : segments) {
+    if (count >= MACRO_MAX_SEGMENTS || !seg.is<JsonArray>() || seg.size() != 4) return false;
+    int duration = seg[3] | 0;
+    if (duration < MACRO_MIN_SEGMENT_MS || duration > MACRO_MAX_SEGMENT_MS) return false;
+    int servo = seg[2] | 0;
+    program[count].left = constrain(seg[0] | 0, -100, 100);
+    program[count].right = constrain(seg[1] | 0, -100, 100);
+    program[count].servo = servo ? constrain(servo, 60, 180) : 0;
+    program[count].durationMs = duration;
+    count++;
   }
+  if (count == 0) return false;
+  
+  endMacro(MACRO_CANCELLED);
+  memcpy(macroProgram, program, count * sizeof(MacroSegment));
+  macroLength = count;
+  return true;
 }
 
+void applyMacroCommand(JsonVariant cmd) {
+  if (cmd.is<const char*>()) {
+    if (strcmp(cmd.as<const char*>(), "stop") == 0 && macroState == MACRO_RUNNING) {
+      endMacro(MACRO_CANCELLED);
+      stopMotors();
+    }
+    return;
+  }
+  if (!cmd.is<JsonObject>()) return;
+  
+  bool uploaded = false;
+  if (cmd["segments"].is<JsonArray>()) {
+    if (!loadMacro(cmd["segments"])) {
+      macroRejected++;
+      return;
+    }
+    uploaded = true;
+  }
+  if (cmd["repeat"].is<int>()) {
+    macroRepeat = constrain(cmd["repeat"].as<int>(), 0, 255);
+  } else if (uploaded) {
+    macroRepeat = 1;
+  }
+  if (cmd["start"] | uploaded) {
+    startMacro();
+  }
+}
 
-void stopMotors() {
-  setMotorSpeeds(0, 0);
+void startMacro() {
+  if (macroLength == 0) return;
+  stopStreaming();
+  cancelManeuver();
+  macroState = MACRO_RUNNING;
+  macroSegment = 0;
+  macroLoop = 0;
+  macroStartMs = millis();
+  macroSegmentStart = macroStartMs;
+  beginMacroSegment();
 }
 
-void updateServo(int angle) {
-  servoAngle = constrain(angle, 60, 180);  // ← Changed from (0, 180) to (60, 180)
-  servoMotor.write(servoAngle);
+void beginMacroSegment() {
+  const MacroSegment& seg = macroProgram[macroSegment];
+  setMotorSpeeds(seg.left, seg.right);
+  if (seg.servo) updateServo(seg.servo);
+  recordFlightEvent(FLIGHT_MACRO, macroState, macroSegment);
+  macroReportPending = true;
 }
 
-// ==================== MQTT SENSOR ALERT ====================
-void publishSensorAlert(String alertType, String side) {
-  if (!mqttClient.connected() || configMode) return;
+// Leaves the motors to the caller; only a finished run stops them itself
+void endMacro(MacroState reason) {
+  if (macroState != MACRO_RUNNING) return;
+  macroState = reason;
+  recordFlightEvent(FLIGHT_MACRO, macroState, macroSegment);
+  macroReportPending = true;
+}
+
+void updateMacro() {
+  if (macroState != MACRO_RUNNING) return;
   
-  JsonDocument doc;
-  doc["alert_type"] = alertType;
-  doc["side"] = side;
-  doc["timestamp"] = millis();
+  unsigned long now = millis();
+  while (now - macroSegmentStart >= macroProgram[macroSegment].durationMs) {
+    macroSegmentStart += macroProgram[macroSegment].durationMs;
+    if (++macroSegment >= macroLength) {
+      macroSegment = 0;
+      macroLoop++;
+      if (macroRepeat != 0 && macroLoop >= macroRepeat) {
+        macroState = MACRO_DONE;
+        recordFlightEvent(FLIGHT_MACRO, macroState, macroSegment);
+        macroReportPending = true;
+        stopMotors();
+        return;
+      }
+    }
+    beginMacroSegment();
+  }
+}
+
+void publishMacroProgress() {
+  macroReportPending = false;
+  if (!mqttClient.connected() || configMode) return;  // Full status still has it
   
-  String output;
-  serializeJson(doc, output);
-  mqttClient.publish(sensor_topic, output.c_str());
+  telemetryArena.reset();
+  JsonDocument doc(&telemetryArena);
+  doc["state"] = MACRO_STATE_NAMES[macroState];
+  doc["segment"] = macroSegment;
+  doc["segments"] = macroLength;
+  doc["loop"] = macroLoop;
+  doc["repeat"] = macroRepeat;
+  doc["elapsed_ms"] = millis() - macroStartMs;
+  publishTelemetry(macro_topic, doc);
 }
 
-// ==================== EEPROM FUNCTIONS ====================
-// (Keep all existing EEPROM functions - clearEEPROM, loadCredentials, saveCredentials, etc.)
-void clearEEPROM() {
-  if (serialEnabled) Serial.println("Clearing EEPROM...");
-  for (int i = 0; i < 512; i++) {
-    EEPROM.write(i, 0);
+// ==================== FLIGHT RECORDER ====================
+// Picks up a ring that survived the reset, or starts a fresh one
+void loadFlightRecorder() {
+  bool kept = ESP.rtcUserMemoryRead(RTC_FLIGHT_OFFSET, (uint32_t*)&flightHeader, sizeof(flightHeader)) &&
+              flightHeader.magic == FLIGHT_MAGIC && flightHeader.head < FLIGHT_EVENTS &&
+              flightHeader.count <= FLIGHT_EVENTS;
+  if (kept) {
+    flightHeader.boots++;
+  } else {
+    flightHeader = {};
+    flightHeader.magic = FLIGHT_MAGIC;
   }
-  EEPROM.commit();
-  if (serialEnabled) Serial.println("✓ EEPROM cleared");
+  
+  const rst_info* reset = ESP.getResetInfoPtr();
+  flightHeader.resetReason = reset->reason;
+  flightHeader.lastEventMs = millis();  // Time across the reset is unknown
+  memset(flightRecent, 0, sizeof(flightRecent));
+  recordFlightEvent(FLIGHT_BOOT, reset->reason, reset->exccause);
 }
 
-void loadCredentials() {
-  if (serialEnabled) Serial.println("Loading credentials from EEPROM...");
-  int magic = (EEPROM.read(200) << 8) | EEPROM.read(201);
-  if (magic != EEPROM_MAGIC) {
-    if (serialEnabled) Serial.println("No valid credentials found");
-    return;
+void writeFlightHeader() {
+  ESP.rtcUserMemoryWrite(RTC_FLIGHT_OFFSET, (uint32_t*)&flightHeader, sizeof(flightHeader));
+}
+
+void appendFlightEvent(FlightEvent event) {
+  ESP.rtcUserMemoryWrite(RTC_FLIGHT_EVENTS_OFFSET + flightHeader.head, (uint32_t*)&event, sizeof(event));
+  flightHeader.head = (flightHeader.head + 1) % FLIGHT_EVENTS;
+  if (flightHeader.count < FLIGHT_EVENTS) flightHeader.count++;
+  memmove(flightRecent + 1, flightRecent, sizeof(flightRecent) - sizeof(FlightEvent));
+  flightRecent[0] = event;
+  writeFlightHeader();
+}
+
+void CARBOT_HOT recordFlightEvent(uint8_t type, uint8_t a, uint8_t b) {
+  unsigned long now = millis();
+  unsigned long gap = now - flightHeader.lastEventMs;
+  uint8_t dt = gap / FLIGHT_TICK_MS;
+  if (gap >= 255 * FLIGHT_TICK_MS) {
+    uint32_t tenths = min(gap / 100, 65535UL);
+    FlightEvent marker = { FLIGHT_GAP, (uint8_t)tenths, (uint8_t)(tenths >> 8),
+                           (uint8_t)((gap % 100) / FLIGHT_TICK_MS) };
+    appendFlightEvent(marker);
+    dt = 0;
   }
+  flightHeader.lastEventMs = now - gap % FLIGHT_TICK_MS;  // Keep the remainder
   
-  int ssidLength = EEPROM.read(0);
-  if (ssidLength > 0 && ssidLength < 100) {
-    ssid_stored = "";
-    for (int i = 0; i < ssidLength; i++) {
-      ssid_stored += char(EEPROM.read(1 + i));
+  FlightEvent event = { type, a, b, dt };
+  appendFlightEvent(event);
+}
+
+// age 0 is the newest event
+void CARBOT_HOT rewriteRecentFlightEvent(int age) {
+  uint8_t slot = (flightHeader.head + FLIGHT_EVENTS - 1 - age) % FLIGHT_EVENTS;
+  ESP.rtcUserMemoryWrite(RTC_FLIGHT_EVENTS_OFFSET + slot, (uint32_t*)&flightRecent[age], sizeof(FlightEvent));
+}
+
+void CARBOT_HOT recordFlightCommand(uint8_t source) {
+  for (int age = 0; age < FLIGHT_FOLD_DEPTH && age < flightHeader.count; age++) {
+    FlightEvent& recent = flightRecent[age];
+    if (recent.type == FLIGHT_COMMAND && recent.a == source && recent.b < 255) {
+      recent.b++;
+      rewriteRecentFlightEvent(age);
+      return;
     }
   }
-  
-  int passwordLength = EEPROM.read(100);
-  if (passwordLength > 0 && passwordLength < 100) {
-    password_stored = "";
-    for (int i = 0; i < passwordLength; i++) {
-      password_stored += char(EEPROM.read(101 + i));
-    }
+  recordFlightEvent(FLIGHT_COMMAND, source, 0);
+}
+
+void CARBOT_HOT recordFlightSetpoint(int left, int right) {
+  if (flightHeader.count > 0 && flightRecent[0].type == FLIGHT_SETPOINT) {
+    flightRecent[0].a = (uint8_t)left;
+    flightRecent[0].b = (uint8_t)right;
+    rewriteRecentFlightEvent(0);
+    return;
   }
-  
-  int controlPasswordLength = EEPROM.read(300);
-  if (controlPasswordLength > 0 && controlPasswordLength < 50) {
-    control_password_stored = "";
-    for (int i = 0; i < controlPasswordLength; i++) {
-      control_password_stored += char(EEPROM.read(301 + i));
+  recordFlightEvent(FLIGHT_SETPOINT, (uint8_t)left, (uint8_t)right);
+}
+
+void CARBOT_HOT recordFlightOverrun(uint8_t slot, uint32_t runUs) {
+  uint8_t runMs = min(runUs / 1000, (uint32_t)255);
+  for (int age = 0; age < FLIGHT_FOLD_DEPTH && age < flightHeader.count; age++) {
+    FlightEvent& recent = flightRecent[age];
+    if (recent.type == FLIGHT_OVERRUN && (recent.a & 0x0F) == slot && recent.a < 0xF0) {
+      recent.a += 0x10;
+      recent.b = max(recent.b, runMs);
+      rewriteRecentFlightEvent(age);
+      return;
     }
   }
+  recordFlightEvent(FLIGHT_OVERRUN, slot, runMs);
+}
+
+// Two compares per pass; only transitions reach the ring
+void CARBOT_HOT watchFlightState() {
+  uint8_t ir = (irLeftBlocked ? 0x01 : 0) | (irRightBlocked ? 0x02 : 0);
+  if (ir != flightIrBits) {
+    flightIrBits = ir;
+    recordFlightEvent(FLIGHT_IR, ir, 0);
+  }
+  if (maneuverStep != flightManeuver) {
+    flightManeuver = maneuverStep;
+    recordFlightEvent(FLIGHT_MANEUVER, maneuverStep, 0);
+  }
+}
+
+// index 0 is the oldest event
+bool readFlightEvent(int index, FlightEvent* event) {
+  int slot = (flightHeader.head + FLIGHT_EVENTS - flightHeader.count + index) % FLIGHT_EVENTS;
+  return ESP.rtcUserMemoryRead(RTC_FLIGHT_EVENTS_OFFSET + slot, (uint32_t*)event, sizeof(*event));
+}
+
+size_t writeFlightDumpHeader(uint8_t* out) {
+  uint32_t age = millis() - flightHeader.lastEventMs;
+  out[0] = FLIGHT_DUMP_MAGIC;
+  out[1] = FLIGHT_DUMP_VERSION;
+  out[2] = flightHeader.count;
+  out[3] = flightHeader.resetReason;
+  memcpy(out + 4, &flightHeader.boots, 2);
+  memcpy(out + 6, &age, 4);
+  out[10] = FLIGHT_EVENTS;
+  out[11] = 0;
+  return FLIGHT_DUMP_HEADER;
+}
+
+void clearFlightRecorder() {
+  flightHeader.head = 0;
+  flightHeader.count = 0;
+  flightHeader.lastEventMs = millis();
+  memset(flightRecent, 0, sizeof(flightRecent));
+  writeFlightHeader();
+}
+
+// From taskStatus, not the MQTT callback - the client shares its buffer
+void publishFlightDump() {
+  flightDumpPending = false;
+  if (!mqttClient.connected() || configMode) return;
   
-  if (serialEnabled) {
-    Serial.println("✓ Credentials loaded");
-    if (ssid_stored.length() > 0) {
-      Serial.println("  SSID: " + ssid_stored);
+  uint8_t frame[FLIGHT_DUMP_HEADER + FLIGHT_EVENTS * sizeof(FlightEvent)];
+  size_t len = writeFlightDumpHeader(frame);
+  for (int i = 0; i < flightHeader.count; i++) {
+    FlightEvent event;
+    if (!readFlightEvent(i, &event)) break;
+    memcpy(frame + len, &event, sizeof(event));
+    len += sizeof(event);
+  }
+  mqttClient.publish(flight_topic, frame, len);
+}
+
+// GET /flight - same bytes as the MQTT dump, FLIGHT_CHUNK_EVENTS per chunk
+void handleFlight() {
+  server.chunkedResponseModeStart(200, "application/octet-stream");
+  uint8_t chunk[FLIGHT_DUMP_HEADER + FLIGHT_CHUNK_EVENTS * sizeof(FlightEvent)];
+  size_t len = writeFlightDumpHeader(chunk);
+  for (int i = 0; i < flightHeader.count; i++) {
+    FlightEvent event;
+    if (!readFlightEvent(i, &event)) break;
+    memcpy(chunk + len, &event, sizeof(event));
+    len += sizeof(event);
+    if (len + sizeof(event) > sizeof(chunk)) {
+      server.sendContent((const char*)chunk, len);
+      len = 0;
     }
   }
+  if (len > 0) server.sendContent((const char*)chunk, len);
+  server.chunkedResponseFinalize();
 }
 
-void saveCredentials(String ssid, String password) {
-  if (serialEnabled) Serial.println("Saving WiFi credentials to EEPROM...");
-  for (int i = 0; i < 200; i++) {
-    EEPROM.write(i, 0);
+// ==================== LATENCY ECHO ====================
+void setLatencyEcho(bool on) {
+  latencyEcho = on;
+  latencyReceived = 0;
+  latencyApplied = 0;
+}
+
+// Once the seq passed its checks; the newest one wins like the setpoint
+void CARBOT_HOT noteCommandSeq(uint16_t seq) {
+  if (!latencyEcho) return;
+  pendingCommand.hasSeq = true;
+  pendingCommand.seq = seq;
+  pendingCommand.rxUs = latencyRxUs;
+}
+
+void publishLatencyEcho(uint32_t applyUs) {
+  latencyApplied++;
+  if (!mqttClient.connected()) return;
+  
+  uint8_t frame[LATENCY_ECHO_LEN];
+  uint32_t elapsedUs = applyUs - pendingCommand.rxUs;
+  frame[0] = LATENCY_ECHO_MAGIC;
+  frame[1] = LATENCY_ECHO_VERSION;
+  memcpy(frame + 2, &pendingCommand.seq, 2);
+  memcpy(frame + 4, &applyUs, 4);
+  memcpy(frame + 8, &elapsedUs, 4);
+  memcpy(frame + 12, &latencyReceived, 2);
+  memcpy(frame + 14, &latencyApplied, 2);
+  mqttClient.publish(latency_topic, frame, sizeof(frame));
+}
+
+// ==================== MOTOR CONTROL ====================
+// New ramp target; the ramp task moves the motors there
+void CARBOT_HOT setMotorSpeeds(int left, int right) {
+  left = constrain(left, -100, 100);
+  right = constrain(right, -100, 100);
+  if (left != leftTarget || right != rightTarget) {
+    recordFlightSetpoint(left, right);
   }
+  leftTarget = left;
+  rightTarget = right;
   
-  EEPROM.write(0, ssid.length());
-  for (unsigned int i = 0; i < ssid.length(); i++) {
-    EEPROM.write(1 + i, ssid[i]);
+  if (motorBrakeActive) {
+    motorBrakeActive = false;
+    writeMotorOutputs(leftSpeed, rightSpeed);  // Release the short brake
   }
+}
+
+// Step the driven speed toward the targets, limited by accel/brake rates
+void CARBOT_HOT updateMotorRamp() {
+  unsigned long now = millis();
+  unsigned long dt = min(now - lastRampStep, MOTOR_RAMP_MAX_STEP_MS);
+  lastRampStep = now;
+  if (motorBrakeActive) return;  // Held until the next setMotorSpeeds()
   
-  EEPROM.write(100, password.length());
-  for (unsigned int i = 0; i < password.length(); i++) {
-    EEPROM.write(101 + i, password[i]);
+  long* ramps[2] = { &leftRampMilli, &rightRampMilli };
+  const int targets[2] = { leftTarget, rightTarget };
+  for (int i = 0; i < 2; i++) {
+    long current = *ramps[i];
+    long target = targets[i] * 1000L;
+    if (current == target) continue;
+    
+    // Moving away from zero accelerates; toward or through zero brakes
+    bool accelerating = (current >= 0 && target > current) ||
+                        (current <= 0 && target < current);
+    long step = (long)(accelerating ? motorAccelRate : motorBrakeRate) * (long)dt;
+    
+    if (accelerating) {
+      current = (target > current) ? min(current + step, target) : max(current - step, target);
+    } else if (target > current) {
+      // Stop at zero first, the next step accelerates the other way
+      long limit = (current < 0 && target > 0) ? 0 : target;
+      current = min(current + step, limit);
+    } else {
+      long limit = (current > 0 && target < 0) ? 0 : target;
+      current = max(current - step, limit);
+    }
+    *ramps[i] = current;
   }
   
-  EEPROM.write(200, (EEPROM_MAGIC >> 8) & 0xFF);
-  EEPROM.write(201, EEPROM_MAGIC & 0xFF);
-  EEPROM.commit();
+  int left = (int)(leftRampMilli / 1000);
+  int right = (int)(rightRampMilli / 1000);
+  if (left != leftSpeed || right != rightSpeed) {
+    writeMotorOutputs(left, right);
+  }
+}
+
+// Emergency stop: skip the ramp and short both motor terminals (IN high,
+// EN full) so the wheels stop in a few ms instead of coasting
+void CARBOT_HOT brakeNow() {
+  leftTarget = rightTarget = 0;
+  leftRampMilli = rightRampMilli = 0;
+  leftSpeed = rightSpeed = 0;
+  motorBrakeActive = true;
+  motorBrakeNowCount++;
   
-  ssid_stored = ssid;
-  password_stored = password;
-  if (serialEnabled) Serial.println("✓ WiFi credentials saved");
+  applyBridgeState(MOTOR_DIR_MASK, 255, 255);
 }
 
-void saveControlPassword(String password) {
-  if (serialEnabled) Serial.println("Saving control password to EEPROM...");
-  EEPROM.write(300, password.length());
-  for (unsigned int i = 0; i < password.length(); i++) {
-    EEPROM.write(301 + i, password[i]);
+void applyRampConfig(JsonObject cfg) {
+  if (cfg["accel"].is<int>()) {
+    motorAccelRate = constrain(cfg["accel"].as<int>(), 50, 10000);
+  }
+  if (cfg["brake"].is<int>()) {
+    motorBrakeRate = constrain(cfg["brake"].as<int>(), 50, 10000);
+  }
+}
+
+// Drive the H-bridge directly - only the ramp and brakeNow() call this
+void CARBOT_HOT writeMotorOutputs(int left, int right) {
+  leftSpeed = constrain(left, -100, 100);
+  rightSpeed = constrain(right, -100, 100);
+  
+  // Left forward = IN1 low/IN2 high, right forward = IN3 high/IN4 low
+  uint32_t high = 0;
+  if (leftSpeed > 0) high |= bit(IN2_PIN);
+  else if (leftSpeed < 0) high |= bit(IN1_PIN);
+  if (rightSpeed > 0) high |= bit(IN3_PIN);
+  else if (rightSpeed < 0) high |= bit(IN4_PIN);
+  
+  applyBridgeState(high, motorDuty[MOTOR_LEFT].duty[abs(leftSpeed)],
+                   motorDuty[MOTOR_RIGHT].duty[abs(rightSpeed)]);
+}
+
+// Only touches what differs from the cached state. GPIO0-15 change in one
+// GPOS/GPOC store each; GPIO16 lives in the RTC block and needs its own.
+void CARBOT_HOT applyBridgeState(uint32_t highPins, uint8_t leftDuty, uint8_t rightDuty) {
+  uint32_t changed = (highPins ^ bridge.highPins) & MOTOR_DIR_MASK;
+  if (changed) {
+    uint32_t set = changed & highPins;
+    uint32_t clear = changed & ~highPins;
+    if (clear & 0xFFFF) GPOC = clear & 0xFFFF;
+    if (set & 0xFFFF) GPOS = set & 0xFFFF;
+    if (changed & bit(16)) digitalWrite(16, (highPins & bit(16)) ? HIGH : LOW);
+    bridge.highPins = highPins;
+    bridge.pinUpdates++;
+  }
+  // analogWrite() restarts the software PWM cycle - skip it when unchanged
+  if (leftDuty != bridge.leftDuty) {
+    analogWrite(ENA_PIN, leftDuty);
+    bridge.leftDuty = leftDuty;
+    bridge.pwmUpdates++;
+  }
+  if (rightDuty != bridge.rightDuty) {
+    analogWrite(ENB_PIN, rightDuty);
+    bridge.rightDuty = rightDuty;
+    bridge.pwmUpdates++;
+  }
+}
+
+// Lowest duty that still turns the wheel; speed 1-100 maps onto min-255
+void setMotorDeadband(int motor, int minDuty) {
+  minDuty = constrain(minDuty, 0, 254);
+  motorDuty[motor] = makeDutyTable(minDuty);
+  motorMinDuty[motor] = minDuty;
+  writeMotorOutputs(leftSpeed, rightSpeed);  // Re-apply at the new scale
+}
+
+void applyMotorCalibration(JsonObject cfg) {
+  if (cfg["left_min"].is<int>()) {
+    setMotorDeadband(MOTOR_LEFT, cfg["left_min"].as<int>());
+  }
+  if (cfg["right_min"].is<int>()) {
+    setMotorDeadband(MOTOR_RIGHT, cfg["right_min"].as<int>());
+  }
+  config.motorMinDuty[MOTOR_LEFT] = motorMinDuty[MOTOR_LEFT];
+  config.motorMinDuty[MOTOR_RIGHT] = motorMinDuty[MOTOR_RIGHT];
+  saveConfig();
+}
+
+
+void stopMotors() {
+  setMotorSpeeds(0, 0);
+}
+
+void updateServo(int angle) {
+  angle = constrain(angle, SERVO_MIN_ANGLE, SERVO_MAX_ANGLE);
+  if (angle != servoAngle) recordFlightEvent(FLIGHT_SERVO, angle, 0);
+  servoAngle = angle;
+  if (servoAngle * 1000L == servoPosMilli && servoVelMilli == 0) return;
+  
+  if (servoSettled) lastServoStep = millis();  // No stale dt on the first step
+  servoSettled = false;
+  if (!servoMotor.attached()) {
+    servoMotor.attach(SERVO_PIN, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
+    servoPulseUs = -1;
+    writeServoPulse();  // Resume from where the head was left
+  }
+}
+
+// Step the driven angle toward servoAngle, limited by speed and accel
+void updateServoProfile() {
+  unsigned long now = millis();
+  if (servoSettled) {
+    if (servoDetachMs && servoMotor.attached() && now - servoSettledSince >= servoDetachMs) {
+      servoMotor.detach();
+      servoDetaches++;
+    }
+    return;
+  }
+  
+  long dt = (long)min(now - lastServoStep, SERVO_MAX_STEP_MS);
+  lastServoStep = now;
+  long target = servoAngle * 1000L;
+  long error = target - servoPosMilli;
+  int dir = (error > 0) ? 1 : -1;
+  long dv = (long)servoAccel * dt;  // 1/1000 deg/s gained per step
+  
+  // Brake when still heading away or when the stopping distance is used up
+  long long stopDist = (long long)servoVelMilli * servoVelMilli / (2000LL * servoAccel);
+  if (servoVelMilli * dir < 0 || labs(error) <= stopDist) {
+    long slow = min(dv, labs(servoVelMilli));
+    servoVelMilli += (servoVelMilli > 0) ? -slow : slow;
+  } else {
+    servoVelMilli = constrain(servoVelMilli + dir * dv, -servoMaxSpeed * 1000L, servoMaxSpeed * 1000L);
+  }
+  servoPosMilli += servoVelMilli * dt / 1000;
+  
+  if ((dir > 0 && servoPosMilli >= target) || (dir < 0 && servoPosMilli <= target) || error == 0) {
+    servoPosMilli = target;
+    servoVelMilli = 0;
+    servoSettled = true;
+    servoSettledSince = now;
+  }
+  writeServoPulse();
+}
+
+// Only an actual pulse change reaches the library
+void writeServoPulse() {
+  int us = SERVO_MIN_PULSE_US +
+           (int)(servoPosMilli * (SERVO_MAX_PULSE_US - SERVO_MIN_PULSE_US) / 180000L);
+  if (us == servoPulseUs || !servoMotor.attached()) return;
+  servoMotor.writeMicroseconds(us);
+  servoPulseUs = us;
+}
+
+void applyServoProfileConfig(JsonObject cfg) {
+  if (cfg["speed"].is<int>()) {
+    servoMaxSpeed = constrain(cfg["speed"].as<int>(), 10, 1000);
+  }
+  if (cfg["accel"].is<int>()) {
+    servoAccel = constrain(cfg["accel"].as<int>(), 50, 20000);
+  }
+  if (cfg["detach_ms"].is<int>()) {
+    servoDetachMs = constrain(cfg["detach_ms"].as<int>(), 0, 10000);
+  }
+}
+
+// ==================== MQTT SENSOR ALERT ====================
+// Safe from the ISR: touches only the ring and never waits. A full ring
+// drops the new event - the ones already queued cover the same edge.
+bool IRAM_ATTR pushAlert(AlertQueue& queue, AlertType type) {
+  uint8_t head = queue.head;
+  uint8_t next = (head + 1) & (ALERT_QUEUE_SIZE - 1);
+  if (next == __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE)) {
+    queue.dropped++;
+    return false;
+  }
+  queue.events[head].type = type;
+  queue.events[head].ms = millis();
+  __atomic_store_n(&queue.head, next, __ATOMIC_RELEASE);  // Publish the slot
+  return true;
+}
+
+void queueSensorAlert(AlertType type) {
+  pushAlert(loopAlerts, type);
+}
+
+void drainAlertQueue(AlertQueue& queue) {
+  uint8_t tail = queue.tail;
+  uint8_t head = __atomic_load_n(&queue.head, __ATOMIC_ACQUIRE);
+  
+  while (tail != head) {
+    const AlertEvent& event = queue.events[tail];
+    if (event.type < ALERT_TYPE_COUNT) {
+      AlertSlot& slot = alertSlots[event.type];
+      if (slot.count == 0) {
+        slot.firstMs = event.ms;
+      } else {
+        alertsCoalesced++;
+      }
+      if (slot.count < 0xFFFF) slot.count++;
+      slot.lastMs = event.ms;
+    }
+    tail = (tail + 1) & (ALERT_QUEUE_SIZE - 1);
+  }
+  __atomic_store_n(&queue.tail, tail, __ATOMIC_RELEASE);
+}
+
+void publishSensorAlert(AlertType type, const AlertSlot& slot) {
+  telemetryArena.reset();
+  JsonDocument doc(&telemetryArena);
+  doc["alert_type"] = ALERT_INFO[type].type;
+  doc["side"] = ALERT_INFO[type].side;
+  doc["timestamp"] = slot.lastMs;
+  doc["count"] = slot.count;  // Events folded into this alert
+  if (slot.count > 1) doc["first_ms"] = slot.firstMs;
+  
+  publishTelemetry(sensor_topic, doc);
+}
+
+// Pending alerts survive a disconnect and go out, still coalesced, once
+// MQTT is back
+void publishPendingAlerts() {
+  drainAlertQueue(isrAlerts);
+  drainAlertQueue(loopAlerts);
+  if (!mqttClient.connected() || configMode) return;
+  
+  unsigned long now = millis();
+  for (uint8_t type = 0; type < ALERT_TYPE_COUNT; type++) {
+    AlertSlot& slot = alertSlots[type];
+    if (slot.count == 0) continue;
+    if (slot.everPublished && now - slot.lastPublishMs < ALERT_COALESCE_MS) continue;
+    
+    if ((size_t)espClient.availableForWrite() < ALERT_MIN_SEND_ROOM) {
+      alertBackpressureWaits++;
+      return;  // Keep coalescing until the socket drains
+    }
+    publishSensorAlert((AlertType)type, slot);
+    alertsPublished++;
+    slot.count = 0;
+    slot.lastPublishMs = now;
+    slot.everPublished = true;
+  }
+}
+
+// ==================== SENSOR RECORDING ====================
+void setSensorRecording(bool on, unsigned long flushMs) {
+  sensorFlushMs = constrain(flushMs, 50UL, 5000UL);
+  if (on && !sensorRecording) {
+    sensorRingHead = 0;
+    sensorRingCount = 0;
+    sensorDroppedSinceBatch = 0;
+    lastSensorFlush = millis();
+  }
+  sensorRecording = on;
+}
+
+void recordSensorSample() {
+  if (sensorRingCount == SENSOR_RING_SIZE) {
+    // Full: overwrite the oldest
+    sensorRingHead = (sensorRingHead + 1) % SENSOR_RING_SIZE;
+    sensorRingCount--;
+    sensorSamplesDropped++;
+    if (sensorDroppedSinceBatch < 255) sensorDroppedSinceBatch++;
+  }
+  
+  uint16_t level = constrain(irFiltered / IR_FILTER_SCALE, 0, 1023);
+  if (irLeftBlocked) level |= SENSOR_LEVEL_LEFT_BLOCKED;
+  if (digitalRead(IR_RIGHT_PIN)) level |= SENSOR_LEVEL_RIGHT_PIN;
+  if (irRightBlocked || irRightEdgePending) level |= SENSOR_LEVEL_RIGHT_BLOCKED;
+  
+  SensorSample& sample = sensorRing[(sensorRingHead + sensorRingCount) % SENSOR_RING_SIZE];
+  sample.ms = millis();
+  sample.level = level;
+  sample.left = leftSpeed;
+  sample.right = rightSpeed;
+  sensorRingCount++;
+}
+
+// Packs as many of the oldest samples as fit into sensorBatch
+size_t encodeSensorBatch(uint16_t& samplesUsed) {
+  size_t len = SENSOR_BATCH_HEADER;
+  uint32_t previousMs = sensorRing[sensorRingHead].ms;
+  samplesUsed = 0;
+  
+  while (samplesUsed < sensorRingCount && samplesUsed < 255 &&
+         len + SENSOR_SAMPLE_MAX_BYTES <= SENSOR_BATCH_BYTES) {
+    const SensorSample& sample = sensorRing[(sensorRingHead + samplesUsed) % SENSOR_RING_SIZE];
+    uint32_t delta = sample.ms - previousMs;
+    previousMs = sample.ms;
+    do {
+      uint8_t b = delta & 0x7F;
+      delta >>= 7;
+      sensorBatch[len++] = delta ? (b | 0x80) : b;
+    } while (delta);
+    sensorBatch[len++] = sample.level & 0xFF;
+    sensorBatch[len++] = sample.level >> 8;
+    sensorBatch[len++] = (uint8_t)sample.left;
+    sensorBatch[len++] = (uint8_t)sample.right;
+    samplesUsed++;
+  }
+  
+  uint32_t firstMs = sensorRing[sensorRingHead].ms;
+  sensorBatch[0] = SENSOR_BATCH_MAGIC;
+  sensorBatch[1] = SENSOR_BATCH_VERSION;
+  sensorBatch[2] = samplesUsed;
+  sensorBatch[3] = sensorDroppedSinceBatch;
+  memcpy(sensorBatch + 4, &firstMs, sizeof(firstMs));
+  return len;
+}
+
+void flushSensorBatch() {
+  if (sensorRingCount == 0 || !mqttClient.connected() || configMode) return;
+  
+  uint16_t used;
+  size_t len = encodeSensorBatch(used);
+  
+  // Backpressure: leave the samples in the ring until TCP has room
+  if ((size_t)espClient.availableForWrite() < len + strlen(sensor_topic) + 8) {
+    sensorBackpressureWaits++;
+    return;
+  }
+  if (!mqttClient.publish(sensor_topic, sensorBatch, len)) return;
+  
+  sensorRingHead = (sensorRingHead + used) % SENSOR_RING_SIZE;
+  sensorRingCount -= used;
+  sensorDroppedSinceBatch = 0;
+  sensorBatchesSent++;
+}
+
+// Serialize into the static buffer; drop the message rather than truncate it
+bool publishTelemetry(const char* topic, JsonDocument& doc) {
+  if (doc.overflowed()) return false;
+  
+  // serializeJson silently truncates to the buffer, so measure first
+  if (measureJson(doc) >= sizeof(telemetryBuffer)) {
+    telemetryOversize++;
+    return false;
+  }
+  size_t len = serializeJson(doc, telemetryBuffer, sizeof(telemetryBuffer));
+  if (len == 0) return false;
+  
+  return mqttClient.publish(topic, (const uint8_t*)telemetryBuffer, len);
+}
+
+// ==================== EEPROM FUNCTIONS ====================
+void clearEEPROM() {
+  if (serialEnabled) Serial.println("Clearing EEPROM...");
+  config = defaultConfig();
+  saveConfig();
+  if (serialEnabled) Serial.println("✓ EEPROM cleared");
+}
+
+StoredConfig defaultConfig() {
+  StoredConfig defaults = {};
+  defaults.header.magic = CONFIG_MAGIC;
+  defaults.header.version = CONFIG_VERSION;
+  defaults.header.size = sizeof(StoredConfig) - sizeof(ConfigHeader);
+  strncpy(defaults.controlPassword, "1234", sizeof(defaults.controlPassword) - 1);
+  for (int i = 0; i < IR_SURFACE_COUNT; i++) {
+    defaults.irSurfaces[i].onAdc = IR_THRESHOLD_ADC;
+    defaults.irSurfaces[i].offAdc = IR_THRESHOLD_ADC - IR_HYSTERESIS_ADC;
+  }
+  defaults.motorMinDuty[MOTOR_LEFT] = MOTOR_DEFAULT_MIN_DUTY;
+  defaults.motorMinDuty[MOTOR_RIGHT] = MOTOR_DEFAULT_MIN_DUTY;
+  strncpy(defaults.brokers[0].host, mqtt_server, sizeof(defaults.brokers[0].host) - 1);
+  defaults.brokers[0].port = mqtt_port;
+  defaults.preferredBroker = MQTT_BROKER_NONE;
+  defaults.mdnsDiscovery = 1;
+  defaults.idleTimeoutS = POWER_DEFAULT_IDLE_S;
+  defaults.wakeLatencyMs = POWER_DEFAULT_LATENCY_MS;
+  return defaults;
+}
+
+uint32_t configCrc(const StoredConfig& cfg, uint16_t size) {
+  return crc32((const uint8_t*)&cfg + sizeof(ConfigHeader), size);
+}
+
+bool loadConfig() {
+  StoredConfig stored;
+  EEPROM.get(CONFIG_EEPROM_ADDR, stored);
+  const uint16_t payloadSize = sizeof(StoredConfig) - sizeof(ConfigHeader);
+  
+  config = defaultConfig();
+  if (stored.header.magic != CONFIG_MAGIC || stored.header.size == 0 ||
+      stored.header.size > payloadSize ||
+      configCrc(stored, stored.header.size) != stored.header.crc) {
+    return false;
+  }
+  
+  // Older blob: take what it has, the rest stays at the defaults
+  memcpy((uint8_t*)&config + sizeof(ConfigHeader),
+         (const uint8_t*)&stored + sizeof(ConfigHeader), stored.header.size);
+  config.ssid[sizeof(config.ssid) - 1] = '\0';
+  config.wifiPassword[sizeof(config.wifiPassword) - 1] = '\0';
+  config.controlPassword[sizeof(config.controlPassword) - 1] = '\0';
+  for (int i = 0; i < MQTT_BROKER_SLOTS; i++) {
+    config.brokers[i].host[sizeof(config.brokers[i].host) - 1] = '\0';
+  }
+  config.deviceName[sizeof(config.deviceName) - 1] = '\0';
+  for (int i = 0; i < FLEET_MAX_GROUPS; i++) {
+    config.groups[i][FLEET_GROUP_LEN - 1] = '\0';
+  }
+  return true;
+}
+
+// Commits only when the bytes in flash would actually change
+bool saveConfig() {
+  config.header.magic = CONFIG_MAGIC;
+  config.header.version = CONFIG_VERSION;
+  config.header.size = sizeof(StoredConfig) - sizeof(ConfigHeader);
+  config.header.crc = configCrc(config, config.header.size);
+  
+  if (memcmp(EEPROM.getConstDataPtr() + CONFIG_EEPROM_ADDR, &config, sizeof(config)) == 0) {
+    return false;
+  }
+  EEPROM.put(CONFIG_EEPROM_ADDR, config);
+  EEPROM.commit();
+  configCommits++;
+  return true;
+}
+
+// One-time import of the v3.0 layout (SSID @0, WiFi pass @100, magic @200,
+// control pass @300); saved back in the new format by loadCredentials()
+bool loadLegacyConfig() {
+  int magic = (EEPROM.read(LEGACY_MAGIC_ADDR) << 8) | EEPROM.read(LEGACY_MAGIC_ADDR + 1);
+  if (magic != EEPROM_MAGIC) return false;
+  
+  const uint8_t* data = EEPROM.getConstDataPtr();
+  int ssidLength = data[0];
+  if (ssidLength > 0 && ssidLength < (int)sizeof(config.ssid)) {
+    memcpy(config.ssid, data + 1, ssidLength);
+  }
+  int passwordLength = data[100];
+  if (passwordLength > 0 && passwordLength < (int)sizeof(config.wifiPassword)) {
+    memcpy(config.wifiPassword, data + 101, passwordLength);
+  }
+  int controlPasswordLength = data[300];
+  if (controlPasswordLength > 0 && controlPasswordLength < (int)sizeof(config.controlPassword)) {
+    memset(config.controlPassword, 0, sizeof(config.controlPassword));
+    memcpy(config.controlPassword, data + 301, controlPasswordLength);
+  }
+  return true;
+}
+
+// Push the loaded config into the runtime state
+void applyConfig() {
+  ssid_stored = config.ssid;
+  password_stored = config.wifiPassword;
+  control_password_stored = config.controlPassword;
+  updateControlFrameKey();
+  
+  selectIrSurface(config.irActiveSurface);
+  setMotorDeadband(MOTOR_LEFT, config.motorMinDuty[MOTOR_LEFT]);
+  setMotorDeadband(MOTOR_RIGHT, config.motorMinDuty[MOTOR_RIGHT]);
+  buildFleetTopics();
+}
+
+void loadCredentials() {
+  if (serialEnabled) Serial.println("Loading credentials from EEPROM...");
+  if (!loadConfig()) {
+    if (loadLegacyConfig()) {
+      if (serialEnabled) Serial.println("Migrating v3.0 EEPROM layout");
+      saveConfig();
+    } else {
+      if (serialEnabled) Serial.println("No valid credentials found");
+    }
+  }
+  if (config.sessionSecretSource == SESSION_SECRET_NONE) {
+    deriveSessionSecret();  // Once, for a config saved before v7
+    saveConfig();
+  }
+  applyConfig();
+  
+  if (serialEnabled) {
+    Serial.println("✓ Credentials loaded");
+    if (ssid_stored.length() > 0) {
+      Serial.println("  SSID: " + ssid_stored);
+    }
+  }
+}
+
+void saveCredentials(String ssid, String password) {
+  if (serialEnabled) Serial.println("Saving WiFi credentials to EEPROM...");
+  memset(config.ssid, 0, sizeof(config.ssid));
+  memset(config.wifiPassword, 0, sizeof(config.wifiPassword));
+  strncpy(config.ssid, ssid.c_str(), sizeof(config.ssid) - 1);
+  strncpy(config.wifiPassword, password.c_str(), sizeof(config.wifiPassword) - 1);
+  saveConfig();
+  
+  ssid_stored = config.ssid;
+  password_stored = config.wifiPassword;
+  if (serialEnabled) Serial.println("✓ WiFi credentials saved");
+}
+
+void saveControlPassword(String password) {
+  if (serialEnabled) Serial.println("Saving control password to EEPROM...");
+  memset(config.controlPassword, 0, sizeof(config.controlPassword));
+  strncpy(config.controlPassword, password.c_str(), sizeof(config.controlPassword) - 1);
+  if (config.sessionSecretSource != SESSION_SECRET_PROVISIONED) deriveSessionSecret();
+  saveConfig();
+  control_password_stored = config.controlPassword;
+  updateControlFrameKey();
+  clearAuthSessions();  // Keys were derived from the old password
+  if (serialEnabled) Serial.println("✓ Control password saved");
+}
+
+// Constant time over the whole stored buffer, no String copy
+bool validateControlPassword(const char* password) {
+  uint8_t diff = 0;
+  bool ended = false;
+  for (size_t i = 0; i < sizeof(config.controlPassword); i++) {
+    uint8_t c = ended ? 0 : (uint8_t)password[i];
+    if (c == 0) ended = true;
+    diff |= c ^ (uint8_t)config.controlPassword[i];
+  }
+  return ended && diff == 0;
+}
+
+// Pad the password into an HMAC key once so each frame only costs the
+// two compressions over its 8 bytes
+void updateControlFrameKey() {
+  br_hmac_key_init(&controlFrameKey, &br_sha256_vtable,
+                   control_password_stored.c_str(), control_password_stored.length());
+}
+
+uint32_t CARBOT_HOT computeFrameTag(const byte* frame) {
+  uint32_t tag;
+  br_hmac_context hmac;
+  br_hmac_init(&hmac, &controlFrameKey, sizeof(tag));
+  br_hmac_update(&hmac, frame, offsetof(CommandFrame, tag));
+  br_hmac_out(&hmac, &tag);  // Leading bytes, read little-endian like the frame
+  return tag;
+}
+
+// ==================== MQTT FUNCTIONS ====================
+void setupMQTT() {
+  mqttClient.setServer(mqtt_server, mqtt_port);  // Replaced per attempt by useBroker()
+  mqttClient.setCallback(mqttCallback);
+  mqttClient.setBufferSize(MQTT_BUFFER_SIZE);  // One-time allocation
+  mqttClient.setSocketTimeout(MQTT_SOCKET_TIMEOUT_S);
+  espClient.setTimeout(MQTT_CONNECT_TIMEOUT_MS);
+}
+
+// One connect attempt per call at most; failures back off exponentially
+// with jitter so loop() keeps its timing while the broker is down. An
+// attempt blocks (DNS, TCP, CONNACK). Losing the link in manual drive
+// stops the motors first and the attempt waits until they have ramped
+// down. A bot that is still driving itself (stream over UDP, autonomous,
+// macro) keeps attempting, but only from a cached address and with the
+// shorter CONNACK wait, so each attempt blocks for about 2 s at most.
+void reconnectMQTT() {
+  if (configMode) return;
+  
+  unsigned long now = millis();
+  if (!mqttOutage) {
+    recordFlightEvent(FLIGHT_LINK, FLIGHT_MQTT_LOST, (uint8_t)mqttClient.state());
+    mqttOutage = true;
+    mqttOutageStart = now;
+    mqttBackoffMs = MQTT_BACKOFF_MIN_MS;
+    mqttNextAttempt = now;
+    if (streamState == STREAM_OFF && !autonomousMode && macroState != MACRO_RUNNING) {
+      stopMotors();  // That was the operator's link - don't drive on blind
+    }
+  }
+  if ((long)(now - mqttNextAttempt) < 0) return;
+  bool moving = leftSpeed != 0 || rightSpeed != 0;
+  if (moving && leftTarget == 0 && rightTarget == 0) return;  // Still ramping down
+  
+  int broker = nextBrokerCandidate();
+  if (broker < 0) {  // No broker configured or found yet
+    if (!moving && millis() - lastMdnsQuery >= MDNS_REDISCOVER_MS) {
+      discoverMqttBroker();
+    }
+    return;
+  }
+  if (moving && broker != MQTT_BROKER_MDNS && !brokerStats[broker].ip.isSet()) {
+    return;  // DNS waits until parked
+  }
+  bool resolved = useBroker(broker);
+  
+  String clientId = String(deviceId) + "_" + String(random(0xffff), HEX);
+  mqttClient.setSocketTimeout(moving ? MQTT_MOVING_SOCKET_TIMEOUT_S : MQTT_SOCKET_TIMEOUT_S);
+  unsigned long attemptStart = millis();
+  bool connected = resolved && mqttClient.connect(clientId.c_str(), mqtt_user, mqtt_password);
+  recordBrokerResult(broker, connected, millis() - attemptStart);
+  
+  if (connected) {
+    subscribeFleetTopics();
+    recordFlightEvent(FLIGHT_LINK, FLIGHT_MQTT_UP, broker);
+    
+    if (!mqttEverConnected) {
+      bootToMqttMs = millis();
+    }
+    char online[96];
+    snprintf(online, sizeof(online),
+             "{\"status\":\"online\",\"boot_ms\":%lu,\"wifi_fast\":%s}",
+             bootToMqttMs, wifiFastConnected ? "true" : "false");
+    mqttClient.publish(status_topic, online);
+    
+    if (mqttEverConnected) {
+      mqttReconnectCount++;
+      mqttLastReconnectMs = millis() - mqttOutageStart;
+    }
+    mqttEverConnected = true;
+    mqttOutage = false;
+    mqttBackoffMs = MQTT_BACKOFF_MIN_MS;
+  } else {
+    mqttFailedAttempts++;
+    if (nextBrokerCandidate() >= 0) {
+      mqttNextAttempt = millis();  // Try the next broker on the next pass
+      return;
+    }
+    
+    // Whole round failed: back off, then start over from the preferred one
+    // with fresh DNS answers
+    brokerRoundTried = 0;
+    for (int i = 0; i < MQTT_BROKER_SLOTS && !moving; i++) {
+      brokerStats[i].ip = IPAddress();
+    }
+    if (!moving && millis() - lastMdnsQuery >= MDNS_REDISCOVER_MS) {
+      discoverMqttBroker();
+    }
+    // Equal jitter: wait between half and all of the current backoff
+    unsigned long wait = mqttBackoffMs / 2 + random(mqttBackoffMs / 2 + 1);
+    mqttNextAttempt = millis() + wait;
+    mqttBackoffMs = min(mqttBackoffMs * 2, MQTT_BACKOFF_MAX_MS);
+  }
+}
+
+// ==================== BROKER SELECTION ====================
+bool staticBrokerConfigured() {
+  for (int i = 0; i < MQTT_BROKER_SLOTS; i++) {
+    if (brokerAvailable(i)) return true;
+  }
+  return false;
+}
+
+bool brokerAvailable(int broker) {
+  if (broker == MQTT_BROKER_MDNS) return mdnsBrokerPort != 0;
+  return broker >= 0 && broker < MQTT_BROKER_SLOTS && config.brokers[broker].host[0] != '\0';
+}
+
+// Preferred broker first, then the fastest known (fewest failures among
+// equals); -1 when the round is done
+int nextBrokerCandidate() {
+  int preferred = config.preferredBroker;
+  if (brokerAvailable(preferred) && !(brokerRoundTried & bit(preferred))) {
+    return preferred;
+  }
+  
+  int best = -1;
+  uint32_t bestLatency = 0;
+  for (int i = 0; i < MQTT_BROKER_COUNT; i++) {
+    if (!brokerAvailable(i) || (brokerRoundTried & bit(i))) continue;
+    uint32_t latency = brokerStats[i].latencyMs ? brokerStats[i].latencyMs : UINT32_MAX;
+    if (best < 0 || latency < bestLatency ||
+        (latency == bestLatency && brokerStats[i].failures < brokerStats[best].failures)) {
+      best = i;
+      bestLatency = latency;
+    }
+  }
+  return best;
+}
+
+// Connects by address so connect() never does DNS; false = name didn't resolve
+bool useBroker(int broker) {
+  currentBroker = broker;
+  brokerRoundTried |= bit(broker);
+  if (broker == MQTT_BROKER_MDNS) {
+    mqttClient.setServer(mdnsBrokerIp, mdnsBrokerPort);
+    return true;
+  }
+  
+  BrokerStats& stats = brokerStats[broker];
+  if (!stats.ip.isSet()) {
+    IPAddress ip;
+    if (!WiFi.hostByName(config.brokers[broker].host, ip, MQTT_DNS_TIMEOUT_MS)) return false;
+    stats.ip = ip;
+  }
+  mqttClient.setServer(stats.ip, config.brokers[broker].port);
+  return true;
+}
+
+void recordBrokerResult(int broker, bool connected, uint32_t latencyMs) {
+  BrokerStats& stats = brokerStats[broker];
+  if (!connected) {
+    stats.failures++;
+    return;
+  }
+  
+  latencyMs = max(latencyMs, (uint32_t)1);
+  stats.latencyMs = stats.latencyMs ? (stats.latencyMs * 3 + latencyMs) / 4 : latencyMs;
+  stats.failures = 0;
+  brokerRoundTried = 0;
+  
+  // Sticky: only switch when the preferred one is gone or 25% slower
+  int preferred = config.preferredBroker;
+  bool switchPreference = !brokerAvailable(preferred) ||
+                          brokerStats[preferred].latencyMs == 0 ||
+                          stats.latencyMs * 4 < brokerStats[preferred].latencyMs * 3;
+  if (broker != preferred && switchPreference) {
+    config.preferredBroker = broker;
+    saveConfig();
+  }
+}
+
+// Looks for _mqtt._tcp on the LAN; blocks for the query (about a second)
+bool discoverMqttBroker() {
+  if (!config.mdnsDiscovery || !wifiReady) return false;
+  lastMdnsQuery = millis();
+  
+  if (!mdnsStarted) {
+    char hostname[24];
+    snprintf(hostname, sizeof(hostname), "carbot-%06x", ESP.getChipId());
+    mdnsStarted = MDNS.begin(hostname);
+    if (!mdnsStarted) return false;
+  }
+  
+  int found = MDNS.queryService("mqtt", "tcp");
+  if (found <= 0) return false;
+  
+  IPAddress ip = MDNS.IP(0);
+  uint16_t port = MDNS.port(0);
+  if (ip != mdnsBrokerIp || port != mdnsBrokerPort) {
+    brokerStats[MQTT_BROKER_MDNS] = {};  // Different broker, forget its history
+  }
+  mdnsBrokerIp = ip;
+  mdnsBrokerPort = port;
+  return true;
+}
+
+// "host" or "host:port"; empty text clears the slot
+bool parseBrokerEntry(const String& text, BrokerEntry& entry) {
+  const char* value = text.c_str();
+  const char* colon = strrchr(value, ':');
+  size_t hostLength = colon ? (size_t)(colon - value) : strlen(value);
+  long port = colon ? atol(colon + 1) : 1883;
+  if (hostLength >= sizeof(entry.host) || port <= 0 || port > 65535) return false;
+  
+  memset(&entry, 0, sizeof(entry));
+  memcpy(entry.host, value, hostLength);
+  entry.port = hostLength ? port : 0;
+  return true;
+}
+
+// {"list": ["host:port", ...], "mdns": bool} - applies from the next connect
+void applyBrokerConfig(JsonObject cfg) {
+  if (cfg["list"].is<JsonArray>()) {
+    JsonArray list = cfg["list"];
+    BrokerEntry entries[MQTT_BROKER_SLOTS] = {};
+    for (int i = 0; i < MQTT_BROKER_SLOTS && i < (int)list.size(); i++) {
+      if (!parseBrokerEntry(String(list[i] | ""), entries[i])) return;
+    }
+    memcpy(config.brokers, entries, sizeof(entries));
+    config.preferredBroker = MQTT_BROKER_NONE;
+    for (int i = 0; i < MQTT_BROKER_SLOTS; i++) {
+      brokerStats[i] = {};
+    }
+  }
+  if (cfg["mdns"].is<bool>()) {
+    config.mdnsDiscovery = cfg["mdns"] ? 1 : 0;
+  }
+  saveConfig();
+}
+
+// ==================== FLEET TOPICS ====================
+// Topic-safe: letters, digits, '-' and '_' (no '/', '+' or '#')
+bool isValidFleetName(const char* name, size_t maxLen) {
+  size_t len = strlen(name);
+  if (len == 0 || len >= maxLen) return false;
+  for (size_t i = 0; i < len; i++) {
+    char c = name[i];
+    if (!isalnum((unsigned char)c) && c != '-' && c != '_') return false;
+  }
+  return true;
+}
+
+void buildFleetTopics() {
+  if (config.deviceName[0]) {
+    strncpy(deviceId, config.deviceName, sizeof(deviceId) - 1);
+    deviceId[sizeof(deviceId) - 1] = '\0';
+  } else {
+    snprintf(deviceId, sizeof(deviceId), "cb-%06x", ESP.getChipId());
+  }
+  
+  snprintf(command_topic, MQTT_TOPIC_LEN, "carbot/%s/command", deviceId);
+  snprintf(status_topic, MQTT_TOPIC_LEN, "carbot/%s/status", deviceId);
+  snprintf(sensor_topic, MQTT_TOPIC_LEN, "carbot/%s/sensors", deviceId);
+  snprintf(metrics_topic, MQTT_TOPIC_LEN, "carbot/%s/metrics", deviceId);
+  snprintf(auth_topic, MQTT_TOPIC_LEN, "carbot/%s/auth", deviceId);
+  snprintf(macro_topic, MQTT_TOPIC_LEN, "carbot/%s/macro", deviceId);
+  snprintf(flight_topic, MQTT_TOPIC_LEN, "carbot/%s/flight", deviceId);
+  snprintf(latency_topic, MQTT_TOPIC_LEN, "carbot/%s/latency", deviceId);
+  snprintf(broadcast_topic, MQTT_TOPIC_LEN, "carbot/all/command");
+  memset(groupCommands, 0, sizeof(groupCommands));  // Groups may have changed
+  for (int i = 0; i < FLEET_MAX_GROUPS; i++) {
+    group_topics[i][0] = '\0';
+    if (config.groups[i][0]) {
+      snprintf(group_topics[i], MQTT_TOPIC_LEN, "carbot/group/%s/command", config.groups[i]);
+    }
+  }
+}
+
+void subscribeFleetTopics() {
+  mqttClient.subscribe(command_topic);
+  mqttClient.subscribe(broadcast_topic);
+  for (int i = 0; i < FLEET_MAX_GROUPS; i++) {
+    if (group_topics[i][0]) mqttClient.subscribe(group_topics[i]);
+  }
+}
+
+void unsubscribeFleetTopics() {
+  mqttClient.unsubscribe(command_topic);
+  for (int i = 0; i < FLEET_MAX_GROUPS; i++) {
+    if (group_topics[i][0]) mqttClient.unsubscribe(group_topics[i]);
+  }
+}
+
+// Empty name = chip ID. All-or-nothing: one bad entry rejects the change.
+// Swaps the subscriptions in place, so the MQTT session stays up.
+bool setFleetIdentity(const char* name, const char* const* groups, int groupCount) {
+  if (name[0] && !isValidFleetName(name, DEVICE_NAME_LEN)) return false;
+  if (groupCount > FLEET_MAX_GROUPS) return false;
+  for (int i = 0; i < groupCount; i++) {
+    if (!isValidFleetName(groups[i], FLEET_GROUP_LEN)) return false;
+  }
+  
+  bool resubscribe = mqttClient.connected();
+  if (resubscribe) unsubscribeFleetTopics();
+  
+  memset(config.deviceName, 0, sizeof(config.deviceName));
+  strncpy(config.deviceName, name, sizeof(config.deviceName) - 1);
+  memset(config.groups, 0, sizeof(config.groups));
+  for (int i = 0; i < groupCount; i++) {
+    strncpy(config.groups[i], groups[i], FLEET_GROUP_LEN - 1);
+  }
+  saveConfig();
+  buildFleetTopics();
+  
+  if (resubscribe) subscribeFleetTopics();
+  return true;
+}
+
+// Fields left out keep their current value. Works on copies, since the
+// defaults point into config, which setFleetIdentity() rewrites.
+void applyFleetConfig(JsonObject cfg) {
+  char name[DEVICE_NAME_LEN];
+  char groups[FLEET_MAX_GROUPS][FLEET_GROUP_LEN];
+  const char* groupList[FLEET_MAX_GROUPS];
+  int groupCount = 0;
+  
+  const char* newName = cfg["name"] | (const char*)config.deviceName;
+  if (strlen(newName) >= sizeof(name)) return;
+  strcpy(name, newName);
+  
+  if (cfg["groups"].is<JsonArray>()) {
+    JsonArray list = cfg["groups"];
+    if (list.size() > (size_t)FLEET_MAX_GROUPS) return;
+    for (JsonVariant group : list) {
+      const char* value = group | "";
+      if (strlen(value) >= FLEET_GROUP_LEN) return;
+      strcpy(groups[groupCount], value);
+      groupCount++;
+    }
+  } else {
+    for (int i = 0; i < FLEET_MAX_GROUPS; i++) {
+      if (config.groups[i][0]) strcpy(groups[groupCount++], config.groups[i]);
+    }
+  }
+  
+  for (int i = 0; i < groupCount; i++) groupList[i] = groups[i];
+  setFleetIdentity(name, groupList, groupCount);
+}
+
+void CARBOT_HOT handleBinaryCommand(const byte* payload, unsigned int length) {
+  if (length < 2) return;
+  
+  if (payload[1] == CMD_FRAME_VERSION_SESSION) {
+    if (length != sizeof(SessionFrame)) return;
+    SessionFrame frame;
+    memcpy(&frame, payload, sizeof(frame));
+    AuthSession* session = findAuthSession(frame.sid);
+    if (!session) {
+      authFailures++;
+      return;
+    }
+    if (!verifySessionTag(*session, frame.seq, payload, offsetof(SessionFrame, tag), frame.tag)) return;
+    noteAuthenticatedCommand(FLIGHT_SRC_FRAME);
+    noteCommandSeq(frame.seq);
+    applyCommandFrame(frame.flags, frame.left, frame.right, frame.servo);
+    return;
+  }
+  
+  if (length != sizeof(CommandFrame)) return;
+  CommandFrame frame;
+  memcpy(&frame, payload, sizeof(frame));
+  if (frame.version != CMD_FRAME_VERSION) return;
+  if (config.requireSession && frame.flags != CMD_FLAG_STOP) {
+    authLegacyRefused++;
+    return;
+  }
+  if (computeFrameTag(payload) != frame.tag) return;
+  noteAuthenticatedCommand(FLIGHT_SRC_FRAME);
+  if (!acceptCommandSequence(true, frame.seq, false, 0)) return;
+  applyCommandFrame(frame.flags, frame.left, frame.right, frame.servo);
+}
+
+void CARBOT_HOT applyCommandFrame(uint8_t flags, int left, int right, int servo) {
+  if (flags & CMD_FLAG_AUTO_SET) {
+    autonomousMode = (flags & CMD_FLAG_AUTO_ON) != 0;
+    if (!autonomousMode && cancelManeuver()) {
+      stopMotors();
+    }
+  }
+  
+  if ((flags & CMD_FLAG_STREAM) && streamState == STREAM_OFF) {
+    startStreaming(streamRateHz, streamTimeoutMs);  // Last declared rate
+  }
+  
+  if (flags & CMD_FLAG_SERVO) {
+    queueServoCommand(servo);
+  }
+  
+  if (flags & CMD_FLAG_STOP) {
+    queueMotorCommand(0, 0);
+  } else if (flags & CMD_FLAG_MOTORS) {
+    queueMotorCommand(left, right);
+  }
+}
+
+// ==================== SESSION AUTH ====================
+bool CARBOT_HOT constantTimeEquals(const uint8_t* a, const uint8_t* b, size_t length) {
+  uint8_t diff = 0;
+  for (size_t i = 0; i < length; i++) {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
+
+bool parseHexBytes(const char* hex, uint8_t* out, size_t length) {
+  if (strlen(hex) != length * 2) return false;
+  for (size_t i = 0; i < length * 2; i++) {
+    char c = hex[i];
+    uint8_t nibble;
+    if (c >= '0' && c <= '9') nibble = c - '0';
+    else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+    else return false;
+    out[i / 2] = (i % 2) ? (out[i / 2] | nibble) : (nibble << 4);
+  }
+  return true;
+}
+
+void formatHex(const uint8_t* data, size_t length, char* out) {
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < length; i++) {
+    out[i * 2] = digits[data[i] >> 4];
+    out[i * 2 + 1] = digits[data[i] & 0x0F];
+  }
+  out[length * 2] = '\0';
+}
+
+// PBKDF2-HMAC-SHA256 for a single 32-byte block (RFC 8018)
+void pbkdf2Sha256(const void* password, size_t passwordLength, const uint8_t* salt, size_t saltLength,
+                 uint32_t iterations, uint8_t* out) {
+  static const uint8_t blockIndex[4] = {0, 0, 0, 1};
+  br_hmac_key_context passwordKey;
+  br_hmac_context hmac;
+  uint8_t u[AUTH_KEY_LEN];
+  br_hmac_key_init(&passwordKey, &br_sha256_vtable, password, passwordLength);
+  br_hmac_init(&hmac, &passwordKey, sizeof(u));
+  br_hmac_update(&hmac, salt, saltLength);
+  br_hmac_update(&hmac, blockIndex, sizeof(blockIndex));
+  br_hmac_out(&hmac, u);
+  memcpy(out, u, sizeof(u));
+  
+  for (uint32_t i = 1; i < iterations; i++) {
+    br_hmac_init(&hmac, &passwordKey, sizeof(u));
+    br_hmac_update(&hmac, u, sizeof(u));
+    br_hmac_out(&hmac, u);
+    for (size_t j = 0; j < sizeof(u); j++) out[j] ^= u[j];
+    if ((i & 0xFF) == 0) yield();  // Keeps the watchdog fed
+  }
+  memset(u, 0, sizeof(u));
+}
+
+// New salt, then stretch the current password; the caller saves
+void deriveSessionSecret() {
+  for (size_t i = 0; i < AUTH_SALT_LEN; i += 4) {
+    uint32_t r = ESP.random();
+    memcpy(config.sessionSalt + i, &r, 4);
+  }
+  pbkdf2Sha256(config.controlPassword, strlen(config.controlPassword), config.sessionSalt,
+               AUTH_SALT_LEN, AUTH_KDF_ITERATIONS, config.sessionSecret);
+  config.sessionSecretSource = SESSION_SECRET_PASSWORD;
+}
+
+// 64 hex digits provision a key, "" goes back to the stretched password
+bool setSessionSecret(const char* keyHex) {
+  if (keyHex[0] == '\0') {
+    deriveSessionSecret();
+  } else {
+    uint8_t secret[AUTH_KEY_LEN];
+    if (!parseHexBytes(keyHex, secret, sizeof(secret))) return false;
+    memcpy(config.sessionSecret, secret, sizeof(secret));
+    memset(config.sessionSalt, 0, sizeof(config.sessionSalt));
+    config.sessionSecretSource = SESSION_SECRET_PROVISIONED;
+    memset(secret, 0, sizeof(secret));
+  }
+  saveConfig();
+  clearAuthSessions();
+  return true;
+}
+
+void clearAuthSessions() {
+  activeSession.valid = false;
+  for (int i = 0; i < AUTH_PENDING_SLOTS; i++) pendingSessions[i].valid = false;
+}
+
+// Issues a pending session; the current one keeps working until the
+// controller proves it derived the new key
+void startAuthSession(const char* clientNonceHex) {
+  uint8_t clientNonce[AUTH_NONCE_LEN];
+  if (!parseHexBytes(clientNonceHex, clientNonce, sizeof(clientNonce))) return;
+  
+  unsigned long now = millis();
+  AuthSession* pending = nullptr;
+  for (int i = 0; i < AUTH_PENDING_SLOTS; i++) {
+    AuthSession& slot = pendingSessions[i];
+    if (slot.valid && now - slot.issuedMs >= AUTH_PENDING_TTL_MS) slot.valid = false;
+    if (slot.valid && memcmp(slot.clientNonce, clientNonce, sizeof(clientNonce)) == 0) {
+      return;  // Repeated hello, already answered
+    }
+    if (!slot.valid && !pending) pending = &slot;
+  }
+  if (!pending) {
+    authHellosRefused++;  // Live slots are never evicted
+    return;
+  }
+  
+  uint8_t botNonce[AUTH_NONCE_LEN];
+  for (size_t i = 0; i < sizeof(botNonce); i += 4) {
+    uint32_t r = ESP.random();  // Hardware RNG
+    memcpy(botNonce + i, &r, 4);
+  }
+  
+  br_hmac_key_context secretKey;
+  br_hmac_context hmac;
+  uint8_t sessionKey[AUTH_KEY_LEN];
+  br_hmac_key_init(&secretKey, &br_sha256_vtable, config.sessionSecret, sizeof(config.sessionSecret));
+  br_hmac_init(&hmac, &secretKey, sizeof(sessionKey));
+  br_hmac_update(&hmac, "carbot-session", 14);
+  br_hmac_update(&hmac, clientNonce, sizeof(clientNonce));
+  br_hmac_update(&hmac, botNonce, sizeof(botNonce));
+  br_hmac_update(&hmac, deviceId, strlen(deviceId));
+  br_hmac_out(&hmac, sessionKey);
+  
+  pending->valid = true;
+  pending->id = nextSessionId++;
+  if (nextSessionId == 0) nextSessionId = 1;
+  pending->seqValid = false;
+  pending->lastSeq = 0;
+  pending->issuedMs = now;
+  memcpy(pending->clientNonce, clientNonce, sizeof(clientNonce));
+  br_hmac_key_init(&pending->key, &br_sha256_vtable, sessionKey, sizeof(sessionKey));
+  memset(sessionKey, 0, sizeof(sessionKey));
+  
+  uint8_t proof[AUTH_TAG_LEN];
+  br_hmac_init(&hmac, &pending->key, sizeof(proof));
+  br_hmac_update(&hmac, "carbot-bot", 10);
+  br_hmac_out(&hmac, proof);
+  authHandshakes++;
+  
+  char nonceHex[AUTH_NONCE_LEN * 2 + 1];
+  char proofHex[AUTH_TAG_LEN * 2 + 1];
+  char saltHex[AUTH_SALT_LEN * 2 + 1];
+  char reply[112];
+  formatHex(botNonce, sizeof(botNonce), nonceHex);
+  formatHex(proof, sizeof(proof), proofHex);
+  int len = snprintf(reply, sizeof(reply), "{\"sid\":%u,\"nonce\":\"%s\",\"proof\":\"%s\"",
+                     pending->id, nonceHex, proofHex);
+  if (config.sessionSecretSource == SESSION_SECRET_PASSWORD) {
+    formatHex(config.sessionSalt, sizeof(config.sessionSalt), saltHex);
+    len += snprintf(reply + len, sizeof(reply) - len, ",\"salt\":\"%s\"", saltHex);
+  }
+  snprintf(reply + len, sizeof(reply) - len, "}");
+  mqttClient.publish(auth_topic, reply);
+}
+
+AuthSession* CARBOT_HOT findAuthSession(uint8_t sid) {
+  if (activeSession.valid && activeSession.id == sid) return &activeSession;
+  for (int i = 0; i < AUTH_PENDING_SLOTS; i++) {
+    AuthSession& slot = pendingSessions[i];
+    if (slot.valid && slot.id == sid && millis() - slot.issuedMs < AUTH_PENDING_TTL_MS) return &slot;
+  }
+  return nullptr;
+}
+
+// Checks seq before the HMAC, and only a frame that verifies moves any state
+bool CARBOT_HOT verifySessionTag(AuthSession& session, uint16_t seq, const uint8_t* data,
+                                 size_t length, const uint8_t* tag) {
+  uint32_t extended = seq;
+  if (session.seqValid) {
+    int16_t diff = (int16_t)(seq - (uint16_t)session.lastSeq);
+    if (diff <= 0) {
+      authReplays++;
+      return false;
+    }
+    extended = session.lastSeq + diff;
+  }
+  
+  uint8_t epoch[2] = {(uint8_t)(extended >> 16), (uint8_t)(extended >> 24)};
+  uint8_t expected[AUTH_TAG_LEN];
+  br_hmac_context hmac;
+  br_hmac_init(&hmac, &session.key, sizeof(expected));
+  br_hmac_update(&hmac, epoch, sizeof(epoch));
+  br_hmac_update(&hmac, data, length);
+  br_hmac_out(&hmac, expected);
+  if (!constantTimeEquals(expected, tag, sizeof(expected))) {
+    authFailures++;
+    return false;
+  }
+  
+  session.lastSeq = extended;
+  session.seqValid = true;
+  if (&session != &activeSession) {
+    activeSession = session;  // Controller has the new key
+    session.valid = false;
+  }
+  return true;
+}
+
+// JSON commands without the password: header + body + tag, see SESSION AUTH
+void handleSealedCommand(const byte* payload, unsigned int length) {
+  if (length < SEALED_HEADER_LEN + 2 + AUTH_TAG_LEN) return;
+  AuthSession* session = findAuthSession(payload[1]);
+  if (!session) {
+    authFailures++;
+    return;
+  }
+  uint16_t seq = payload[2] | (payload[3] << 8);
+  size_t signedLength = length - AUTH_TAG_LEN;
+  const byte* body = payload + SEALED_HEADER_LEN;
+  if (body[0] != '{') return;  // Bodies are JSON only
+  if (!verifySessionTag(*session, seq, payload, signedLength, payload + signedLength)) return;
+  noteAuthenticatedCommand(FLIGHT_SRC_JSON);
+  noteCommandSeq(seq);
+  
+  commandSealed = true;
+  handleCommandPayload(body, signedLength - SEALED_HEADER_LEN);
+  commandSealed = false;
+}
+
+// Returns false for duplicates, out-of-order and expired frames
+bool CARBOT_HOT acceptCommandSequence(bool hasSeq, uint16_t seq, bool hasTs, uint32_t ts) {
+  if (!hasSeq && !hasTs) return true;  // Legacy sender
+  
+  CommandStream& stream = *commandStream;
+  unsigned long now = millis();
+  bool newSession = now - stream.lastMs > SEQ_SESSION_TIMEOUT_MS;
+  
+  if (hasSeq && stream.seqValid && !newSession) {
+    int16_t diff = (int16_t)(seq - stream.lastSeq);
+    if (diff <= 0 && diff > -SEQ_REORDER_WINDOW) {
+      cmdDroppedOutOfOrder++;
+      return false;
+    }
+    if (diff <= 0) newSession = true;  // Far behind: sender restarted
+  }
+  
+  if (hasTs) {
+    // One-way delay relative to the best case seen; no clock sync needed
+    int32_t offset = (int32_t)(now - ts);
+    if (!stream.clockValid || newSession || offset < stream.clockOffset) {
+      stream.clockOffset = offset;
+      stream.clockValid = true;
+    }
+    if (offset - stream.clockOffset > COMMAND_MAX_AGE_MS) {
+      cmdDroppedStale++;
+      return false;
+    }
+  }
+  
+  if (hasSeq) {
+    stream.lastSeq = seq;
+    stream.seqValid = true;
+    noteCommandSeq(seq);
+  }
+  stream.lastMs = now;
+  return true;
+}
+
+// Latest wins: a queued setpoint is replaced, not replayed
+void CARBOT_HOT queueMotorCommand(int left, int right) {
+  if (pendingCommand.hasMotors) cmdCoalesced++;
+  pendingCommand.hasMotors = true;
+  pendingCommand.left = left;
+  pendingCommand.right = right;
+}
+
+void queueServoCommand(int angle) {
+  if (pendingCommand.hasServo) cmdCoalesced++;
+  pendingCommand.hasServo = true;
+  pendingCommand.servo = angle;
+}
+
+// Called once after each mqttClient.loop() pass
+void CARBOT_HOT applyPendingCommand() {
+  if (pendingCommand.hasServo) {
+    updateServo(pendingCommand.servo);
+  }
+  if (pendingCommand.hasMotors) {
+    cancelManeuver();  // Operator override
+    endMacro(MACRO_CANCELLED);
+    setMotorSpeeds(pendingCommand.left, pendingCommand.right);
+    
+    if (streamState != STREAM_OFF) {
+      unsigned long now = millis();
+      streamMaxGapMs = max(streamMaxGapMs, now - lastStreamSetpoint);
+      lastStreamSetpoint = now;
+      streamLeft = leftTarget;
+      streamRight = rightTarget;
+      streamState = STREAM_LIVE;
+    }
+  }
+  if (pendingCommand.hasSeq && (pendingCommand.hasMotors || pendingCommand.hasServo)) {
+    publishLatencyEcho(micros());
+  }
+  pendingCommand = {};
+}
+
+// ==================== STREAMING DEADMAN ====================
+void startStreaming(int rateHz, unsigned long timeoutMs) {
+  endMacro(MACRO_CANCELLED);  // The stream owns the motors now
+  streamRateHz = constrain(rateHz, 1, 100);
+  streamTimeoutMs = constrain(timeoutMs, 100UL, 5000UL);
+  streamState = STREAM_LIVE;
+  lastStreamSetpoint = millis();
+  streamLeft = leftTarget;
+  streamRight = rightTarget;
+  streamMaxGapMs = 0;
+}
+
+void stopStreaming() {
+  if (streamState == STREAM_OFF) return;
+  streamState = STREAM_OFF;
+  if (maneuverStep == MANEUVER_IDLE) {
+    stopMotors();  // Don't leave a streamed setpoint running unsupervised
+  }
+}
+
+void updateStreamDeadman() {
+  if (streamState == STREAM_OFF || streamState == STREAM_STOPPED) return;
+  if (maneuverStep != MANEUVER_IDLE) return;  // Maneuver owns the motors
+  
+  unsigned long gap = millis() - lastStreamSetpoint;
+  unsigned long holdMs = min((unsigned long)(STREAM_HOLD_PERIODS * 1000 / streamRateHz), streamTimeoutMs);
+  
+  if (gap >= streamTimeoutMs) {
+    streamState = STREAM_STOPPED;
+    streamDeadmanTrips++;
+    stopMotors();
+    
+  } else if (gap > holdMs) {
+    // Linear decay from the held setpoint to zero at the deadline
+    unsigned long remaining = streamTimeoutMs - gap;
+    unsigned long window = streamTimeoutMs - holdMs;
+    int left = (int)(streamLeft * (long)remaining / (long)window);
+    int right = (int)(streamRight * (long)remaining / (long)window);
+    if (left != leftTarget || right != rightTarget) {
+      setMotorSpeeds(left, right);
+    }
+    streamState = STREAM_DECAY;
+    
+  } else if (gap > 1000UL / streamRateHz) {
+    streamState = STREAM_HOLD;
+  }
+}
+
+const char* streamStateName(StreamState state) {
+  switch (state) {
+    case STREAM_LIVE: return "live";
+    case STREAM_HOLD: return "hold";
+    case STREAM_DECAY: return "decay";
+    case STREAM_STOPPED: return "stopped";
+    default: return "off";
+  }
+}
+
+void CARBOT_HOT mqttCallback(char* topic, byte* payload, unsigned int length) {
+  uint32_t start = metricStart();
+  commandFromGroup = strcmp(topic, command_topic) != 0;
+  if (commandFromGroup) {
+    groupCommandsReceived++;
+    commandStream = &groupCommands[0];
+    for (int i = 0; i < FLEET_MAX_GROUPS; i++) {
+      if (group_topics[i][0] && strcmp(topic, group_topics[i]) == 0) commandStream = &groupCommands[1 + i];
+    }
+  }
+  handleCommandPayload(payload, length);
+  commandFromGroup = false;
+  commandStream = &directCommands;
+  recordMetric(METRIC_CALLBACK, start);
+}
+
+// ==================== LAN CONTROL (UDP) ====================
+void startUdpControl() {
+  if (udpControlActive || !wifiReady) return;
+  udpControlActive = controlUdp.begin(UDP_CONTROL_PORT);
+}
+
+void stopUdpControl() {
+  if (!udpControlActive) return;
+  controlUdp.stop();
+  udpControlActive = false;
+}
+
+// Drains a few datagrams per pass; like MQTT, only the newest setpoint
+// from the pass is applied
+void pollUdpControl() {
+  static uint8_t packet[UDP_PACKET_MAX];
+  bool received = false;
+  
+  for (int i = 0; i < UDP_MAX_PACKETS_PER_PASS; i++) {
+    int size = controlUdp.parsePacket();
+    if (size <= 0) break;
+    if (size > (int)UDP_PACKET_MAX) {
+      udpOversize++;
+      continue;  // Next parsePacket() discards it
+    }
+    int length = controlUdp.read(packet, sizeof(packet));
+    if (length <= 0) continue;
+    
+    udpPackets++;
+    uint32_t start = metricStart();
+    handleCommandPayload(packet, length);
+    recordMetric(METRIC_CALLBACK, start);
+    received = true;
+  }
+  if (received) applyPendingCommand();
+}
+
+// Only once the password or tag checked out, so a stranger's packets
+// can't keep the bot awake, fill the recorder or skew the bench counts
+void CARBOT_HOT noteAuthenticatedCommand(uint8_t source) {
+  notePowerActivity();
+  if (latencyEcho) latencyReceived++;
+  recordFlightCommand(source | (commandFromGroup ? FLIGHT_SRC_GROUP : 0));
+}
+
+void handleCommandPayload(const byte* payload, unsigned int length) {
+  if (latencyEcho && !commandSealed) latencyRxUs = micros();  // Arrival, counted later
+  
+  // Binary frames skip JSON parsing entirely
+  if (length > 0 && payload[0] == CMD_FRAME_MAGIC) {
+    handleBinaryCommand(payload, length);
+    return;
+  }
+  if (length > 0 && payload[0] == SEALED_FRAME_MAGIC && !commandSealed) {
+    handleSealedCommand(payload, length);
+    return;
+  }
+  
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, payload, length);
+  if (error) return;
+  
+  // Handshake needs no credentials - the reply is useless without the secret
+  if (doc["auth"]["hello"].is<const char*>()) {
+    startAuthSession(doc["auth"]["hello"]);
+    return;
+  }
+  
+  // Sealed bodies were authenticated and sequenced by handleSealedCommand()
+  if (!commandSealed) {
+    if (config.requireSession) {
+      authLegacyRefused++;
+      return;
+    }
+    if (!validateControlPassword(doc["password"] | "")) return;
+    noteAuthenticatedCommand(FLIGHT_SRC_JSON);
+    
+    bool hasSeq = doc["seq"].is<long>();
+    bool hasTs = doc["ts"].is<unsigned long>();
+    if (!acceptCommandSequence(hasSeq, (uint16_t)(doc["seq"] | 0L),
+                               hasTs, (uint32_t)(doc["ts"] | 0UL))) {
+      return;
+    }
+  }
+  
+  // ==================== PROCESS ALL ARGUMENTS (NO RETURN) ====================
+  
+  // 1. AUTONOMOUS MODE TOGGLE (Process but don't return)
+  if (doc["autonomous"].is<bool>()) {
+    autonomousMode = doc["autonomous"];
+    if (!autonomousMode && cancelManeuver()) {
+      stopMotors();
+    }
+  }
+  
+  // 2. SERVO CONTROL (Process but don't return)
+  if (doc["servo"].is<int>()) {
+    int angle = doc["servo"];
+    queueServoCommand(angle);
+  }
+  
+  // 3. STREAMING MODE (Process but don't return)
+  if (doc["stream"].is<JsonObject>()) {
+    startStreaming(doc["stream"]["rate_hz"] | STREAM_DEFAULT_RATE_HZ,
+                   doc["stream"]["timeout_ms"] | STREAM_DEFAULT_TIMEOUT_MS);
+  } else if (doc["stream"].is<bool>()) {
+    if (doc["stream"]) {
+      startStreaming(STREAM_DEFAULT_RATE_HZ, STREAM_DEFAULT_TIMEOUT_MS);
+    } else {
+      stopStreaming();
+    }
+  }
+  
+  // 4. STATUS PUBLISH POLICY / LAN CONTROL / BROKERS / RECORDING / POWER / FLEET / AUTH / MACRO / FLIGHT / BENCH (Process but don't return)
+  if (doc["record"].is<JsonObject>()) {
+    setSensorRecording(doc["record"]["on"] | true,
+                       doc["record"]["flush_ms"] | sensorFlushMs);
+  } else if (doc["record"].is<bool>()) {
+    setSensorRecording(doc["record"], sensorFlushMs);
+  }
+  if (doc["brokers"].is<JsonObject>()) {
+    applyBrokerConfig(doc["brokers"]);
+  }
+  if (doc["status_cfg"].is<JsonObject>()) {
+    applyStatusConfig(doc["status_cfg"]);
+  }
+  if (doc["bench"]["echo"].is<bool>()) {
+    setLatencyEcho(doc["bench"]["echo"]);
+  }
+  if (doc["flight"].is<const char*>()) {
+    const char* action = doc["flight"];
+    if (strcmp(action, "dump") == 0) flightDumpPending = true;
+    else if (strcmp(action, "clear") == 0) clearFlightRecorder();
+  }
+  if (!doc["macro"].isNull()) {
+    applyMacroCommand(doc["macro"]);
+  }
+  if (doc["auth"]["require"].is<bool>()) {
+    config.requireSession = doc["auth"]["require"] ? 1 : 0;
+    saveConfig();
+  }
+  if (doc["fleet"].is<JsonObject>()) {
+    applyFleetConfig(doc["fleet"]);
+  }
+  if (doc["power"].is<JsonObject>()) {
+    applyPowerConfig(doc["power"]);
+  }
+  if (doc["udp"].is<bool>()) {
+    config.udpControl = doc["udp"] ? 1 : 0;
+    saveConfig();
+    if (config.udpControl) startUdpControl();
+    else stopUdpControl();
+  }
+  
+  // 5. RAMP LIMITS / DEADBAND (Process but don't return)
+  if (doc["servo_profile"].is<JsonObject>()) {
+    applyServoProfileConfig(doc["servo_profile"]);
+  }
+  if (doc["ramp"].is<JsonObject>()) {
+    applyRampConfig(doc["ramp"]);
+  }
+  if (doc["motor_cal"].is<JsonObject>()) {
+    applyMotorCalibration(doc["motor_cal"]);
+  }
+  
+  // 6. IR SURFACE CALIBRATION (Process but don't return)
+  if (doc["ir_cal"].is<JsonObject>()) {
+    applyIrCalibration(doc["ir_cal"]);
+  } else if (doc["ir_surface"].is<int>()) {
+    selectIrSurface(doc["ir_surface"]);
+    saveConfig();  // No-op when already selected
+  }
+  
+  // 7. DIRECT WHEEL SPEED CONTROL
+  if (doc["left"].is<int>() && doc["right"].is<int>()) {
+    int left = doc["left"];    // -100 to +100
+    int right = doc["right"];  // -100 to +100
+    
+    queueMotorCommand(left, right);
+    return;  // Can return here since motors are set
+  }
+  
+  // 8. SIMPLE DIRECTION COMMANDS (FALLBACK)
+  String cmd = doc["cmd"] | "";
+  int speed = doc["speed"] | 50;
+  
+  if (cmd == "F") {
+    queueMotorCommand(speed, speed);
+  } else if (cmd == "B") {
+    queueMotorCommand(-speed, -speed);
+  } else if (cmd == "L") {
+    queueMotorCommand(-speed, speed);  // Left backward, right forward
+  } else if (cmd == "R") {
+    queueMotorCommand(speed, -speed);  // Left forward, right backward
+  } else if (cmd == "S") {
+    queueMotorCommand(0, 0);
+  }
+}
+
+
+void publishStatus() {
+  if (!mqttClient.connected() || configMode) return;
+  
+  telemetryArena.reset();
+  JsonDocument doc(&telemetryArena);
+  doc["device_id"] = deviceId;
+  doc["status"] = "online";
+  doc["left_speed"] = leftSpeed;
+  doc["right_speed"] = rightSpeed;
+  doc["left_target"] = leftTarget;
+  doc["right_target"] = rightTarget;
+  doc["ramping"] = leftSpeed != leftTarget || rightSpeed != rightTarget;
+  doc["braking"] = motorBrakeActive;
+  doc["servo_angle"] = servoAngle;
+  doc["servo_pos"] = servoPosMilli / 1000;
+  doc["servo_attached"] = servoMotor.attached();
+  doc["autonomous_mode"] = autonomousMode;
+  doc["stream_state"] = streamStateName(streamState);
+  doc["macro_state"] = MACRO_STATE_NAMES[macroState];
+  doc["macro_segment"] = macroSegment;
+  doc["macro_loop"] = macroLoop;
+  
+  // Sensor status (kept fresh by updateStatusPublisher / handleObstacles)
+  doc["ir_left_blocked"] = irLeftBlocked;
+  doc["ir_right_blocked"] = irRightBlocked;
+  doc["ir_left_level"] = irFiltered / IR_FILTER_SCALE;
+  doc["ir_surface"] = config.irActiveSurface;
+  doc["ir_on"] = irOnThreshold;
+  doc["ir_off"] = irOffThreshold;
+  
+  doc["rssi"] = WiFi.RSSI();
+  doc["uptime"] = millis() / 1000;
+  if (currentBroker >= 0) {
+    doc["broker"] = currentBroker == MQTT_BROKER_MDNS ? "mdns" : config.brokers[currentBroker].host;
+    doc["broker_latency_ms"] = brokerStats[currentBroker].latencyMs;
+  }
+  doc["auth_session"] = activeSession.valid ? activeSession.id : 0;
+  doc["auth_required"] = config.requireSession != 0;
+  
+  // Motor ramp
+  doc["ramp_accel"] = motorAccelRate;
+  doc["ramp_brake"] = motorBrakeRate;
+  doc["left_min_duty"] = motorMinDuty[MOTOR_LEFT];
+  doc["right_min_duty"] = motorMinDuty[MOTOR_RIGHT];
+  
+  // Streaming deadman
+  if (streamState != STREAM_OFF) {
+    doc["stream_rate_hz"] = streamRateHz;
+    doc["stream_timeout_ms"] = streamTimeoutMs;
+    doc["stream_max_gap_ms"] = streamMaxGapMs;
+  }
+  doc["recording"] = sensorRecording;
+  doc["power_state"] = POWER_STATE_NAMES[powerState];
+  
+  // LAN control
+  doc["ip"] = WiFi.localIP().toString();
+  doc["udp_port"] = udpControlActive ? UDP_CONTROL_PORT : 0;
+  
+  if (publishTelemetry(status_topic, doc)) {
+    recordPublishedStatus(STATUS_FIELD_ALL);
+    lastFullStatusTime = millis();
+    publishStatusHealth();
+  }
+}
+
+// Second half of the full snapshot: counters that only grow, on the same
+// topic but tagged "section":"health" so consumers can tell them apart
+void publishStatusHealth() {
+  telemetryArena.reset();
+  JsonDocument doc(&telemetryArena);
+  doc["device_id"] = deviceId;
+  doc["section"] = "health";
+  doc["servo_detaches"] = servoDetaches;
+  doc["macro_rejected"] = macroRejected;
+  doc["flight_events"] = flightHeader.count;
+  doc["flight_boots"] = flightHeader.boots;
+  doc["config_commits"] = configCommits;
+  
+  // Broker link health
+  doc["mqtt_reconnects"] = mqttReconnectCount;
+  doc["mqtt_failed_attempts"] = mqttFailedAttempts;
+  doc["mqtt_last_reconnect_ms"] = mqttLastReconnectMs;
+  
+  // Session auth
+  doc["auth_failures"] = authFailures;
+  doc["auth_replays"] = authReplays;
+  doc["auth_refused"] = authLegacyRefused;
+  doc["auth_hellos_refused"] = authHellosRefused;
+  
+  // Command ordering
+  doc["cmd_dropped_ooo"] = cmdDroppedOutOfOrder;
+  doc["cmd_dropped_stale"] = cmdDroppedStale;
+  doc["cmd_coalesced"] = cmdCoalesced;
+  doc["brake_now_count"] = motorBrakeNowCount;
+  doc["stream_trips"] = streamDeadmanTrips;
+  
+  // Sensor recording and alerts
+  doc["rec_batches"] = sensorBatchesSent;
+  doc["rec_dropped"] = sensorSamplesDropped;
+  doc["rec_waits"] = sensorBackpressureWaits;
+  doc["alerts_sent"] = alertsPublished;
+  doc["alerts_coalesced"] = alertsCoalesced;
+  doc["alerts_dropped"] = loopAlerts.dropped + isrAlerts.dropped;
+  doc["alert_waits"] = alertBackpressureWaits;
+  
+  // Power states, ms spent in each since boot
+  doc["power_active_ms"] = powerDwellMs(POWER_ACTIVE);
+  doc["power_modem_ms"] = powerDwellMs(POWER_MODEM_SLEEP);
+  doc["power_light_ms"] = powerDwellMs(POWER_LIGHT_SLEEP);
+  doc["power_wakes"] = powerWakes;
+  doc["udp_packets"] = udpPackets;
+  
+  // Scheduler health
+  doc["sched_overruns"] = totalTaskOverruns();
+  JsonObject overruns = doc["task_overruns"].to<JsonObject>();
+  for (int i = 0; i < taskCount; i++) {
+    overruns[tasks[i].name] = tasks[i].overruns;
+  }
+  doc["telemetry_oversize"] = telemetryOversize;
+  
+  // Heap health - should stay flat over days of uptime
+  doc["free_heap"] = ESP.getFreeHeap();
+  doc["heap_frag"] = ESP.getHeapFragmentation();
+  doc["max_free_block"] = ESP.getMaxFreeBlockSize();
+  
+  publishTelemetry(status_topic, doc);
+}
+
+// Only the fields that moved past their threshold since the last publish
+void publishStatusDelta(uint8_t fields) {
+  if (!mqttClient.connected() || configMode) return;
+  
+  telemetryArena.reset();
+  JsonDocument doc(&telemetryArena);
+  doc["device_id"] = deviceId;
+  doc["delta"] = true;
+  
+  if (fields & STATUS_FIELD_SPEED) {
+    doc["left_speed"] = leftSpeed;
+    doc["right_speed"] = rightSpeed;
+    doc["left_target"] = leftTarget;
+    doc["right_target"] = rightTarget;
+    doc["braking"] = motorBrakeActive;
+  }
+  if (fields & STATUS_FIELD_SERVO) {
+    doc["servo_angle"] = servoAngle;
+  }
+  if (fields & STATUS_FIELD_IR) {
+    doc["ir_left_blocked"] = irLeftBlocked;
+    doc["ir_right_blocked"] = irRightBlocked;
+  }
+  if (fields & STATUS_FIELD_MODE) {
+    doc["autonomous_mode"] = autonomousMode;
+    doc["stream_state"] = streamStateName(streamState);
+  }
+  doc["uptime"] = millis() / 1000;
+  
+  if (publishTelemetry(status_topic, doc)) {
+    recordPublishedStatus(fields);
+  }
+}
+
+uint8_t changedStatusFields() {
+  uint8_t fields = 0;
+  
+  // Any start or stop is reported regardless of the threshold
+  bool stoppedChanged = ((leftSpeed == 0) != (lastPublished.leftSpeed == 0)) ||
+                        ((rightSpeed == 0) != (lastPublished.rightSpeed == 0));
+  if (stoppedChanged ||
+      abs(leftSpeed - lastPublished.leftSpeed) >= statusSpeedDelta ||
+      abs(rightSpeed - lastPublished.rightSpeed) >= statusSpeedDelta) {
+    fields |= STATUS_FIELD_SPEED;
+  }
+  if (abs(servoAngle - lastPublished.servoAngle) >= statusServoDelta) {
+    fields |= STATUS_FIELD_SERVO;
+  }
+  if (irLeftBlocked != lastPublished.irLeftBlocked ||
+      irRightBlocked != lastPublished.irRightBlocked) {
+    fields |= STATUS_FIELD_IR;
+  }
+  // Live/hold/decay flip with packet jitter - only report on/off/tripped
+  bool streamOffChanged = (streamState == STREAM_OFF) != (lastPublished.streamState == STREAM_OFF);
+  bool streamTripChanged = (streamState == STREAM_STOPPED) != (lastPublished.streamState == STREAM_STOPPED);
+  if (autonomousMode != lastPublished.autonomousMode || streamOffChanged || streamTripChanged) {
+    fields |= STATUS_FIELD_MODE;
+  }
+  return fields;
+}
+
+void recordPublishedStatus(uint8_t fields) {
+  if (fields & STATUS_FIELD_SPEED) {
+    lastPublished.leftSpeed = leftSpeed;
+    lastPublished.rightSpeed = rightSpeed;
+  }
+  if (fields & STATUS_FIELD_SERVO) {
+    lastPublished.servoAngle = servoAngle;
+  }
+  if (fields & STATUS_FIELD_IR) {
+    lastPublished.irLeftBlocked = irLeftBlocked;
+    lastPublished.irRightBlocked = irRightBlocked;
+  }
+  if (fields & STATUS_FIELD_MODE) {
+    lastPublished.autonomousMode = autonomousMode;
+    lastPublished.streamState = streamState;
+  }
+  lastStatusTime = millis();
+}
+
+void updateStatusPublisher() {
+  if (!mqttClient.connected() || configMode) return;
+  unsigned long now = millis();
+  
+  // The IR sampler already reads the sensors while edges are watched or
+  // a recording runs; a second read here would double-step the filter
+  if (!edgeChecksActive() && !sensorRecording) {
+    readIRSensors();
+  }
+  
+  uint32_t start = metricStart();
+  if (now - lastFullStatusTime >= statusHeartbeatMs) {
+    publishStatus();
+    recordMetric(METRIC_STATUS, start);
+    return;
+  }
+  
+  uint8_t fields = changedStatusFields();
+  if (fields && now - lastStatusTime >= statusMinIntervalMs) {
+    publishStatusDelta(fields);
+    recordMetric(METRIC_STATUS, start);
+  }
+}
+
+void applyStatusConfig(JsonObject cfg) {
+  if (cfg["heartbeat_ms"].is<unsigned long>()) {
+    statusHeartbeatMs = max(1000UL, cfg["heartbeat_ms"].as<unsigned long>());
+  }
+  if (cfg["min_interval_ms"].is<unsigned long>()) {
+    statusMinIntervalMs = cfg["min_interval_ms"].as<unsigned long>();
+  }
+  if (cfg["speed_delta"].is<int>()) {
+    statusSpeedDelta = constrain(cfg["speed_delta"].as<int>(), 1, 200);
+  }
+  if (cfg["servo_delta"].is<int>()) {
+    statusServoDelta = constrain(cfg["servo_delta"].as<int>(), 1, 120);
+  }
+}
+// Page is portal/index.html, gzipped into flash by scripts/embed_portal.py.
+// send_P() streams it straight from PROGMEM - no RAM copy of the page.
+void handleRoot() {
+  if (server.header("If-None-Match") == PORTAL_HTML_ETAG) {
+    server.send(304);
+    return;
+  }
+  server.sendHeader("Content-Encoding", "gzip");
+  server.sendHeader("Cache-Control", "max-age=3600");
+  server.sendHeader("ETag", PORTAL_HTML_ETAG);
+  server.send_P(200, "text/html", (PGM_P)PORTAL_HTML_GZ, PORTAL_HTML_GZ_LEN);
+}
+
+// ==================== WIFI FUNCTIONS  ====================
+uint32_t crc32(const uint8_t* data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (length--) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
   }
-  EEPROM.commit();
-  control_password_stored = password;
-  if (serialEnabled) Serial.println("✓ Control password saved");
+  return ~crc;
 }
 
-bool validateControlPassword(String password) {
-  return (password == control_password_stored);
+uint32_t wifiCacheCrc() {
+  return crc32((const uint8_t*)&wifiCache + sizeof(wifiCache.crc),
+               sizeof(wifiCache) - sizeof(wifiCache.crc));
 }
 
-// ==================== MQTT FUNCTIONS ====================
-void setupMQTT() {
-  mqttClient.setServer(mqtt_server, mqtt_port);
-  mqttClient.setCallback(mqttCallback);
+uint32_t ssidHash() {
+  return crc32((const uint8_t*)ssid_stored.c_str(), ssid_stored.length());
 }
 
-void reconnectMQTT() {
-  if (configMode) return;
-  int attempts = 0;
-  while (!mqttClient.connected() && attempts < 3) {
-    String clientId = "ESP12E_CarBot_" + String(random(0xffff), HEX);
-    if (mqttClient.connect(clientId.c_str(), mqtt_user, mqtt_password)) {
-      mqttClient.subscribe(command_topic);
-      mqttClient.publish(status_topic, "{\"status\":\"online\"}");
-    } else {
-      attempts++;
-      delay(2000);
-    }
+bool loadWifiCache() {
+  if (!ESP.rtcUserMemoryRead(RTC_WIFI_CACHE_OFFSET, (uint32_t*)&wifiCache, sizeof(wifiCache))) {
+    return false;
   }
+  return wifiCache.crc == wifiCacheCrc() && wifiCache.ssidHash == ssidHash();
 }
 
-void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  JsonDocument doc;
-  DeserializationError error = deserializeJson(doc, payload, length);
-  if (error) return;
-  
-  String receivedPassword = doc["password"] | "";
-  if (!validateControlPassword(receivedPassword)) return;
-  
-  // ==================== PROCESS ALL ARGUMENTS (NO RETURN) ====================
+void saveWifiCache() {
+  WifiFastCache previous = wifiCache;
   
-  // 1. AUTONOMOUS MODE TOGGLE (Process but don't return)
-  if (doc["autonomous"].is<bool>()) {
-    autonomousMode = doc["autonomous"];
-  }
+  wifiCache.ssidHash = ssidHash();
+  wifiCache.ip = WiFi.localIP();
+  wifiCache.gateway = WiFi.gatewayIP();
+  wifiCache.subnet = WiFi.subnetMask();
+  wifiCache.dns = WiFi.dnsIP();
+  memcpy(wifiCache.bssid, WiFi.BSSID(), sizeof(wifiCache.bssid));
+  wifiCache.channel = WiFi.channel();
+  wifiCache.reserved = 0;
+  wifiCache.crc = wifiCacheCrc();
   
-  // 2. SERVO CONTROL (Process but don't return)
-  if (doc["servo"].is<int>()) {
-    int angle = doc["servo"];
-    updateServo(angle);
-  }
+  if (memcmp(&previous, &wifiCache, sizeof(wifiCache)) == 0) return;
+  ESP.rtcUserMemoryWrite(RTC_WIFI_CACHE_OFFSET, (uint32_t*)&wifiCache, sizeof(wifiCache));
+}
+
+// Starts an attempt and returns at once - updateWiFiConnection() finishes it
+void beginWiFiConnect(bool useCache) {
+  wifiFastAttempt = useCache;
+  wifiAttemptStart = millis();
   
-  // 3. DIRECT WHEEL SPEED CONTROL
-  if (doc["left"].is<int>() && doc["right"].is<int>()) {
-    int left = doc["left"];    // -100 to +100
-    int right = doc["right"];  // -100 to +100
-    
-    setMotorSpeeds(left, right);
-    return;  // Can return here since motors are set
+  if (serialEnabled) {
+    Serial.println("\n--- WiFi Connection Attempt ---");
+    Serial.println("SSID: " + ssid_stored);
+    if (useCache) {
+      Serial.println("Fast path: cached BSSID/channel/IP");
+    } else {
+      Serial.println("Attempt: " + String(wifiConnectionAttempts + 1) + "/" + String(MAX_WIFI_ATTEMPTS));
+    }
   }
   
-  // 4. SIMPLE DIRECTION COMMANDS (FALLBACK)
-  String cmd = doc["cmd"] | "";
-  int speed = doc["speed"] | 50;
+  WiFi.persistent(false);  // SDK would otherwise rewrite its flash config
+  WiFi.mode(WIFI_STA);
   
-  if (cmd == "F") {
-    setMotorSpeeds(speed, speed);
-  } else if (cmd == "B") {
-    setMotorSpeeds(-speed, -speed);
-  } else if (cmd == "L") {
-    setMotorSpeeds(-speed, speed);  // Left backward, right forward
-  } else if (cmd == "R") {
-    setMotorSpeeds(speed, -speed);  // Left forward, right backward
-  } else if (cmd == "S") {
-    stopMotors();
+  if (useCache) {
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway),
+                IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+    WiFi.begin(ssid_stored.c_str(), password_stored.c_str(), wifiCache.channel, wifiCache.bssid);
+  } else {
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());  // Back to DHCP
+    WiFi.begin(ssid_stored.c_str(), password_stored.c_str());
   }
 }
 
-
-void publishStatus() {
-  if (!mqttClient.connected() || configMode) return;
+void updateWiFiConnection() {
+  if (WiFi.status() == WL_CONNECTED) {
+    onWiFiConnected();
+    return;
+  }
   
-  JsonDocument doc;
-  doc["device_id"] = "esp12e_carbot";
-  doc["status"] = "online";
-  doc["left_speed"] = leftSpeed;
-  doc["right_speed"] = rightSpeed;
-  doc["servo_angle"] = servoAngle;
-  doc["autonomous_mode"] = autonomousMode;
+  unsigned long timeout = wifiFastAttempt ? WIFI_FAST_TIMEOUT_MS : WIFI_FULL_TIMEOUT_MS;
+  if (millis() - wifiAttemptStart < timeout) return;
   
-  // Sensor status
-  readIRSensors();
-  doc["ir_left_blocked"] = irLeftBlocked;
-  doc["ir_right_blocked"] = irRightBlocked;
+  if (wifiFastAttempt) {
+    // AP moved or lease gone - fall back to a full scan + DHCP
+    if (serialEnabled) Serial.println("✗ Cached connect failed, doing full connect");
+    beginWiFiConnect(false);
+    return;
+  }
   
-  doc["rssi"] = WiFi.RSSI();
-  doc["uptime"] = millis() / 1000;
+  if (serialEnabled) Serial.println("✗ Connection failed");
+  wifiConnectionAttempts++;
   
-  String output;
-  serializeJson(doc, output);
-  mqttClient.publish(status_topic, output.c_str());
-}
-void handleRoot() {
-  String html = R"rawliteral(
-<!DOCTYPE html>
-<html>
-<head>
-  <meta charset='UTF-8'>
-  <meta name='viewport' content='width=device-width, initial-scale=1.0'>
-  <title>CarBot WiFi Setup</title>
-  <style>
-    * { margin: 0; padding: 0; box-sizing: border-box; }
-    body {
-      font-family: 'Segoe UI', Arial, sans-serif;
-      background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-      min-height: 100vh;
-      display: flex;
-      justify-content: center;
-      align-items: center;
-      padding: 20px;
-    }
-    .container {
-      background: white;
-      border-radius: 20px;
-      padding: 40px;
-      box-shadow: 0 20px 60px rgba(0,0,0,0.3);
-      max-width: 500px;
-      width: 100%;
-    }
-    h1 {
-      color: #667eea;
-      text-align: center;
-      margin-bottom: 10px;
-      font-size: 28px;
-    }
-    h2 {
-      color: #666;
-      font-size: 18px;
-      margin-top: 30px;
-      margin-bottom: 15px;
-      border-bottom: 2px solid #667eea;
-      padding-bottom: 10px;
-    }
-    .form-group {
-      margin-bottom: 20px;
-    }
-    label {
-      display: block;
-      margin-bottom: 8px;
-      color: #333;
-      font-weight: 600;
-    }
-    input, select {
-      width: 100%;
-      padding: 12px;
-      border: 2px solid #ddd;
-      border-radius: 8px;
-      font-size: 16px;
-      transition: border-color 0.3s;
-    }
-    input:focus, select:focus {
-      outline: none;
-      border-color: #667eea;
-    }
-    button {
-      width: 100%;
-      padding: 14px;
-      background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-      color: white;
-      border: none;
-      border-radius: 8px;
-      font-size: 16px;
-      font-weight: 600;
-      cursor: pointer;
-      transition: transform 0.2s, box-shadow 0.2s;
-      margin-top: 10px;
-    }
-    button:hover {
-      transform: translateY(-2px);
-      box-shadow: 0 5px 15px rgba(102, 126, 234, 0.4);
-    }
-    .btn-secondary {
-      background: linear-gradient(135deg, #f093fb 0%, #f5576c 100%);
-    }
-    .status {
-      text-align: center;
-      margin-top: 20px;
-      padding: 15px;
-      border-radius: 8px;
-      background: #f0f0f0;
-      display: none;
-    }
-    .status.show { display: block; }
-    .status.success { background: #d4edda; color: #155724; }
-    .status.error { background: #f8d7da; color: #721c24; }
-    .checkbox-group {
-      display: flex;
-      align-items: center;
-      margin-top: 10px;
-    }
-    .checkbox-group input[type="checkbox"] {
-      width: auto;
-      margin-right: 8px;
-    }
-    .info-box {
-      background: #e7f3ff;
-      border-left: 4px solid #2196F3;
-      padding: 12px;
-      margin-bottom: 20px;
-      border-radius: 4px;
-      font-size: 14px;
-      color: #1976D2;
-    }
-  </style>
-</head>
-<body>
-  <div class='container'>
-    <h1>🚗 CarBot Setup</h1>
-    <div class='info-box'>
-      📡 Phone-controlled bot with IR obstacle detection
-    </div>
-    <h2>📶 WiFi Configuration</h2>
-    <div class='form-group'>
-      <button onclick='scanNetworks()'>Scan for Networks</button>
-    </div>
-    <div class='form-group'>
-      <label for='ssid'>WiFi Network:</label>
-      <select id='ssid'>
-        <option value=''>Select a network...</option>
-      </select>
-    </div>
-    <div class='form-group'>
-      <label for='password'>WiFi Password:</label>
-      <input type='password' id='password' placeholder='Enter WiFi password'>
-      <div class='checkbox-group'>
-        <input type='checkbox' id='showPass' onclick='togglePassword("password", "showPass")'>
-        <label for='showPass' style='margin:0; font-weight:normal;'>Show password</label>
-      </div>
-    </div>
-    <div class='form-group'>
-      <button onclick='connectWiFi()'>Save & Connect</button>
-    </div>
-    <h2>🔐 MQTT Control Password</h2>
-    <div class='form-group'>
-      <label for='controlPassword'>Control Password:</label>
-      <input type='password' id='controlPassword' placeholder='Min 4 characters' value='1234'>
-      <div class='checkbox-group'>
-        <input type='checkbox' id='showControl' onclick='togglePassword("controlPassword", "showControl")'>
-        <label for='showControl' style='margin:0; font-weight:normal;'>Show password</label>
-      </div>
-    </div>
-    <div class='form-group'>
-      <button class='btn-secondary' onclick='setControlPassword()'>Update Password</button>
-    </div>
-    <div id='status' class='status'></div>
-  </div>
-  <script>
-    function togglePassword(inputId, checkboxId) {
-      const input = document.getElementById(inputId);
-      const checkbox = document.getElementById(checkboxId);
-      input.type = checkbox.checked ? 'text' : 'password';
-    }
-    function showStatus(message, type) {
-      const status = document.getElementById('status');
-      status.textContent = message;
-      status.className = 'status show ' + type;
-      setTimeout(() => {
-        status.classList.remove('show');
-      }, 5000);
-    }
-    function scanNetworks() {
-      showStatus('Scanning...', '');
-      fetch('/scan')
-        .then(response => response.json())
-        .then(data => {
-          const select = document.getElementById('ssid');
-          select.innerHTML = '<option value="">Select a network...</option>';
-          data.networks.forEach(network => {
-            const option = document.createElement('option');
-            option.value = network.ssid;
-            option.textContent = network.ssid + ' (' + network.rssi + ' dBm)';
-            select.appendChild(option);
-          });
-          showStatus('Found ' + data.networks.length + ' networks', 'success');
-        })
-        .catch(error => {
-          showStatus('Scan failed', 'error');
-        });
-    }
-    function connectWiFi() {
-      const ssid = document.getElementById('ssid').value;
-      const password = document.getElementById('password').value;
-      if (!ssid) {
-        showStatus('Please select a network', 'error');
-        return;
-      }
-      showStatus('Saving and connecting...', '');
-      fetch('/connect', {
-        method: 'POST',
-        headers: {'Content-Type': 'application/x-www-form-urlencoded'},
-        body: 'ssid=' + encodeURIComponent(ssid) + '&password=' + encodeURIComponent(password)
-      })
-        .then(response => response.json())
-        .then(data => {
-          if (data.success) {
-            showStatus('Saved! Restarting...', 'success');
-            setTimeout(() => {
-              window.location.reload();
-            }, 3000);
-          } else {
-            showStatus('Failed: ' + data.message, 'error');
-          }
-        })
-        .catch(error => {
-          showStatus('Error occurred', 'error');
-        });
-    }
-    function setControlPassword() {
-      const password = document.getElementById('controlPassword').value;
-      if (password.length < 4) {
-        showStatus('Password must be at least 4 characters', 'error');
-        return;
-      }
-      showStatus('Updating...', '');
-      fetch('/setpassword', {
-        method: 'POST',
-        headers: {'Content-Type': 'application/x-www-form-urlencoded'},
-        body: 'password=' + encodeURIComponent(password)
-      })
-        .then(response => response.json())
-        .then(data => {
-          if (data.success) {
-            showStatus('Password updated!', 'success');
-          } else {
-            showStatus('Update failed', 'error');
-          }
-        })
-        .catch(error => {
-          showStatus('Error occurred', 'error');
-        });
-    }
-  </script>
-</body>
-</html>
-)rawliteral";
-  server.send(200, "text/html", html);
+  if (wifiConnectionAttempts < MAX_WIFI_ATTEMPTS) {
+    beginWiFiConnect(false);
+    return;
+  }
+  
+  // ========== WIFI FAILED - AP MODE ==========
+  if (serialEnabled) {
+    Serial.println("\n⚠ All WiFi attempts failed!");
+    Serial.println("⚠ Starting AP mode...");
+  }
+  startConfigMode();
+  setupWebServer();
+  if (serialEnabled) Serial.println("✅ AP mode active at http://192.168.4.1");
 }
 
-// ==================== WIFI FUNCTIONS  ====================
-bool connectToWiFi() {
-  if (ssid_stored.length() == 0) {
-    if (serialEnabled) Serial.println("No stored WiFi credentials");
-    return false;
+void onWiFiConnected() {
+  wifiReady = true;
+  recordFlightEvent(FLIGHT_LINK, FLIGHT_WIFI_UP, WiFi.channel());
+  wifiFastConnected = wifiFastAttempt;
+  wifiConnectionAttempts = 0;
+  configMode = false;
+  saveWifiCache();
+  if (!staticBrokerConfigured()) {
+    discoverMqttBroker();  // Nothing else to connect to; otherwise only after a failed round
   }
   
   if (serialEnabled) {
-    Serial.println("\n--- WiFi Connection Attempt ---");
-    Serial.println("SSID: " + ssid_stored);
-    Serial.println("Attempt: " + String(wifiConnectionAttempts + 1) + "/" + String(MAX_WIFI_ATTEMPTS));
+    Serial.println("✓ WiFi Connected!");
+    Serial.print("  IP Address: ");
+    Serial.println(WiFi.localIP());
+    Serial.print("  Signal: ");
+    Serial.print(WiFi.RSSI());
+    Serial.println(" dBm");
+    Serial.print("  Connect time: ");
+    Serial.print(millis());
+    Serial.println(" ms since boot");
   }
   
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(ssid_stored.c_str(), password_stored.c_str());
+  reconnectMQTT();
   
-  int timeout = 0;
-  while (WiFi.status() != WL_CONNECTED && timeout < 20) {
-    delay(500);
-    if (serialEnabled) Serial.print(".");
-    timeout++;
+  if (serialEnabled) {
+    if (mqttClient.connected()) {
+      Serial.println("✅ MQTT connected to broker");
+    } else {
+      Serial.println("⚠ MQTT connection failed (will retry in loop)");
+    }
+    
+    // ========== DISABLE SERIAL & INIT ENB ==========
+    Serial.println("\n🔄 Disabling Serial to free GPIO1...");
+    Serial.println("✅ GPIO1 (ENB) will control right motor");
+    Serial.println("========================================");
+    Serial.flush();
+    delay(200);
   }
-  if (serialEnabled) Serial.println();
   
-  if (WiFi.status() == WL_CONNECTED) {
-    if (serialEnabled) {
-      Serial.println("✓ WiFi Connected!");
-      Serial.print("  IP Address: ");
-      Serial.println(WiFi.localIP());
-      Serial.print("  Signal: ");
-      Serial.print(WiFi.RSSI());
-      Serial.println(" dBm");
-    }
-    wifiConnectionAttempts = 0;
-    configMode = false;
-    return true;
-  } else {
-    if (serialEnabled) Serial.println("✗ Connection failed");
-    wifiConnectionAttempts++;
-    return false;
+  disableSerial();
+  
+  // NOW safe to initialize ENB on GPIO1
+  pinMode(ENB_PIN, OUTPUT);
+  digitalWrite(ENB_PIN, LOW);
+  delay(50);
+  
+  // GPIO3 (RX) is free too - start edge interrupt
+  attachIrRightInterrupt();
+  
+  if (config.udpControl) {
+    startUdpControl();
   }
 }
 
@@ -759,15 +3680,68 @@ void startConfigMode() {
   }
 }
 
+// Scans run in the background; results stay in the SDK until the next
+// scan and are served from there while fresh. A request that finds no
+// fresh results starts a scan and gets {"scanning":true} - the page polls.
+void updateWifiScan() {
+  if (!wifiScanRunning) return;
+  int8_t n = WiFi.scanComplete();
+  if (n == WIFI_SCAN_RUNNING) return;
+  
+  wifiScanRunning = false;
+  wifiScanCount = max((int8_t)0, n);
+  wifiScanCompletedAt = millis();
+  wifiScanValid = true;
+}
+
 void handleScan() {
-  int n = WiFi.scanNetworks();
-  String json = "{\"networks\":[";
-  for (int i = 0; i < n; i++) {
-    if (i > 0) json += ",";
-    json += "{\"ssid\":\"" + WiFi.SSID(i) + "\",\"rssi\":" + String(WiFi.RSSI(i)) + "}";
+  updateWifiScan();
+  bool fresh = wifiScanValid && millis() - wifiScanCompletedAt < WIFI_SCAN_CACHE_MS;
+  if (!fresh && !wifiScanRunning) {
+    WiFi.scanNetworks(true);  // Async - returns at once
+    wifiScanRunning = true;
+    wifiScanValid = false;
   }
-  json += "]}";
-  server.send(200, "application/json", json);
+  
+  if (!fresh) {
+    server.send(202, "application/json", "{\"scanning\":true,\"networks\":[]}");
+    return;
+  }
+  
+  // One network per chunk - RAM stays flat however many APs are around
+  server.chunkedResponseModeStart(200, "application/json");
+  server.sendContent("{\"scanning\":false,\"networks\":[");
+  char entry[24 + 6 * 32 + 16];  // Worst case: every SSID byte as \u00XX
+  char ssid[6 * 32 + 1];
+  for (int i = 0; i < wifiScanCount; i++) {
+    jsonEscape(WiFi.SSID(i).c_str(), ssid, sizeof(ssid));
+    snprintf(entry, sizeof(entry), "%s{\"ssid\":\"%s\",\"rssi\":%d}",
+             i > 0 ? "," : "", ssid, (int)WiFi.RSSI(i));
+    server.sendContent(entry);
+  }
+  server.sendContent("]}");
+  server.chunkedResponseFinalize();
+}
+
+// Writes a JSON string body (no quotes); truncates rather than overflow
+void jsonEscape(const char* in, char* out, size_t outSize) {
+  size_t o = 0;
+  for (; *in; in++) {
+    uint8_t c = *in;
+    char esc[7];
+    if (c == '"' || c == '\\') {
+      esc[0] = '\\'; esc[1] = c; esc[2] = '\0';
+    } else if (c < 0x20) {
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+    } else {
+      esc[0] = c; esc[1] = '\0';
+    }
+    size_t len = strlen(esc);
+    if (o + len >= outSize) break;
+    memcpy(out + o, esc, len);
+    o += len;
+  }
+  out[o] = '\0';
 }
 
 void handleConnect() {
@@ -783,6 +3757,96 @@ void handleConnect() {
   }
 }
 
+// GET: current list for the portal form. POST: b0..b2 ("host[:port]"), mdns
+void handleBrokers() {
+  if (server.method() == HTTP_POST) {
+    BrokerEntry entries[MQTT_BROKER_SLOTS] = {};
+    for (int i = 0; i < MQTT_BROKER_SLOTS; i++) {
+      String arg = server.arg(String("b") + String(i));
+      if (!parseBrokerEntry(arg, entries[i])) {
+        server.send(400, "application/json", "{\"success\":false,\"message\":\"Bad broker\"}");
+        return;
+      }
+    }
+    memcpy(config.brokers, entries, sizeof(entries));
+    config.preferredBroker = MQTT_BROKER_NONE;
+    for (int i = 0; i < MQTT_BROKER_SLOTS; i++) {
+      brokerStats[i] = {};
+    }
+    config.mdnsDiscovery = server.arg("mdns") == "1";
+    saveConfig();
+    server.send(200, "application/json", "{\"success\":true}");
+    return;
+  }
+  
+  char json[64 + MQTT_BROKER_SLOTS * (6 * 40 + 24)];
+  char host[6 * 40 + 1];
+  int len = snprintf(json, sizeof(json), "{\"mdns\":%s,\"brokers\":[",
+                     config.mdnsDiscovery ? "true" : "false");
+  for (int i = 0; i < MQTT_BROKER_SLOTS; i++) {
+    jsonEscape(config.brokers[i].host, host, sizeof(host));
+    len += snprintf(json + len, sizeof(json) - len, "%s{\"host\":\"%s\",\"port\":%u}",
+                    i > 0 ? "," : "", host, config.brokers[i].port);
+  }
+  snprintf(json + len, sizeof(json) - len, "]}");
+  server.send(200, "application/json", json);
+}
+
+// GET: identity for the portal form. POST: name, groups ("a,b,c")
+void handleFleet() {
+  if (server.method() == HTTP_POST) {
+    String name = server.arg("name");
+    String groupArg = server.arg("groups");
+    char groups[FLEET_MAX_GROUPS * FLEET_GROUP_LEN + 8];
+    const char* groupList[FLEET_MAX_GROUPS];
+    int groupCount = 0;
+    bool valid = name.length() < DEVICE_NAME_LEN && groupArg.length() < sizeof(groups);
+    
+    if (valid) {
+      strcpy(groups, groupArg.c_str());
+      for (char* group = strtok(groups, ", "); group && valid; group = strtok(nullptr, ", ")) {
+        valid = groupCount < FLEET_MAX_GROUPS;
+        if (valid) groupList[groupCount++] = group;
+      }
+    }
+    if (!valid || !setFleetIdentity(name.c_str(), groupList, groupCount)) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Bad name or groups\"}");
+      return;
+    }
+    server.send(200, "application/json", "{\"success\":true}");
+    return;
+  }
+  
+  char json[96 + FLEET_MAX_GROUPS * (FLEET_GROUP_LEN + 4)];
+  int len = snprintf(json, sizeof(json), "{\"device\":\"%s\",\"name\":\"%s\",\"groups\":[",
+                     deviceId, config.deviceName);
+  bool first = true;
+  for (int i = 0; i < FLEET_MAX_GROUPS; i++) {
+    if (!config.groups[i][0]) continue;
+    len += snprintf(json + len, sizeof(json) - len, "%s\"%s\"", first ? "" : ",", config.groups[i]);
+    first = false;
+  }
+  snprintf(json + len, sizeof(json) - len, "]}");
+  server.send(200, "application/json", json);
+}
+
+// GET: where the session secret comes from. POST: key = 64 hex digits,
+// or empty to derive it from the control password again
+void handleSessionKey() {
+  if (server.method() == HTTP_POST) {
+    if (!server.hasArg("key") || !setSessionSecret(server.arg("key").c_str())) {
+      server.send(400, "application/json", "{\"success\":false,\"message\":\"Need 64 hex digits\"}");
+      return;
+    }
+    server.send(200, "application/json", "{\"success\":true}");
+    return;
+  }
+  
+  server.send(200, "application/json",
+              config.sessionSecretSource == SESSION_SECRET_PROVISIONED ?
+              "{\"source\":\"provisioned\"}" : "{\"source\":\"password\"}");
+}
+
 void handleSetPassword() {
   if (server.hasArg("password")) {
     String password = server.arg("password");
@@ -798,13 +3862,334 @@ void handleSetPassword() {
 }
 
 void setupWebServer() {
+  const char* headerKeys[] = { "If-None-Match" };
+  server.collectHeaders(headerKeys, 1);
   server.on("/", handleRoot);
   server.on("/scan", handleScan);
   server.on("/connect", HTTP_POST, handleConnect);
   server.on("/setpassword", HTTP_POST, handleSetPassword);
+  server.on("/sessionkey", handleSessionKey);
+  server.on("/brokers", handleBrokers);
+  server.on("/fleet", handleFleet);
+  server.on("/flight", handleFlight);
   server.begin();
 }
 
+// ==================== TASK SCHEDULER ====================
+// Keeps tasks[] sorted by priority so runScheduler() can walk it in order
+bool registerTask(const char* name, TaskFunction run, uint32_t periodMs, uint8_t priority) {
+  if (taskCount >= MAX_TASKS) return false;
+  
+  int slot = taskCount;
+  while (slot > 0 && tasks[slot - 1].priority > priority) {
+    tasks[slot] = tasks[slot - 1];
+    slot--;
+  }
+  
+  Task& task = tasks[slot];
+  task.name = name;
+  task.run = run;
+  task.periodUs = periodMs * 1000;
+  task.priority = priority;
+  task.nextRunUs = micros();
+  task.lastDurationUs = 0;
+  task.maxDurationUs = 0;
+  task.overruns = 0;
+  taskCount++;
+  return true;
+}
+
+void runScheduler() {
+  for (int i = 0; i < taskCount; i++) {
+    Task& task = tasks[i];
+    uint32_t start = micros();
+    if ((int32_t)(start - task.nextRunUs) < 0) continue;
+    
+    task.run();
+    
+    uint32_t end = micros();
+    task.lastDurationUs = end - start;
+    task.maxDurationUs = max(task.maxDurationUs, task.lastDurationUs);
+    if (task.periodUs == 0) continue;
+    
+    // Fixed rate: next deadline from the schedule, not from when we ran.
+    // Missed periods are skipped instead of run back-to-back.
+    task.nextRunUs += task.periodUs;
+    bool late = (int32_t)(end - task.nextRunUs) >= 0;
+    if (late && powerState != POWER_ACTIVE) {
+      late = false;  // Slept through it on purpose
+      task.nextRunUs = end + task.periodUs;
+    }
+    if (late || task.lastDurationUs > task.periodUs) {
+      task.overruns++;
+      recordFlightOverrun(i, task.lastDurationUs);
+    }
+    if (late) {
+      task.nextRunUs = end + task.periodUs;
+    }
+  }
+}
+
+uint32_t totalTaskOverruns() {
+  uint32_t total = 0;
+  for (int i = 0; i < taskCount; i++) {
+    total += tasks[i].overruns;
+  }
+  return total;
+}
+
+// ==================== TASKS ====================
+void taskUdpControl() {
+  if (!udpControlActive) return;
+  pollUdpControl();
+}
+
+void taskMqtt() {
+  if (configMode || !wifiReady) return;
+  
+  if (!mqttClient.connected()) {
+    reconnectMQTT();
+  }
+  if (mdnsStarted) MDNS.update();  // Answers queries for our own name
+  mqttClient.loop();  // Keepalive, and the first packet if any
+  for (int n = 1; n < MQTT_MAX_PACKETS_PER_PASS && espClient.available(); n++) {
+    mqttClient.loop();
+  }
+  applyPendingCommand();  // Newest setpoint from this pass only
+}
+
+void taskIrSampler() {
+  if (!edgeChecksActive() && !sensorRecording) return;  // Status publisher samples when idle
+  sampleLeftIR();
+  irSampleDue = edgeChecksActive();
+  if (sensorRecording) {
+    recordSensorSample();
+  }
+}
+
+void taskSensorFlush() {
+  if (!sensorRecording && sensorRingCount == 0) return;
+  if (millis() - lastSensorFlush < sensorFlushMs) return;
+  lastSensorFlush = millis();
+  flushSensorBatch();
+}
+
+void taskAlerts() {
+  publishPendingAlerts();
+}
+
+void taskPower() {
+  updatePowerState();
+}
+
+// Every pass, so a latched GPIO3 edge is handled without waiting a tick
+void taskObstacles() {
+  if (edgeChecksActive() && (irSampleDue || irRightEdgePending)) {
+    irSampleDue = false;
+    uint32_t start = metricStart();
+    handleObstacles();
+    recordMetric(METRIC_OBSTACLES, start);
+  }
+}
+
+void taskMotion() {
+  updateStreamDeadman();
+  updateManeuver();
+  updateMacro();
+  watchFlightState();
+}
+
+void taskMotorRamp() {
+  updateMotorRamp();
+}
+
+void taskServo() {
+  updateServoProfile();
+}
+
+void taskStatus() {
+  updateStatusPublisher();
+  if (macroReportPending) publishMacroProgress();
+  if (flightDumpPending) publishFlightDump();
+}
+
+void taskWiFi() {
+  if (configMode || wifiReady) return;
+  updateWiFiConnection();
+}
+
+void taskWebServer() {
+  if (!configMode) return;
+  uint32_t start = metricStart();
+  updateWifiScan();
+  server.handleClient();
+  recordMetric(METRIC_WEB, start);
+}
+
+void taskMetrics() {
+  publishMetrics();
+}
+
+// ==================== POWER MANAGEMENT ====================
+void notePowerActivity() {
+  lastActivityMs = millis();
+  if (powerState != POWER_ACTIVE) {
+    setPowerState(POWER_ACTIVE);
+    powerWakes++;
+  }
+}
+
+// Anything that moves, samples or listens for a deadline keeps us awake
+bool powerIdleAllowed() {
+  if (config.idleTimeoutS == 0 || configMode || !wifiReady) return false;
+  if (leftTarget != 0 || rightTarget != 0 || leftSpeed != 0 || rightSpeed != 0) return false;
+  if (autonomousMode || sensorRecording || streamState != STREAM_OFF) return false;
+  if (maneuverStep != MANEUVER_IDLE || macroState == MACRO_RUNNING || !servoSettled) return false;
+  return true;
+}
+
+// Beacons per radio wake, so the radio's wait is at most half the budget
+uint8_t powerListenInterval() {
+  uint32_t beacons = (config.wakeLatencyMs / 2) / BEACON_INTERVAL_MS;
+  return (uint8_t)constrain(beacons, 1UL, (uint32_t)MAX_LISTEN_INTERVAL);
+}
+
+uint32_t powerLoopSleepMs() {
+  return config.wakeLatencyMs / 2;
+}
+
+void setPowerState(PowerState state) {
+  if (state == powerState) return;
+  unsigned long now = millis();
+  powerStateMs[powerState] += now - powerStateSince;
+  powerStateSince = now;
+  powerState = state;
+  
+  switch (state) {
+    case POWER_ACTIVE:
+      WiFi.setSleepMode(WIFI_NONE_SLEEP);
+      break;
+    case POWER_MODEM_SLEEP:
+      WiFi.setSleepMode(WIFI_MODEM_SLEEP, powerListenInterval());
+      break;
+    case POWER_LIGHT_SLEEP:
+      WiFi.setSleepMode(WIFI_LIGHT_SLEEP, powerListenInterval());
+      break;
+    default:
+      break;
+  }
+}
+
+uint32_t powerDwellMs(PowerState state) {
+  uint32_t total = powerStateMs[state];
+  if (state == powerState) total += millis() - powerStateSince;
+  return total;
+}
+
+void applyPowerConfig(JsonObject cfg) {
+  if (cfg["idle_s"].is<int>()) {
+    config.idleTimeoutS = constrain(cfg["idle_s"].as<int>(), 0, 3600);
+  }
+  if (cfg["latency_ms"].is<int>()) {
+    config.wakeLatencyMs = constrain(cfg["latency_ms"].as<int>(),
+                                     (int)POWER_MIN_LATENCY_MS, (int)POWER_MAX_LATENCY_MS);
+  }
+  if (cfg["light"].is<bool>()) {
+    config.lightSleep = cfg["light"] ? 1 : 0;
+  }
+  saveConfig();
+}
+
+void updatePowerState() {
+  if (!powerIdleAllowed()) {
+    lastActivityMs = millis();
+    setPowerState(POWER_ACTIVE);
+    return;
+  }
+  if (powerState != POWER_ACTIVE) return;
+  if (millis() - lastActivityMs < (unsigned long)config.idleTimeoutS * 1000UL) return;
+  
+  setPowerState(config.lightSleep ? POWER_LIGHT_SLEEP : POWER_MODEM_SLEEP);
+}
+
+// ==================== METRICS ====================
+uint32_t CARBOT_HOT metricStart() {
+  return ESP.getCycleCount();
+}
+
+// Returns the measured duration in microseconds
+uint32_t CARBOT_HOT recordMetric(MetricId id, uint32_t startCycles) {
+  uint32_t us = (ESP.getCycleCount() - startCycles) / cyclesPerUs;
+  LatencyHistogram& hist = metrics[id];
+  
+  int bucket = us ? 32 - __builtin_clz(us) : 0;
+  if (bucket >= HIST_BUCKETS) bucket = HIST_BUCKETS - 1;
+  hist.buckets[bucket]++;
+  hist.count++;
+  if (us > hist.maxUs) hist.maxUs = us;
+  return us;
+}
+
+// Upper edge of the bucket holding the percentile (never above the max)
+uint32_t histogramPercentile(const LatencyHistogram& hist, uint32_t percent) {
+  if (hist.count == 0) return 0;
+  
+  uint32_t target = (hist.count * (uint64_t)percent + 99) / 100;
+  uint32_t seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += hist.buckets[b];
+    if (seen >= target) {
+      uint32_t upper = (b == 0) ? 0 : (1UL << b) - 1;
+      return min(upper, hist.maxUs);
+    }
+  }
+  return hist.maxUs;
+}
+
+void publishMetrics() {
+  if (!mqttClient.connected() || configMode) return;
+  
+  telemetryArena.reset();
+  JsonDocument doc(&telemetryArena);
+  doc["device_id"] = deviceId;
+  doc["window_ms"] = millis() - metricsWindowStart;
+  doc["loop_budget_us"] = LOOP_BUDGET_US;
+  doc["loop_over_budget"] = loopOverBudget;
+  doc["cpu_mhz"] = cyclesPerUs;
+  
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    const LatencyHistogram& hist = metrics[i];
+    if (hist.count == 0) continue;
+    JsonObject entry = doc[METRIC_NAMES[i]].to<JsonObject>();
+    entry["n"] = hist.count;
+    entry["p50"] = histogramPercentile(hist, 50);
+    entry["p99"] = histogramPercentile(hist, 99);
+    entry["max"] = hist.maxUs;
+  }
+  
+  if (publishTelemetry(metrics_topic, doc)) {
+    memset(metrics, 0, sizeof(metrics));
+    metricsWindowStart = millis();
+  }
+}
+
+void setupTasks() {
+  registerTask("mqtt", taskMqtt, 0, 0);
+  registerTask("udp", taskUdpControl, 0, 0);
+  registerTask("obstacle", taskObstacles, 0, 1);
+  registerTask("ir", taskIrSampler, IR_SAMPLE_INTERVAL_MS, 2);
+  registerTask("motion", taskMotion, MOTION_INTERVAL_MS, 3);
+  registerTask("ramp", taskMotorRamp, MOTOR_RAMP_INTERVAL_MS, 3);
+  registerTask("servo", taskServo, SERVO_INTERVAL_MS, 3);
+  registerTask("wifi", taskWiFi, WIFI_POLL_INTERVAL_MS, 4);
+  registerTask("status", taskStatus, STATUS_CHECK_INTERVAL_MS, 5);
+  registerTask("record", taskSensorFlush, SENSOR_FLUSH_CHECK_MS, 5);
+  registerTask("alerts", taskAlerts, ALERT_PUBLISH_INTERVAL_MS, 5);
+  registerTask("web", taskWebServer, WEB_SERVER_INTERVAL_MS, 6);
+  registerTask("metrics", taskMetrics, METRICS_INTERVAL_MS, 7);
+  registerTask("power", taskPower, POWER_CHECK_INTERVAL_MS, 7);
+}
+
 // ==================== SETUP ====================
 void setup() {
   // ========== STEP 1: SECURE ALL MOTOR PINS IMMEDIATELY ==========
@@ -829,7 +4214,7 @@ void setup() {
   // ========== STEP 3: START SERIAL ==========
   Serial.begin(115200);
   delay(100);
-  EEPROM.begin(512);
+  EEPROM.begin(CONFIG_EEPROM_SIZE);
   
   Serial.println("\n\n========================================");
   Serial.println("  ESP12E PHONE-CONTROLLED BOT v3.0");
@@ -839,60 +4224,24 @@ void setup() {
   Serial.println("✓ IR sensors initialized (A0, GPIO3)");
   Serial.println("⏳ ENB (GPIO1) will init after WiFi...");
   
+  loadFlightRecorder();
+  
   // ========== STEP 4: INITIALIZE SERVO ==========
-  servoMotor.attach(SERVO_PIN);
-  servoMotor.write(servoAngle);
+  servoMotor.attach(SERVO_PIN, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
+  servoPosMilli = servoAngle * 1000L;  // Unknown start, one jump is unavoidable
+  writeServoPulse();
+  servoSettledSince = millis();
   Serial.println("✓ Servo initialized on GPIO15");
   
   // ========== STEP 5: LOAD CREDENTIALS ==========
   loadCredentials();
   
-  // ========== STEP 6: WIFI CONNECTION ==========
+  // ========== STEP 6: WIFI CONNECTION (ASYNC) ==========
+  // loop() finishes the connect, then brings up MQTT and frees GPIO1/GPIO3
   if (ssid_stored.length() > 0) {
     Serial.println("\n--- Attempting WiFi Connection ---");
-    
-    while (wifiConnectionAttempts < MAX_WIFI_ATTEMPTS) {
-      if (connectToWiFi()) {
-        Serial.println("\n✅ WiFi connected successfully!");
-        
-        // Setup MQTT
-        setupMQTT();
-        reconnectMQTT();
-        
-        if (mqttClient.connected()) {
-          Serial.println("✅ MQTT connected to broker");
-        } else {
-          Serial.println("⚠ MQTT connection failed (will retry in loop)");
-        }
-        
-        // ========== STEP 7: DISABLE SERIAL & INIT ENB ==========
-        Serial.println("\n🔄 Disabling Serial to free GPIO1...");
-        Serial.println("✅ GPIO1 (ENB) will control right motor");
-        Serial.println("========================================");
-        Serial.flush();
-        delay(200);
-        
-        disableSerial();
-        
-        // NOW safe to initialize ENB on GPIO1
-        pinMode(ENB_PIN, OUTPUT);
-        digitalWrite(ENB_PIN, LOW);
-        delay(50);
-        
-        break;
-      }
-      
-      delay(1000);
-    }
-    
-    // ========== WIFI FAILED - AP MODE ==========
-    if (wifiConnectionAttempts >= MAX_WIFI_ATTEMPTS) {
-      Serial.println("\n⚠ All WiFi attempts failed!");
-      Serial.println("⚠ Starting AP mode...");
-      startConfigMode();
-      setupWebServer();
-      Serial.println("✅ AP mode active at http://192.168.4.1");
-    }
+    setupMQTT();
+    beginWiFiConnect(loadWifiCache());
     
   } else {
     // ========== NO CREDENTIALS - AP MODE ==========
@@ -907,8 +4256,11 @@ void setup() {
   }
   
   // ========== STEP 8: INITIALIZE TIMERS ==========
-  lastSensorCheck = millis();
   lastStatusTime = millis();
+  lastFullStatusTime = millis() - statusHeartbeatMs;  // Full snapshot first
+  setupTasks();
+  cyclesPerUs = ESP.getCpuFreqMHz();
+  metricsWindowStart = millis();
   
   if (serialEnabled) {
     Serial.println("\n========================================");
@@ -918,31 +4270,18 @@ void setup() {
 }
 
 // ==================== LOOP ====================
+// No trailing delay while active: returning from loop() already yields to
+// the WiFi stack
 void loop() {
-  if (configMode) {
-    server.handleClient();
-    
-  } else {
-    // ========== MQTT CONNECTION ==========
-    if (!mqttClient.connected()) {
-      reconnectMQTT();
-    }
-    mqttClient.loop();
-    
-    // ========== AUTONOMOUS OBSTACLE AVOIDANCE ==========
-    if (autonomousMode) {
-      if (millis() - lastSensorCheck > 100) {  // Check every 100ms
-        handleObstacles();
-        lastSensorCheck = millis();
-      }
-    }
-    
-    // ========== PUBLISH STATUS ==========
-    if (millis() - lastStatusTime > 2000) {
-      publishStatus();
-      lastStatusTime = millis();
-    }
+  uint32_t start = metricStart();
+  runScheduler();
+  
+  if (recordMetric(METRIC_LOOP, start) > LOOP_BUDGET_US) {
+    loopOverBudget++;
   }
   
-  delay(10);
+  // Parked: let the CPU (and in light sleep the whole chip) rest
+  if (powerState != POWER_ACTIVE) {
+    delay(powerLoopSleepMs());
+  }
 }
@@ -0,0 +1,235 @@
+/*
+ * Host-side stand-in for the ESP8266 Arduino core, used by [env:native].
+ * Only what main.cpp touches is provided. Time, GPIO, ADC and interrupts
+ * are driven by the tests through the mock* helpers.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+using std::max;
+using std::min;
+
+#define IRAM_ATTR
+#define PROGMEM
+#define PGM_P const char*
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x00
+#define OUTPUT 0x01
+#define INPUT_PULLUP 0x02
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+#define A0 17
+#define DEC 10
+#define HEX 16
+
+#define bit(b) (1UL << (b))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// ==================== MOCK HARDWARE ====================
+const int MOCK_PIN_COUNT = 18;
+
+struct MockHardware {
+  unsigned long nowUs = 0;
+  uint8_t pinModes[MOCK_PIN_COUNT] = {};
+  uint8_t pinLevels[MOCK_PIN_COUNT] = {};
+  int pwm[MOCK_PIN_COUNT] = {};
+  int analogValue = 0;
+  void (*isr[MOCK_PIN_COUNT])() = {};
+  uint32_t digitalWrites = 0;
+  uint32_t analogWrites = 0;
+  uint32_t gpioRegWrites = 0;
+};
+inline MockHardware mockHw;
+
+// GPOS/GPOC: each store sets or clears every GPIO0-15 bit in the mask
+struct MockGpioRegister {
+  uint8_t level;
+  MockGpioRegister& operator=(uint32_t mask) {
+    for (int pin = 0; pin < 16; pin++) {
+      if (mask & (1UL << pin)) mockHw.pinLevels[pin] = level;
+    }
+    mockHw.gpioRegWrites++;
+    return *this;
+  }
+};
+inline MockGpioRegister mockGpos = { HIGH };
+inline MockGpioRegister mockGpoc = { LOW };
+#define GPOS mockGpos
+#define GPOC mockGpoc
+
+inline void mockReset() { mockHw = MockHardware(); }
+inline void mockAdvanceMs(unsigned long ms) { mockHw.nowUs += ms * 1000UL; }
+inline void mockAdvanceUs(unsigned long us) { mockHw.nowUs += us; }
+inline void mockSetAnalog(int value) { mockHw.analogValue = value; }
+
+// Drives an input pin and fires its interrupt like a real edge would
+inline void mockSetPin(uint8_t pin, uint8_t level) {
+  bool changed = mockHw.pinLevels[pin] != level;
+  mockHw.pinLevels[pin] = level;
+  if (changed && mockHw.isr[pin]) mockHw.isr[pin]();
+}
+
+// ==================== CORE API ====================
+inline unsigned long millis() { return mockHw.nowUs / 1000UL; }
+inline unsigned long micros() { return mockHw.nowUs; }
+inline void delay(unsigned long ms) { mockAdvanceMs(ms); }
+inline void delayMicroseconds(unsigned int us) { mockAdvanceUs(us); }
+inline void yield() {}
+
+inline void pinMode(uint8_t pin, uint8_t mode) { mockHw.pinModes[pin] = mode; }
+inline void digitalWrite(uint8_t pin, uint8_t value) {
+  mockHw.pinLevels[pin] = value ? HIGH : LOW;
+  mockHw.digitalWrites++;
+}
+inline int digitalRead(uint8_t pin) { return mockHw.pinLevels[pin]; }
+inline int analogRead(uint8_t) { return mockHw.analogValue; }
+inline void analogWrite(uint8_t pin, int value) {
+  mockHw.pwm[pin] = value;
+  mockHw.analogWrites++;
+}
+
+inline uint8_t digitalPinToInterrupt(uint8_t pin) { return pin; }
+inline void attachInterrupt(uint8_t pin, void (*handler)(), int) { mockHw.isr[pin] = handler; }
+inline void detachInterrupt(uint8_t pin) { mockHw.isr[pin] = nullptr; }
+
+inline long random(long howBig) { return howBig > 0 ? rand() % howBig : 0; }
+inline long random(long howSmall, long howBig) { return howSmall + random(howBig - howSmall); }
+inline void randomSeed(unsigned long seed) { srand(seed); }
+
+inline long map(long x, long inMin, long inMax, long outMin, long outMax) {
+  return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+// ==================== STRING ====================
+class String {
+ public:
+  String(const char* s = "") : str(s ? s : "") {}
+  String(const std::string& s) : str(s) {}
+  String(char c) : str(1, c) {}
+  String(int value, unsigned char base = DEC) : str(format(value, base)) {}
+  String(unsigned int value, unsigned char base = DEC) : str(format(value, base)) {}
+  String(long value, unsigned char base = DEC) : str(format(value, base)) {}
+  String(unsigned long value, unsigned char base = DEC) : str(format(value, base)) {}
+  
+  unsigned int length() const { return str.size(); }
+  const char* c_str() const { return str.c_str(); }
+  bool reserve(unsigned int size) { str.reserve(size); return true; }
+  char operator[](unsigned int i) const { return str[i]; }
+  char& operator[](unsigned int i) { return str[i]; }
+  
+  String& operator+=(const String& other) { str += other.str; return *this; }
+  String& operator+=(const char* other) { str += other; return *this; }
+  String& operator+=(char c) { str += c; return *this; }
+  
+  bool operator==(const String& other) const { return str == other.str; }
+  bool operator==(const char* other) const { return str == other; }
+  bool operator!=(const String& other) const { return str != other.str; }
+  bool operator!=(const char* other) const { return str != other; }
+  
+  friend String operator+(const String& a, const String& b) { return String(a.str + b.str); }
+  friend String operator+(const String& a, const char* b) { return String(a.str + b); }
+  friend String operator+(const char* a, const String& b) { return String(a + b.str); }
+  
+ private:
+  static std::string format(long value, unsigned char base) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), base == HEX ? "%lx" : "%ld", value);
+    return buf;
+  }
+  std::string str;
+};
+
+// ==================== PRINT / SERIAL ====================
+class IPAddress;
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+  template <typename T> size_t print(const T&) { return 0; }
+  template <typename T> size_t print(const T&, int) { return 0; }
+  template <typename T> size_t println(const T&) { return 0; }
+  size_t println() { return 0; }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  void setTimeout(unsigned long timeout) { timeoutMs = timeout; }
+  unsigned long timeoutMs = 1000;
+};
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long) {}
+  void end() {}
+  void flush() {}
+  size_t write(uint8_t) override { return 1; }
+  using Print::write;
+};
+inline HardwareSerial Serial;
+
+// ==================== ESP ====================
+struct rst_info {
+  uint32_t reason;
+  uint32_t exccause;
+  uint32_t epc1, epc2, epc3, excvaddr, depc;
+};
+
+class EspClass {
+ public:
+  uint32_t getFreeHeap() { return 40000; }
+  uint8_t getHeapFragmentation() { return 0; }
+  uint32_t getMaxFreeBlockSize() { return 38000; }
+  uint32_t getChipId() { return 0x00C0FFEE; }
+  uint8_t getCpuFreqMHz() { return 80; }
+  void restart() { restarts++; }
+  uint32_t random() { return randomState = randomState * 1664525u + 1013904223u; }  // LCG, replays identically
+  
+  // Real elapsed time, so benchmarks measure host cost at 80 "MHz"
+  uint32_t getCycleCount() {
+    using namespace std::chrono;
+    return (uint32_t)(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count() * 80 / 1000);
+  }
+  
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size) {
+    if (offset * 4 + size > sizeof(rtc)) return false;
+    memcpy(data, rtc + offset * 4, size);
+    return true;
+  }
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size) {
+    if (offset * 4 + size > sizeof(rtc)) return false;
+    memcpy(rtc + offset * 4, data, size);
+    return true;
+  }
+  
+  rst_info* getResetInfoPtr() { return &resetInfo; }
+  
+  uint8_t rtc[512] = {};
+  rst_info resetInfo = {};
+  uint32_t restarts = 0;
+  uint32_t randomState = 1;
+};
+inline EspClass ESP;
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <Arduino.h>
+
+class EEPROMClass {
+ public:
+  void begin(size_t size) { this->size = size; }
+  uint8_t read(int address) { return data[address]; }
+  void write(int address, uint8_t value) { data[address] = value; }
+  bool commit() { commits++; return true; }
+  const uint8_t* getConstDataPtr() const { return data; }
+  
+  template <typename T> T& get(int address, T& t) {
+    memcpy(&t, data + address, sizeof(T));
+    return t;
+  }
+  template <typename T> const T& put(int address, const T& t) {
+    memcpy(data + address, &t, sizeof(T));
+    return t;
+  }
+  
+  uint8_t data[4096] = {};
+  size_t size = 0;
+  uint32_t commits = 0;
+};
+inline EEPROMClass EEPROM;
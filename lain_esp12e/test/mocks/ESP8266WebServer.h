@@ -0,0 +1,58 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_POST };
+
+class ESP8266WebServer {
+ public:
+  typedef std::function<void(void)> THandlerFunction;
+  
+  explicit ESP8266WebServer(int) {}
+  void on(const char*, THandlerFunction) {}
+  void on(const char*, HTTPMethod, THandlerFunction) {}
+  void begin() {}
+  void handleClient() {}
+  
+  HTTPMethod method() { return requestMethod; }
+  bool hasArg(const String& name) { return args.count(name.c_str()) > 0; }
+  String arg(const String& name) {
+    auto it = args.find(name.c_str());
+    return it != args.end() ? String(it->second) : String();
+  }
+  void collectHeaders(const char**, size_t) {}
+  String header(const String&) { return requestHeader; }
+  void sendHeader(const String&, const String&, bool = false) { headersSent++; }
+  void send(int code) { lastCode = code; lastLength = 0; }
+  void send(int code, const char*, const String&) { lastCode = code; }
+  void send(int code, const char*, const char* content) {
+    lastCode = code;
+    body = content;
+  }
+  void send_P(int code, const char*, const char*, size_t length) {
+    lastCode = code;
+    lastLength = length;
+  }
+  
+  bool chunkedResponseModeStart(int code, const char*) {
+    lastCode = code;
+    body.clear();
+    return true;
+  }
+  void sendContent(const char* content) { body += content; chunks++; }
+  void sendContent(const char* content, size_t size) { body.append(content, size); chunks++; }
+  void chunkedResponseFinalize() {}
+  
+  HTTPMethod requestMethod = HTTP_GET;
+  std::map<std::string, std::string> args;
+  String requestHeader;   // Value returned for any request header
+  int lastCode = 0;
+  size_t lastLength = 0;
+  int headersSent = 0;
+  std::string body;       // Last chunked response
+  int chunks = 0;
+};
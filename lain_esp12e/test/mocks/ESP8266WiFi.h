@@ -0,0 +1,111 @@
+#pragma once
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#define WIFI_SCAN_RUNNING (-1)
+#define WIFI_SCAN_FAILED (-2)
+
+enum WiFiMode_t { WIFI_OFF, WIFI_STA, WIFI_AP, WIFI_AP_STA };
+enum WiFiSleepType_t { WIFI_NONE_SLEEP = 0, WIFI_LIGHT_SLEEP = 1, WIFI_MODEM_SLEEP = 2 };
+enum wl_status_t {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_WRONG_PASSWORD = 6,
+  WL_DISCONNECTED = 7
+};
+
+class Client : public Stream {
+ public:
+  size_t write(uint8_t) override { return 1; }
+  using Print::write;
+};
+
+class WiFiClient : public Client {
+ public:
+  int available() override { return inboundBytes; }
+  int availableForWrite() { return sendBufferFree; }
+  int inboundBytes = 0;       // Unread bytes, fed by the PubSubClient mock
+  int sendBufferFree = 2920;  // Two full TCP segments
+};
+
+class ESP8266WiFiClass {
+ public:
+  bool mode(WiFiMode_t m) { wifiMode = m; return true; }
+  bool persistent(bool) { return true; }
+  bool config(IPAddress ip, IPAddress, IPAddress, IPAddress = IPAddress()) {
+    staticIp = ip;
+    return true;
+  }
+  wl_status_t begin(const char*, const char* = nullptr, int32_t channel = 0,
+                    const uint8_t* bssid = nullptr, bool = true) {
+    begins++;
+    lastChannel = channel;
+    lastBssidPinned = bssid != nullptr;
+    return wifiStatus;
+  }
+  wl_status_t status() { return wifiStatus; }
+  
+  IPAddress localIP() { return IPAddress(192, 168, 1, 50); }
+  IPAddress gatewayIP() { return IPAddress(192, 168, 1, 1); }
+  IPAddress subnetMask() { return IPAddress(255, 255, 255, 0); }
+  IPAddress dnsIP(uint8_t = 0) { return IPAddress(192, 168, 1, 1); }
+  IPAddress softAPIP() { return IPAddress(192, 168, 4, 1); }
+  uint8_t* BSSID() { return bssid; }
+  int32_t channel() { return 6; }
+  int32_t RSSI() { return -55; }
+  int32_t RSSI(uint8_t i) { return i < scanResults.size() ? scanResults[i].rssi : 0; }
+  String SSID(uint8_t i) { return i < scanResults.size() ? String(scanResults[i].ssid) : String(); }
+  
+  // Only names in `hosts` resolve; anything else fails like a DNS timeout
+  int hostByName(const char* name, IPAddress& result, uint32_t = 10000) {
+    lookups++;
+    auto it = hosts.find(name);
+    if (it == hosts.end()) return 0;
+    result = it->second;
+    return 1;
+  }
+  
+  // Async scans finish when the test sets scanDone
+  int8_t scanNetworks(bool async = false, bool = false) {
+    scans++;
+    if (async && !scanDone) return WIFI_SCAN_RUNNING;
+    return (int8_t)scanResults.size();
+  }
+  int8_t scanComplete() { return scanDone ? (int8_t)scanResults.size() : WIFI_SCAN_RUNNING; }
+  void scanDelete() {}
+  bool softAP(const char*, const char* = nullptr) { return true; }
+  bool setSleepMode(WiFiSleepType_t type, uint8_t listenInterval = 0) {
+    sleepType = type;
+    sleepListenInterval = listenInterval;
+    return true;
+  }
+  
+  wl_status_t wifiStatus = WL_DISCONNECTED;
+  WiFiMode_t wifiMode = WIFI_OFF;
+  IPAddress staticIp;
+  uint8_t bssid[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+  int32_t lastChannel = 0;
+  bool lastBssidPinned = false;
+  uint32_t begins = 0;
+  WiFiSleepType_t sleepType = WIFI_NONE_SLEEP;
+  uint8_t sleepListenInterval = 0;
+  
+  struct ScanResult {
+    std::string ssid;
+    int32_t rssi;
+  };
+  std::map<std::string, IPAddress> hosts;
+  uint32_t lookups = 0;
+  std::vector<ScanResult> scanResults;
+  bool scanDone = false;
+  uint32_t scans = 0;
+};
+inline ESP8266WiFiClass WiFi;
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+
+class IPAddress {
+ public:
+  IPAddress() {}
+  IPAddress(uint32_t value) : address(value) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : address(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  
+  operator uint32_t() const { return address; }
+  uint8_t operator[](int index) const { return (address >> (8 * index)) & 0xFF; }
+  bool isSet() const { return address != 0; }
+  String toString() const {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+    return String(buf);
+  }
+  
+ private:
+  uint32_t address = 0;
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+
+// Records publishes and lets tests inject inbound messages. Like the real
+// client, each loop() reads at most one packet; injected bytes show up in
+// the WiFiClient's available() until then.
+class PubSubClient {
+ public:
+  struct Message {
+    std::string topic;
+    std::string payload;
+  };
+  
+  explicit PubSubClient(WiFiClient& client) : client(client) {}
+  
+  PubSubClient& setServer(const char* host, uint16_t port) {
+    serverHost = host;
+    serverPort = port;
+    return *this;
+  }
+  PubSubClient& setServer(IPAddress ip, uint16_t port) {
+    serverHost = ip.toString().c_str();
+    serverPort = port;
+    return *this;
+  }
+  PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE) { this->callback = callback; return *this; }
+  PubSubClient& setSocketTimeout(uint16_t timeout) { socketTimeoutS = timeout; return *this; }
+  PubSubClient& setKeepAlive(uint16_t) { return *this; }
+  bool setBufferSize(uint16_t size) { bufferSize = size; return true; }
+  
+  // Hosts in `unreachable` fail; `connectDelayMs` advances mock time
+  bool connect(const char*, const char* = nullptr, const char* = nullptr) {
+    connectAttempts++;
+    auto delayMs = connectDelayMs.find(serverHost);
+    if (delayMs != connectDelayMs.end()) mockAdvanceMs(delayMs->second);
+    isConnected = acceptConnect && !unreachable.count(serverHost);
+    return isConnected;
+  }
+  void disconnect() { isConnected = false; }
+  bool connected() { return isConnected; }
+  int state() { return isConnected ? 0 : -1; }
+  
+  bool subscribe(const char* topic) { subscriptions.push_back(topic); return true; }
+  bool unsubscribe(const char*) { return true; }
+  
+  bool publish(const char* topic, const char* payload) {
+    return publish(topic, (const uint8_t*)payload, strlen(payload));
+  }
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length) {
+    if (!isConnected) return false;
+    published.push_back({topic, std::string((const char*)payload, length)});
+    return true;
+  }
+  
+  bool loop() {
+    loops++;
+    if (inbound.empty()) return isConnected;
+    Message msg = inbound.front();
+    inbound.erase(inbound.begin());
+    client.inboundBytes -= packetSize(msg);
+    callback((char*)msg.topic.c_str(), (uint8_t*)&msg.payload[0], msg.payload.size());
+    return isConnected;
+  }
+  
+  void inject(const char* topic, const std::string& payload) {
+    inbound.push_back({topic, payload});
+    client.inboundBytes += packetSize(inbound.back());
+  }
+  static int packetSize(const Message& msg) { return 4 + msg.topic.size() + msg.payload.size(); }
+  
+  WiFiClient& client;
+  uint32_t loops = 0;
+  
+  void (*callback)(char*, uint8_t*, unsigned int) = nullptr;
+  bool isConnected = false;
+  bool acceptConnect = true;
+  uint32_t connectAttempts = 0;
+  uint16_t socketTimeoutS = 15;
+  uint16_t bufferSize = 256;
+  std::string serverHost;
+  uint16_t serverPort = 0;
+  std::set<std::string> unreachable;
+  std::map<std::string, unsigned long> connectDelayMs;
+  std::vector<std::string> subscriptions;
+  std::vector<Message> published;
+  std::vector<Message> inbound;
+};
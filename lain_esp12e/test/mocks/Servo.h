@@ -0,0 +1,31 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Like the ESP8266 core: attach(pin) keeps the 1000-2000us default range
+// and writeMicroseconds clamps to whatever range was attached
+class Servo {
+ public:
+  uint8_t attach(int pin) { return attach(pin, 1000, 2000); }
+  uint8_t attach(int pin, int minUs, int maxUs) {
+    attachedPin = pin;
+    minPulseUs = minUs;
+    maxPulseUs = maxUs;
+    return 1;
+  }
+  void detach() { attachedPin = -1; }
+  bool attached() { return attachedPin >= 0; }
+  void write(int value) { angle = value; writes++; }
+  void writeMicroseconds(int value) {
+    pulseUs = value < minPulseUs ? minPulseUs : value > maxPulseUs ? maxPulseUs : value;
+    writes++;
+  }
+  int read() { return angle; }
+  
+  int attachedPin = -1;
+  int minPulseUs = 1000;
+  int maxPulseUs = 2000;
+  int angle = 0;
+  int pulseUs = 0;
+  uint32_t writes = 0;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+#include <deque>
+#include <string>
+
+// Datagrams queued with inject() are returned one per parsePacket()
+class WiFiUDP : public Stream {
+ public:
+  uint8_t begin(uint16_t port) {
+    localPort = port;
+    listening = true;
+    return 1;
+  }
+  void stop() { listening = false; }
+  
+  int parsePacket() {
+    if (!current.empty()) inbound.pop_front();  // Unread rest is dropped
+    current.clear();
+    if (!listening || inbound.empty()) return 0;
+    current = inbound.front();
+    return (int)current.size();
+  }
+  int read(unsigned char* buffer, size_t length) {
+    size_t n = std::min(length, current.size());
+    memcpy(buffer, current.data(), n);
+    inbound.pop_front();
+    current.clear();
+    return (int)n;
+  }
+  int read() override { return -1; }
+  int available() override { return (int)current.size(); }
+  size_t write(uint8_t) override { return 1; }
+  using Print::write;
+  
+  void inject(const std::string& datagram) { inbound.push_back(datagram); }
+  
+  std::deque<std::string> inbound;
+  std::string current;
+  uint16_t localPort = 0;
+  bool listening = false;
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+// HMAC-SHA256 subset of the BearSSL API that ships with the ESP8266 core.
+// Same calls and results; the contexts just keep the message around.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+struct br_hash_class {
+  size_t desc;
+};
+inline const br_hash_class br_sha256_vtable = {32};
+
+namespace mock_sha256 {
+inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+inline void digest(const uint8_t* data, size_t len, uint8_t out[32]) {
+  static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+  uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+  std::vector<uint8_t> msg(data, data + len);
+  msg.push_back(0x80);
+  while (msg.size() % 64 != 56) msg.push_back(0);
+  uint64_t bits = (uint64_t)len * 8;
+  for (int i = 7; i >= 0; i--) msg.push_back((uint8_t)(bits >> (i * 8)));
+
+  for (size_t block = 0; block < msg.size(); block += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      const uint8_t* p = &msg[block + i * 4];
+      w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+      uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+  }
+  for (int i = 0; i < 8; i++) {
+    out[i * 4] = h[i] >> 24;
+    out[i * 4 + 1] = h[i] >> 16;
+    out[i * 4 + 2] = h[i] >> 8;
+    out[i * 4 + 3] = h[i];
+  }
+}
+}  // namespace mock_sha256
+
+struct br_hmac_key_context {
+  uint8_t key[64];
+};
+
+struct br_hmac_context {
+  const br_hmac_key_context* kc;
+  size_t outLen;
+  std::vector<uint8_t> data;
+};
+
+inline void br_hmac_key_init(br_hmac_key_context* kc, const br_hash_class*, const void* key, size_t keyLen) {
+  memset(kc->key, 0, sizeof(kc->key));
+  if (keyLen > 64) {
+    mock_sha256::digest((const uint8_t*)key, keyLen, kc->key);
+  } else {
+    memcpy(kc->key, key, keyLen);
+  }
+}
+
+inline void br_hmac_init(br_hmac_context* ctx, const br_hmac_key_context* kc, size_t outLen) {
+  ctx->kc = kc;
+  ctx->outLen = (outLen == 0 || outLen > 32) ? 32 : outLen;
+  ctx->data.clear();
+}
+
+inline void br_hmac_update(br_hmac_context* ctx, const void* data, size_t len) {
+  ctx->data.insert(ctx->data.end(), (const uint8_t*)data, (const uint8_t*)data + len);
+}
+
+inline size_t br_hmac_out(const br_hmac_context* ctx, void* out) {
+  std::vector<uint8_t> inner(64);
+  for (int i = 0; i < 64; i++) inner[i] = ctx->kc->key[i] ^ 0x36;
+  inner.insert(inner.end(), ctx->data.begin(), ctx->data.end());
+  uint8_t innerHash[32];
+  mock_sha256::digest(inner.data(), inner.size(), innerHash);
+
+  std::vector<uint8_t> outer(64);
+  for (int i = 0; i < 64; i++) outer[i] = ctx->kc->key[i] ^ 0x5c;
+  outer.insert(outer.end(), innerHash, innerHash + 32);
+  uint8_t mac[32];
+  mock_sha256::digest(outer.data(), outer.size(), mac);
+  memcpy(out, mac, ctx->outLen);
+  return ctx->outLen;
+}
@@ -0,0 +1,1569 @@
+/*
+ * ========================================
+ *   HOST BENCHMARKS + CONTROL-PATH CHECKS
+ *   Run with: pio test -e native -v
+ * ========================================
+ *
+ * main.cpp is compiled into this file so the tests can reach its globals.
+ * Hardware, WiFi and MQTT come from test/mocks; time only moves when a
+ * test calls mockAdvanceMs(), so the recorded traces replay identically.
+ */
+
+#include <unity.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "../../src/main.cpp"
+
+// ==================== HELPERS ====================
+const unsigned long TRACE_START_MS = 10000;  // Past the boot-time obstacle cooldown
+const unsigned long TRACE_FRAME_MS = 33;     // ~30 Hz, like the PS5 controller
+
+struct TraceFrame {
+  int left;
+  int right;
+  int servo;
+  uint16_t seq;
+};
+
+// Joystick sweep: forward ramp, arcs both ways, reverse, stop
+std::vector<TraceFrame> buildTeleopTrace(size_t frames) {
+  std::vector<TraceFrame> trace;
+  for (size_t i = 0; i < frames; i++) {
+    int phase = i % 200;
+    int throttle = phase < 100 ? phase : 200 - phase;   // 0..100..0
+    int turn = (int)(i % 50) - 25;                      // -25..24
+    if ((i / 200) % 2) throttle = -throttle;
+    TraceFrame f;
+    f.left = constrain(throttle + turn, -100, 100);
+    f.right = constrain(throttle - turn, -100, 100);
+    f.servo = 60 + (int)(i % 121);
+    f.seq = (uint16_t)(i + 1);
+    trace.push_back(f);
+  }
+  return trace;
+}
+
+std::string jsonFrame(const TraceFrame& f, unsigned long ts) {
+  char buf[160];
+  snprintf(buf, sizeof(buf),
+           "{\"password\":\"1234\",\"left\":%d,\"right\":%d,\"servo\":%d,\"seq\":%u,\"ts\":%lu}",
+           f.left, f.right, f.servo, f.seq, ts);
+  return buf;
+}
+
+std::string binaryFrame(const TraceFrame& f, uint8_t flags = CMD_FLAG_MOTORS | CMD_FLAG_SERVO) {
+  CommandFrame frame;
+  frame.magic = CMD_FRAME_MAGIC;
+  frame.version = CMD_FRAME_VERSION;
+  frame.seq = f.seq;
+  frame.left = (int8_t)f.left;
+  frame.right = (int8_t)f.right;
+  frame.servo = (uint8_t)f.servo;
+  frame.flags = flags;
+  frame.tag = computeFrameTag((const byte*)&frame);
+  return std::string((const char*)&frame, sizeof(frame));
+}
+
+void deliver(const std::string& payload) {
+  mqttCallback((char*)command_topic, (byte*)&payload[0], payload.size());
+}
+
+// Puts the firmware into "WiFi + MQTT up, bot idle" at TRACE_START_MS
+void resetFirmware() {
+  mockReset();
+  mockAdvanceMs(TRACE_START_MS);
+
+  configMode = false;
+  wifiReady = true;
+  mqttClient.isConnected = true;
+  mqttClient.published.clear();
+  mqttClient.inbound.clear();
+  espClient.inboundBytes = 0;
+  setupMQTT();
+
+  EEPROM = EEPROMClass();
+  config = defaultConfig();  // Control password "1234"
+  for (BrokerStats& stats : brokerStats) stats = {};
+  WiFi.hosts = {{mqtt_server, IPAddress(10, 0, 0, 1)}};
+  WiFi.lookups = 0;
+  brokerRoundTried = 0;
+  currentBroker = -1;
+  mqttOutage = false;  // Connected; the next drop starts a fresh backoff
+  mqttBackoffMs = MQTT_BACKOFF_MIN_MS;
+  mdnsBrokerPort = 0;
+  MDNS.services.clear();
+  mqttClient.unreachable.clear();
+  mqttClient.connectDelayMs.clear();
+  sensorRecording = false;
+  sensorRingCount = 0;
+  sensorSamplesDropped = sensorBackpressureWaits = sensorBatchesSent = 0;
+  loopAlerts = {};
+  isrAlerts = {};
+  memset(alertSlots, 0, sizeof(alertSlots));
+  alertsPublished = alertsCoalesced = alertBackpressureWaits = 0;
+  telemetryOversize = 0;
+  espClient.sendBufferFree = 2920;
+  powerState = POWER_ACTIVE;
+  powerStateSince = lastActivityMs = millis();
+  memset(powerStateMs, 0, sizeof(powerStateMs));
+  powerWakes = 0;
+  groupCommandsReceived = 0;
+  activeSession = {};
+  memset(pendingSessions, 0, sizeof(pendingSessions));
+  authHandshakes = authFailures = authReplays = authLegacyRefused = authHellosRefused = 0;
+  deriveSessionSecret();
+  macroState = MACRO_IDLE;
+  macroLength = 0;
+  macroReportPending = false;
+  macroRejected = 0;
+  memset(ESP.rtc, 0, sizeof(ESP.rtc));
+  ESP.resetInfo = {};
+  flightIrBits = 0;
+  flightManeuver = MANEUVER_IDLE;
+  flightDumpPending = false;
+  setLatencyEcho(false);
+  loadFlightRecorder();
+  WiFi.sleepType = WIFI_NONE_SLEEP;
+
+  autonomousMode = false;
+  maneuverStep = MANEUVER_IDLE;
+  lastObstacleAction = 0;
+  irRightEdgePending = false;
+  irSampleDue = false;
+  irLeftBlocked = false;
+  irFilterSeeded = false;
+  mockSetAnalog(60);
+  streamState = STREAM_OFF;
+
+  pendingCommand = {};
+  directCommands = {};
+  memset(groupCommands, 0, sizeof(groupCommands));
+  cmdDroppedOutOfOrder = 0;
+  cmdDroppedStale = 0;
+  cmdCoalesced = 0;
+
+  servoAngle = 90;
+  servoPosMilli = 90000;
+  servoVelMilli = 0;
+  servoMaxSpeed = 240;
+  servoAccel = 1200;
+  servoDetachMs = 400;
+  servoSettled = true;
+  servoSettledSince = millis();
+  servoPulseUs = -1;
+  servoDetaches = 0;
+  servoMotor.attach(SERVO_PIN, SERVO_MIN_PULSE_US, SERVO_MAX_PULSE_US);
+  motorAccelRate = 600;
+  motorBrakeRate = 1000;
+  motorBrakeActive = false;
+  leftRampMilli = rightRampMilli = 0;
+  lastRampStep = millis();
+  bridge = {};  // mockReset() dropped every pin low
+  applyConfig();
+  stopMotors();
+  writeMotorOutputs(0, 0);
+}
+
+// Run the ramp task for ms milliseconds at its own period
+void runRamp(unsigned long ms) {
+  for (unsigned long t = 0; t < ms; t += MOTOR_RAMP_INTERVAL_MS) {
+    mockAdvanceMs(MOTOR_RAMP_INTERVAL_MS);
+    taskMotorRamp();
+  }
+}
+
+size_t countPublished(const char* topic) {
+  size_t n = 0;
+  for (const PubSubClient::Message& msg : mqttClient.published) {
+    if (msg.topic == topic) n++;
+  }
+  return n;
+}
+
+// ==================== BENCH HARNESS ====================
+template <typename Fn>
+void bench(const char* name, size_t iterations, Fn body) {
+  using namespace std::chrono;
+  std::vector<double> samples;
+  samples.reserve(iterations);
+
+  for (size_t i = 0; i < iterations; i++) {
+    steady_clock::time_point start = steady_clock::now();
+    body(i);
+    samples.push_back(duration<double, std::nano>(steady_clock::now() - start).count());
+  }
+
+  std::sort(samples.begin(), samples.end());
+  double total = 0;
+  for (double s : samples) total += s;
+
+  char line[160];
+  snprintf(line, sizeof(line), "[bench] %-20s n=%-6zu mean=%8.0f ns  p50=%8.0f ns  p99=%8.0f ns  max=%8.0f ns",
+           name, iterations, total / iterations, samples[iterations / 2],
+           samples[(iterations * 99) / 100], samples.back());
+  TEST_MESSAGE(line);
+}
+
+// ==================== CORRECTNESS ====================
+void test_binary_frame_sets_motors_and_servo() {
+  resetFirmware();
+  std::string frame = binaryFrame({70, -30, 120, 1});
+  uint32_t tag;
+  memcpy(&tag, &frame[offsetof(CommandFrame, tag)], sizeof(tag));
+  TEST_ASSERT_EQUAL_HEX32(0x70b692f0, tag);  // HMAC-SHA256("1234", bytes 0..7)[0..3], as latency_bench.py
+  deliver(frame);
+  applyPendingCommand();
+
+  TEST_ASSERT_EQUAL(70, leftTarget);
+  TEST_ASSERT_EQUAL(-30, rightTarget);
+  TEST_ASSERT_EQUAL(120, servoAngle);
+}
+
+void test_binary_frame_with_bad_tag_is_ignored() {
+  resetFirmware();
+  std::string frame = binaryFrame({70, 70, 90, 1});
+  frame[sizeof(CommandFrame) - 1] ^= 0x5A;
+  deliver(frame);
+  applyPendingCommand();
+
+  TEST_ASSERT_EQUAL(0, leftTarget);
+  TEST_ASSERT_EQUAL(0, rightTarget);
+}
+
+void test_json_and_binary_traces_end_in_same_state() {
+  std::vector<TraceFrame> trace = buildTeleopTrace(300);
+
+  resetFirmware();
+  for (const TraceFrame& f : trace) {
+    deliver(jsonFrame(f, millis()));
+    applyPendingCommand();
+    mockAdvanceMs(TRACE_FRAME_MS);
+  }
+  int jsonLeft = leftTarget, jsonRight = rightTarget, jsonServo = servoAngle;
+
+  resetFirmware();
+  for (const TraceFrame& f : trace) {
+    deliver(binaryFrame(f));
+    applyPendingCommand();
+    mockAdvanceMs(TRACE_FRAME_MS);
+  }
+
+  TEST_ASSERT_EQUAL(jsonLeft, leftTarget);
+  TEST_ASSERT_EQUAL(jsonRight, rightTarget);
+  TEST_ASSERT_EQUAL(jsonServo, servoAngle);
+}
+
+void test_setpoints_coalesce_within_one_loop_pass() {
+  resetFirmware();
+  mqttClient.inject(command_topic, binaryFrame({10, 10, 90, 1}));
+  mqttClient.inject(command_topic, binaryFrame({20, 20, 90, 2}));
+  mqttClient.inject(command_topic, binaryFrame({30, 30, 90, 3}));
+  uint32_t loops = mqttClient.loops;
+  taskMqtt();
+
+  TEST_ASSERT_EQUAL(3, mqttClient.loops - loops);  // One packet per loop(), all drained
+  TEST_ASSERT_EQUAL(30, leftTarget);
+  TEST_ASSERT_EQUAL(30, rightTarget);
+  TEST_ASSERT_EQUAL(4, cmdCoalesced);  // 2 motor + 2 servo replacements
+
+  // A burst larger than one pass leaves the rest for the next one
+  for (uint16_t seq = 4; seq < 4 + MQTT_MAX_PACKETS_PER_PASS + 2; seq++) {
+    mqttClient.inject(command_topic, binaryFrame({(int)seq, (int)seq, 90, seq}));
+  }
+  taskMqtt();
+  TEST_ASSERT_EQUAL(3 + MQTT_MAX_PACKETS_PER_PASS, leftTarget);
+  TEST_ASSERT_EQUAL(2, mqttClient.inbound.size());
+  taskMqtt();
+  TEST_ASSERT_EQUAL(5 + MQTT_MAX_PACKETS_PER_PASS, leftTarget);
+}
+
+void test_reordered_and_stale_frames_are_dropped() {
+  resetFirmware();
+  deliver(jsonFrame({40, 40, 90, 5}, millis()));
+  applyPendingCommand();
+
+  deliver(jsonFrame({90, 90, 90, 4}, millis()));  // Older seq
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(40, leftTarget);
+  TEST_ASSERT_EQUAL(1, cmdDroppedOutOfOrder);
+
+  unsigned long sentAt = millis();
+  mockAdvanceMs(COMMAND_MAX_AGE_MS + 50);          // Delivered late
+  deliver(jsonFrame({90, 90, 90, 6}, sentAt));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(40, leftTarget);
+  TEST_ASSERT_EQUAL(1, cmdDroppedStale);
+}
+
+void test_maneuver_steps_without_blocking() {
+  resetFirmware();
+  autonomousMode = true;
+  setMotorSpeeds(50, 50);
+  runRamp(200);
+  TEST_ASSERT_EQUAL(50, leftSpeed);
+  mockSetPin(IR_RIGHT_PIN, HIGH);
+  attachIrRightInterrupt();
+  mockSetPin(IR_RIGHT_PIN, LOW);
+  mockSetPin(IR_RIGHT_PIN, HIGH);  // Edge latched by the ISR
+
+  taskObstacles();
+  TEST_ASSERT_EQUAL(MANEUVER_BRAKE, maneuverStep);
+  TEST_ASSERT_EQUAL(0, leftSpeed);  // Brake-now skips the ramp
+  TEST_ASSERT_TRUE(motorBrakeActive);
+  TEST_ASSERT_EQUAL(HIGH, mockHw.pinLevels[IN1_PIN]);
+  TEST_ASSERT_EQUAL(HIGH, mockHw.pinLevels[IN2_PIN]);
+
+  mockAdvanceMs(MANEUVER_BRAKE_MS);
+  taskMotion();
+  TEST_ASSERT_EQUAL(MANEUVER_SETTLE, maneuverStep);
+  TEST_ASSERT_FALSE(motorBrakeActive);
+
+  mockAdvanceMs(MANEUVER_SETTLE_MS);
+  taskMotion();
+  TEST_ASSERT_EQUAL(MANEUVER_TURN, maneuverStep);
+  TEST_ASSERT_EQUAL(-40, leftTarget);
+  TEST_ASSERT_EQUAL(60, rightTarget);
+  TEST_ASSERT_EQUAL(0, countPublished(sensor_topic));  // Queued, not sent inline
+  taskAlerts();
+  TEST_ASSERT_EQUAL(2, countPublished(sensor_topic));  // ISR edge + maneuver alert
+
+  mockAdvanceMs(MANEUVER_TURN_MS);
+  taskMotion();
+  TEST_ASSERT_EQUAL(MANEUVER_FORWARD, maneuverStep);
+
+  mockAdvanceMs(MANEUVER_FORWARD_MS);
+  taskMotion();
+  TEST_ASSERT_EQUAL(MANEUVER_IDLE, maneuverStep);
+  TEST_ASSERT_EQUAL(0, leftTarget);
+}
+
+void test_operator_command_cancels_maneuver() {
+  resetFirmware();
+  autonomousMode = true;
+  setMotorSpeeds(50, 50);
+  irRightEdgePending = true;
+  taskObstacles();
+  TEST_ASSERT_EQUAL(MANEUVER_BRAKE, maneuverStep);
+
+  deliver(binaryFrame({0, 0, 90, 1}, CMD_FLAG_STOP));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(MANEUVER_IDLE, maneuverStep);
+  TEST_ASSERT_EQUAL(0, leftTarget);
+}
+
+void test_ramp_respects_accel_and_brake_limits() {
+  resetFirmware();
+  setMotorSpeeds(100, 100);
+  runRamp(MOTOR_RAMP_INTERVAL_MS);
+  TEST_ASSERT_EQUAL(6, leftSpeed);   // 600 %/s for 10 ms
+  runRamp(200);
+  TEST_ASSERT_EQUAL(100, leftSpeed);
+
+  // Reversal brakes to zero at 1000 %/s before accelerating again
+  setMotorSpeeds(-100, -100);
+  runRamp(50);
+  TEST_ASSERT_EQUAL(50, leftSpeed);
+  runRamp(50);
+  TEST_ASSERT_EQUAL(0, leftSpeed);
+  runRamp(MOTOR_RAMP_INTERVAL_MS);
+  TEST_ASSERT_EQUAL(-6, leftSpeed);
+}
+
+void test_driver_writes_only_changed_outputs() {
+  resetFirmware();
+  writeMotorOutputs(100, -1);
+  TEST_ASSERT_EQUAL(HIGH, mockHw.pinLevels[IN2_PIN]);
+  TEST_ASSERT_EQUAL(HIGH, mockHw.pinLevels[IN4_PIN]);
+  TEST_ASSERT_EQUAL(255, mockHw.pwm[ENA_PIN]);
+  TEST_ASSERT_EQUAL(85, mockHw.pwm[ENB_PIN]);
+
+  uint32_t gpio = mockHw.gpioRegWrites, digital = mockHw.digitalWrites, pwm = mockHw.analogWrites;
+  writeMotorOutputs(100, -1);
+  TEST_ASSERT_EQUAL(gpio, mockHw.gpioRegWrites);
+  TEST_ASSERT_EQUAL(digital, mockHw.digitalWrites);
+  TEST_ASSERT_EQUAL(pwm, mockHw.analogWrites);
+
+  writeMotorOutputs(90, -1);  // Duty only
+  TEST_ASSERT_EQUAL(gpio, mockHw.gpioRegWrites);
+  TEST_ASSERT_EQUAL(pwm + 1, mockHw.analogWrites);
+
+  setMotorDeadband(MOTOR_RIGHT, 120);
+  TEST_ASSERT_EQUAL(120, mockHw.pwm[ENB_PIN]);
+  TEST_ASSERT_EQUAL(0, motorDuty[MOTOR_RIGHT].duty[0]);
+}
+
+void test_servo_eases_to_target_and_detaches_when_settled() {
+  resetFirmware();
+  deliver("{\"password\":\"1234\",\"servo\":200}");
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(SERVO_MAX_ANGLE, servoAngle);  // Range still enforced
+  TEST_ASSERT_EQUAL(90000, servoPosMilli);         // Nothing jumps
+
+  // Speeds up, never exceeds the max, stops on target without overshoot
+  long lastPos = servoPosMilli, lastStep = 0, peakStep = 0;
+  int steps = 0;
+  while (!servoSettled && steps < 100) {
+    mockAdvanceMs(SERVO_INTERVAL_MS);
+    taskServo();
+    long step = servoPosMilli - lastPos;
+    TEST_ASSERT_TRUE(step >= 0);
+    TEST_ASSERT_TRUE(step <= servoMaxSpeed * (long)SERVO_INTERVAL_MS);
+    if (steps == 1) TEST_ASSERT_TRUE(step > lastStep);
+    peakStep = max(peakStep, step);
+    lastStep = step;
+    lastPos = servoPosMilli;
+    steps++;
+  }
+  TEST_ASSERT_TRUE(servoSettled);
+  TEST_ASSERT_EQUAL(180000, servoPosMilli);
+  TEST_ASSERT_EQUAL(servoMaxSpeed * (long)SERVO_INTERVAL_MS, peakStep);
+  TEST_ASSERT_TRUE(steps > 90 * 1000 / (servoMaxSpeed * (long)SERVO_INTERVAL_MS));
+  TEST_ASSERT_EQUAL(SERVO_MAX_PULSE_US, servoMotor.pulseUs);
+  TEST_ASSERT_EQUAL(SERVO_MIN_PULSE_US, servoMotor.minPulseUs);  // Full range attached
+  TEST_ASSERT_EQUAL(SERVO_MAX_PULSE_US, servoMotor.maxPulseUs);
+
+  mockAdvanceMs(servoDetachMs);
+  taskServo();
+  TEST_ASSERT_FALSE(servoMotor.attached());
+  TEST_ASSERT_EQUAL(1, servoDetaches);
+
+  // Same target stays detached, a new one reattaches at the held angle
+  uint32_t writes = servoMotor.writes;
+  updateServo(180);
+  TEST_ASSERT_FALSE(servoMotor.attached());
+  updateServo(10);
+  TEST_ASSERT_TRUE(servoMotor.attached());
+  TEST_ASSERT_EQUAL(SERVO_MIN_ANGLE, servoAngle);
+  TEST_ASSERT_EQUAL(writes + 1, servoMotor.writes);
+  TEST_ASSERT_EQUAL(SERVO_MAX_PULSE_US, servoMotor.pulseUs);
+  TEST_ASSERT_FALSE(powerIdleAllowed());
+}
+
+void test_ir_filter_rejects_spikes_and_applies_hysteresis() {
+  resetFirmware();
+  for (int i = 0; i < 10; i++) sampleLeftIR();
+
+  mockSetAnalog(900);  // One-sample spike
+  sampleLeftIR();
+  mockSetAnalog(60);
+  sampleLeftIR();
+  TEST_ASSERT_FALSE(irLeftBlocked);
+
+  mockSetAnalog(600);  // Real edge: median passes it on the second sample
+  sampleLeftIR();
+  sampleLeftIR();
+  TEST_ASSERT_TRUE(irLeftBlocked);
+
+  // Settles at a level between off and on - stays blocked
+  mockSetAnalog(irOnThreshold - IR_HYSTERESIS_ADC / 2);
+  for (int i = 0; i < 20; i++) sampleLeftIR();
+  TEST_ASSERT_TRUE(irLeftBlocked);
+
+  mockSetAnalog(60);
+  for (int i = 0; i < 20; i++) sampleLeftIR();
+  TEST_ASSERT_FALSE(irLeftBlocked);
+}
+
+void test_ir_calibration_persists_per_surface() {
+  resetFirmware();
+  JsonDocument cfg;
+  cfg["surface"] = 2;
+  cfg["point"] = "floor";
+  mockSetAnalog(100);
+  applyIrCalibration(cfg.as<JsonObject>());
+  cfg["point"] = "edge";
+  mockSetAnalog(700);
+  applyIrCalibration(cfg.as<JsonObject>());
+
+  TEST_ASSERT_EQUAL(2, config.irActiveSurface);
+  TEST_ASSERT_EQUAL(400, irOnThreshold);
+  TEST_ASSERT_EQUAL(300, irOffThreshold);
+
+  selectIrSurface(0);
+  TEST_ASSERT_TRUE(loadConfig());  // Back from EEPROM
+  applyConfig();
+  TEST_ASSERT_EQUAL(2, config.irActiveSurface);
+  TEST_ASSERT_EQUAL(400, irOnThreshold);
+}
+
+void test_config_commits_only_on_change_and_rejects_corruption() {
+  resetFirmware();
+  saveCredentials("carbot-lab", "hunter22");
+  uint32_t commits = EEPROM.commits;
+  saveCredentials("carbot-lab", "hunter22");  // Reprovisioned, same content
+  TEST_ASSERT_EQUAL(commits, EEPROM.commits);
+
+  config = defaultConfig();
+  TEST_ASSERT_TRUE(loadConfig());
+  TEST_ASSERT_EQUAL_STRING("carbot-lab", config.ssid);
+
+  EEPROM.data[sizeof(ConfigHeader) + 3] ^= 0xFF;
+  TEST_ASSERT_FALSE(loadConfig());
+  TEST_ASSERT_EQUAL_STRING("", config.ssid);
+}
+
+void test_legacy_eeprom_layout_is_migrated() {
+  resetFirmware();
+  const char* ssid = "oldnet";
+  EEPROM.data[0] = strlen(ssid);
+  memcpy(EEPROM.data + 1, ssid, strlen(ssid));
+  EEPROM.data[100] = 4;
+  memcpy(EEPROM.data + 101, "pass", 4);
+  EEPROM.data[200] = (EEPROM_MAGIC >> 8) & 0xFF;
+  EEPROM.data[201] = EEPROM_MAGIC & 0xFF;
+  EEPROM.data[300] = 2;
+  memcpy(EEPROM.data + 301, "42", 2);
+
+  loadCredentials();
+  TEST_ASSERT_TRUE(ssid_stored == "oldnet");
+  TEST_ASSERT_TRUE(control_password_stored == "42");
+  TEST_ASSERT_TRUE(loadConfig());  // Now in the new format
+}
+
+void test_portal_page_streams_from_flash_with_etag() {
+  server.requestHeader = "";
+  handleRoot();
+  TEST_ASSERT_EQUAL(200, server.lastCode);
+  TEST_ASSERT_EQUAL(PORTAL_HTML_GZ_LEN, server.lastLength);
+  TEST_ASSERT_EQUAL_HEX8(0x1f, PORTAL_HTML_GZ[0]);  // gzip magic
+  TEST_ASSERT_EQUAL_HEX8(0x8b, PORTAL_HTML_GZ[1]);
+
+  server.requestHeader = PORTAL_HTML_ETAG;
+  handleRoot();
+  TEST_ASSERT_EQUAL(304, server.lastCode);
+}
+
+void test_scan_is_async_cached_and_escaped() {
+  resetFirmware();
+  WiFi.scanResults = { {"cafe \"guest\"", -48}, {"lab\\net", -71} };
+  WiFi.scanDone = false;
+  wifiScanValid = wifiScanRunning = false;
+
+  handleScan();
+  TEST_ASSERT_EQUAL(202, server.lastCode);
+  TEST_ASSERT_EQUAL(1, WiFi.scans);
+
+  WiFi.scanDone = true;
+  updateWifiScan();
+  handleScan();
+  TEST_ASSERT_EQUAL(200, server.lastCode);
+  JsonDocument doc;
+  TEST_ASSERT_FALSE(deserializeJson(doc, server.body.c_str()));
+  TEST_ASSERT_EQUAL(2, doc["networks"].size());
+  TEST_ASSERT_EQUAL_STRING("cafe \"guest\"", doc["networks"][0]["ssid"].as<const char*>());
+  TEST_ASSERT_EQUAL(-71, doc["networks"][1]["rssi"].as<int>());
+
+  mockAdvanceMs(WIFI_SCAN_CACHE_MS / 2);
+  handleScan();  // Served from cache
+  TEST_ASSERT_EQUAL(1, WiFi.scans);
+}
+
+void test_udp_frames_share_auth_and_sequence_with_mqtt() {
+  resetFirmware();
+  stopUdpControl();
+  controlUdp.inbound.clear();
+  controlUdp.inject(binaryFrame({50, 50, 90, 7}));
+  taskUdpControl();  // Listener off
+  TEST_ASSERT_EQUAL(0, leftTarget);
+
+  deliver("{\"password\":\"1234\",\"udp\":true}");
+  TEST_ASSERT_TRUE(udpControlActive);
+  TEST_ASSERT_EQUAL(1, config.udpControl);
+  TEST_ASSERT_EQUAL(UDP_CONTROL_PORT, controlUdp.localPort);
+
+  taskUdpControl();
+  TEST_ASSERT_EQUAL(50, leftTarget);
+
+  deliver(binaryFrame({80, 80, 90, 7}));  // Same seq over MQTT
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(50, leftTarget);
+  TEST_ASSERT_EQUAL(1, cmdDroppedOutOfOrder);
+
+  std::string forged = binaryFrame({90, 90, 90, 8});
+  forged[sizeof(CommandFrame) - 1] ^= 0x01;
+  controlUdp.inject(forged);
+  taskUdpControl();
+  TEST_ASSERT_EQUAL(50, leftTarget);
+  stopUdpControl();
+}
+
+// Drops the link and makes the next reconnect attempt due
+void attemptMqtt() {
+  mqttClient.isConnected = false;
+  mockAdvanceMs(MQTT_BACKOFF_MAX_MS);
+  reconnectMQTT();
+}
+
+void test_broker_failover_is_sticky_and_latency_aware() {
+  resetFirmware();
+  BrokerEntry a = {"a.example", 1883}, b = {"b.example", 8883};
+  config.brokers[0] = a;
+  config.brokers[1] = b;
+  WiFi.hosts["a.example"] = IPAddress(10, 0, 0, 11);
+  WiFi.hosts["b.example"] = IPAddress(10, 0, 0, 12);
+  mqttClient.unreachable.insert("10.0.0.11");
+  mqttClient.connectDelayMs["10.0.0.11"] = 20;
+  mqttClient.connectDelayMs["10.0.0.12"] = 200;
+
+  attemptMqtt();  // a fails, b is next on the following pass without backoff
+  TEST_ASSERT_FALSE(mqttClient.connected());
+  reconnectMQTT();
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_STRING("10.0.0.12", mqttClient.serverHost.c_str());
+  TEST_ASSERT_EQUAL(8883, mqttClient.serverPort);
+  TEST_ASSERT_EQUAL(1, config.preferredBroker);
+
+  mqttClient.unreachable.clear();
+  attemptMqtt();  // Sticky: b again even though a is back
+  TEST_ASSERT_EQUAL_STRING("10.0.0.12", mqttClient.serverHost.c_str());
+
+  mqttClient.unreachable.insert("10.0.0.12");
+  attemptMqtt();
+  reconnectMQTT();  // a connects 10x faster and takes over the preference
+  TEST_ASSERT_EQUAL_STRING("10.0.0.11", mqttClient.serverHost.c_str());
+  TEST_ASSERT_EQUAL(0, config.preferredBroker);
+}
+
+void test_reconnect_stops_manual_drive_and_reuses_dns() {
+  resetFirmware();
+  TEST_ASSERT_EQUAL(MQTT_CONNECT_TIMEOUT_MS, espClient.timeoutMs);
+  uint32_t attempts = mqttClient.connectAttempts;
+  setMotorSpeeds(50, 50);
+  leftSpeed = rightSpeed = 50;
+  attemptMqtt();  // Operator's link gone: stop first, connect once parked
+  TEST_ASSERT_EQUAL(0, leftTarget);
+  TEST_ASSERT_EQUAL(attempts, mqttClient.connectAttempts);
+  TEST_ASSERT_EQUAL(0, WiFi.lookups);
+
+  leftSpeed = rightSpeed = 0;
+  reconnectMQTT();
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_STRING("10.0.0.1", mqttClient.serverHost.c_str());
+  TEST_ASSERT_EQUAL(MQTT_SOCKET_TIMEOUT_S, mqttClient.socketTimeoutS);
+
+  // Driving itself: attempts go on from the cached address, bounded
+  autonomousMode = true;
+  setMotorSpeeds(40, 40);
+  leftSpeed = rightSpeed = 40;
+  attemptMqtt();
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL(40, leftTarget);
+  TEST_ASSERT_EQUAL(MQTT_MOVING_SOCKET_TIMEOUT_S, mqttClient.socketTimeoutS);
+  TEST_ASSERT_EQUAL(1, WiFi.lookups);  // Same address, no DNS
+
+  // Failing while moving keeps the address; a parked failed round drops it
+  mqttClient.unreachable.insert("10.0.0.1");
+  attemptMqtt();
+  TEST_ASSERT_TRUE(brokerStats[0].ip.isSet());
+  autonomousMode = false;
+  leftSpeed = rightSpeed = 0;
+  stopMotors();
+  attemptMqtt();
+  TEST_ASSERT_FALSE(brokerStats[0].ip.isSet());
+  WiFi.hosts.clear();
+  attempts = mqttClient.connectAttempts;
+  attemptMqtt();
+  TEST_ASSERT_EQUAL(2, WiFi.lookups);
+  TEST_ASSERT_EQUAL(attempts, mqttClient.connectAttempts);
+  TEST_ASSERT_FALSE(mqttClient.connected());
+}
+
+void test_mdns_broker_is_used_when_configured_ones_fail() {
+  resetFirmware();
+  mqttClient.unreachable.insert("10.0.0.1");  // mqtt_server
+  MDNS.services.push_back({IPAddress(192, 168, 1, 20), 1884});
+  lastMdnsQuery = millis() - MDNS_REDISCOVER_MS;
+
+  attemptMqtt();  // Round over -> discovery while parked
+  TEST_ASSERT_FALSE(mqttClient.connected());
+  TEST_ASSERT_EQUAL(1884, mdnsBrokerPort);
+
+  attemptMqtt();
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL_STRING("192.168.1.20", mqttClient.serverHost.c_str());
+  TEST_ASSERT_EQUAL(MQTT_BROKER_MDNS, config.preferredBroker);
+  uint32_t updates = MDNS.updates;
+  taskMqtt();
+  TEST_ASSERT_EQUAL(updates + 1, MDNS.updates);  // Responder serviced every pass
+}
+
+void test_wifi_connect_skips_mdns_when_a_broker_is_configured() {
+  resetFirmware();
+  mqttClient.isConnected = false;
+  uint32_t queries = MDNS.queries;
+  onWiFiConnected();
+  TEST_ASSERT_EQUAL(queries, MDNS.queries);  // Straight to the static broker
+  TEST_ASSERT_TRUE(mqttClient.connected());
+
+  // Without one, discovery is the only way to a broker
+  resetFirmware();
+  mqttClient.isConnected = false;
+  for (int i = 0; i < MQTT_BROKER_SLOTS; i++) config.brokers[i].host[0] = '\0';
+  MDNS.services.push_back({IPAddress(192, 168, 1, 20), 1884});
+  onWiFiConnected();
+  TEST_ASSERT_EQUAL(queries + 1, MDNS.queries);
+  TEST_ASSERT_TRUE(mqttClient.connected());
+}
+
+const PubSubClient::Message* lastMessageOn(const char* topic) {
+  for (auto it = mqttClient.published.rbegin(); it != mqttClient.published.rend(); ++it) {
+    if (it->topic == topic) return &*it;
+  }
+  return nullptr;
+}
+
+void test_sensor_batches_are_delta_encoded_with_backpressure() {
+  resetFirmware();
+  espClient.sendBufferFree = 2920;
+  setSensorRecording(true, 100);
+  writeMotorOutputs(40, -20);
+  for (int i = 0; i < 20; i++) {
+    mockAdvanceMs(IR_SAMPLE_INTERVAL_MS);
+    taskIrSampler();
+  }
+  mockAdvanceMs(100);
+  taskSensorFlush();
+
+  const PubSubClient::Message* batch = lastMessageOn(sensor_topic);
+  TEST_ASSERT_NOT_NULL(batch);
+  const uint8_t* b = (const uint8_t*)batch->payload.data();
+  TEST_ASSERT_EQUAL_HEX8(SENSOR_BATCH_MAGIC, b[0]);
+  TEST_ASSERT_EQUAL(20, b[2]);
+  TEST_ASSERT_EQUAL(SENSOR_BATCH_HEADER + 20 * 5, batch->payload.size());  // 1-byte deltas
+  TEST_ASSERT_EQUAL(IR_SAMPLE_INTERVAL_MS, b[SENSOR_BATCH_HEADER + 5]);      // Second delta
+  TEST_ASSERT_EQUAL(40, (int8_t)b[SENSOR_BATCH_HEADER + 3]);
+  TEST_ASSERT_EQUAL(-20, (int8_t)b[SENSOR_BATCH_HEADER + 4]);
+  TEST_ASSERT_EQUAL(0, sensorRingCount);
+
+  // Send buffer full: samples wait, the ring overwrites its oldest
+  espClient.sendBufferFree = 0;
+  size_t published = mqttClient.published.size();
+  for (int i = 0; i < SENSOR_RING_SIZE + 30; i++) {
+    mockAdvanceMs(IR_SAMPLE_INTERVAL_MS);
+    taskIrSampler();
+    taskSensorFlush();
+  }
+  TEST_ASSERT_EQUAL(published, mqttClient.published.size());
+  TEST_ASSERT_EQUAL(30, sensorSamplesDropped);
+  TEST_ASSERT_TRUE(sensorBackpressureWaits > 0);
+
+  espClient.sendBufferFree = 2920;
+  mockAdvanceMs(100);
+  taskSensorFlush();
+  b = (const uint8_t*)lastMessageOn(sensor_topic)->payload.data();
+  TEST_ASSERT_EQUAL(30, b[3]);
+  setSensorRecording(false, 100);
+}
+
+void test_alerts_coalesce_per_type_and_never_block_the_maneuver() {
+  resetFirmware();
+  queueSensorAlert(ALERT_NO_SURFACE_LEFT);
+  taskAlerts();
+  TEST_ASSERT_EQUAL(1, countPublished(sensor_topic));
+
+  // A table border bouncing the left sensor: one alert per window
+  for (int i = 0; i < 5; i++) {
+    mockAdvanceMs(100);
+    queueSensorAlert(ALERT_NO_SURFACE_LEFT);
+    taskAlerts();
+  }
+  queueSensorAlert(ALERT_NO_FORWARD_PATH);  // Other types are not held back
+  taskAlerts();
+  TEST_ASSERT_EQUAL(2, countPublished(sensor_topic));
+  TEST_ASSERT_EQUAL(4, alertsCoalesced);
+
+  mockAdvanceMs(ALERT_COALESCE_MS);
+  taskAlerts();
+  JsonDocument doc;
+  deserializeJson(doc, lastMessageOn(sensor_topic)->payload.c_str());
+  TEST_ASSERT_EQUAL_STRING("no_surface_left", doc["alert_type"].as<const char*>());
+  TEST_ASSERT_EQUAL(5, doc["count"].as<int>());
+
+  // Congested socket: producers never wait, the queue drops its overflow
+  espClient.sendBufferFree = 0;
+  for (int i = 0; i < ALERT_QUEUE_SIZE + 2; i++) {
+    queueSensorAlert(ALERT_NO_SURFACE_RIGHT);
+  }
+  TEST_ASSERT_EQUAL(3, loopAlerts.dropped);  // One slot stays free
+  mockAdvanceMs(ALERT_COALESCE_MS);
+  taskAlerts();
+  TEST_ASSERT_EQUAL(3, countPublished(sensor_topic));
+  TEST_ASSERT_TRUE(alertBackpressureWaits > 0);
+
+  espClient.sendBufferFree = 2920;
+  taskAlerts();
+  deserializeJson(doc, lastMessageOn(sensor_topic)->payload.c_str());
+  TEST_ASSERT_EQUAL(ALERT_QUEUE_SIZE - 1, doc["count"].as<int>());
+}
+
+void test_idle_power_saving_keeps_wake_latency_bounded() {
+  resetFirmware();
+  taskCount = 0;
+  setupTasks();
+  config.lightSleep = 1;
+  config.wakeLatencyMs = 400;
+
+  // Parked for idle_s: radio and loop go to sleep
+  unsigned long parkedAt = millis();
+  while (millis() - parkedAt < config.idleTimeoutS * 1000UL + POWER_CHECK_INTERVAL_MS) {
+    mockAdvanceMs(1);
+    loop();
+  }
+  TEST_ASSERT_EQUAL(POWER_LIGHT_SLEEP, powerState);
+  TEST_ASSERT_EQUAL(WIFI_LIGHT_SLEEP, WiFi.sleepType);
+  TEST_ASSERT_EQUAL(1, WiFi.sleepListenInterval);  // 200 ms / 102 ms beacons
+  TEST_ASSERT_TRUE(mqttClient.connected());
+
+  // A stranger's packets don't wake it
+  mqttClient.inject(command_topic, "{\"password\":\"guess\",\"left\":40}");
+  for (int i = 0; i < 50; i++) {
+    mockAdvanceMs(1);
+    loop();
+  }
+  TEST_ASSERT_EQUAL(POWER_LIGHT_SLEEP, powerState);
+
+  // A command arriving mid-sleep is acted on within the budget
+  unsigned long sentAt = millis();
+  mqttClient.inject(command_topic, jsonFrame({40, 40, 90, 1}, 0));
+  while (leftTarget == 0 && millis() - sentAt < 2 * config.wakeLatencyMs) {
+    loop();
+  }
+  TEST_ASSERT_EQUAL(40, leftTarget);
+  TEST_ASSERT_TRUE(millis() - sentAt <= config.wakeLatencyMs);
+  TEST_ASSERT_EQUAL(POWER_ACTIVE, powerState);
+  TEST_ASSERT_EQUAL(WIFI_NONE_SLEEP, WiFi.sleepType);
+  TEST_ASSERT_EQUAL(1, powerWakes);
+  TEST_ASSERT_TRUE(powerDwellMs(POWER_LIGHT_SLEEP) > 0);
+  TEST_ASSERT_EQUAL(millis() - parkedAt, powerDwellMs(POWER_ACTIVE) + powerDwellMs(POWER_LIGHT_SLEEP));
+
+  // The extra fields still fit the full status snapshot (state + health)
+  size_t statusCount = countPublished(status_topic);
+  publishStatus();
+  TEST_ASSERT_EQUAL(statusCount + 2, countPublished(status_topic));
+  taskCount = 0;
+}
+
+void test_full_status_fits_with_counters_at_their_widest() {
+  resetFirmware();
+  setupTasks();
+  const uint32_t widest = 0xFFFFFFFF;
+  memset(config.brokers[0].host, 'h', sizeof(config.brokers[0].host) - 1);
+  currentBroker = 0;
+  brokerStats[0].latencyMs = widest;
+  setMotorSpeeds(-100, -100);
+  streamState = STREAM_DECAY;
+  streamTimeoutMs = streamMaxGapMs = widest;
+  activeSession.valid = true;
+  activeSession.id = 0xFF;
+  mqttReconnectCount = mqttFailedAttempts = servoDetaches = 0xFFFF;
+  motorBrakeNowCount = streamDeadmanTrips = configCommits = 0xFFFF;
+  mqttLastReconnectMs = widest;
+  authFailures = authReplays = authLegacyRefused = authHellosRefused = widest;
+  cmdDroppedOutOfOrder = cmdDroppedStale = cmdCoalesced = macroRejected = widest;
+  sensorBatchesSent = sensorSamplesDropped = sensorBackpressureWaits = widest;
+  alertsPublished = alertsCoalesced = alertBackpressureWaits = widest;
+  powerWakes = udpPackets = widest;
+  for (int i = 0; i < POWER_STATE_COUNT; i++) powerStateMs[i] = widest / 2;
+  for (int i = 0; i < taskCount; i++) tasks[i].overruns = 0xFFFF;
+
+  // Both halves go out whole and parse
+  mqttClient.published.clear();
+  publishStatus();
+  TEST_ASSERT_EQUAL(2, countPublished(status_topic));
+  TEST_ASSERT_EQUAL(0, telemetryOversize);
+  JsonDocument state;
+  TEST_ASSERT_FALSE(deserializeJson(state, mqttClient.published[0].payload.c_str()));
+  TEST_ASSERT_EQUAL(-100, state["left_target"].as<int>());
+  JsonDocument health;
+  TEST_ASSERT_FALSE(deserializeJson(health, mqttClient.published[1].payload.c_str()));
+  TEST_ASSERT_EQUAL_STRING("health", health["section"].as<const char*>());
+  TEST_ASSERT_EQUAL(widest, health["auth_failures"].as<uint32_t>());
+  TEST_ASSERT_EQUAL(0xFFFF, health["task_overruns"]["mqtt"].as<int>());
+
+  // A document too big for the buffer is dropped, not sent truncated
+  telemetryArena.reset();
+  JsonDocument big(&telemetryArena);
+  std::string filler(TELEMETRY_BUFFER_SIZE, 'x');
+  big["filler"] = filler.c_str();
+  TEST_ASSERT_FALSE(publishTelemetry(status_topic, big));
+  TEST_ASSERT_EQUAL(1, telemetryOversize);
+  TEST_ASSERT_EQUAL(2, countPublished(status_topic));
+  taskCount = 0;
+}
+
+bool subscribedTo(const std::string& topic) {
+  for (const std::string& sub : mqttClient.subscriptions) {
+    if (sub == topic) return true;
+  }
+  return false;
+}
+
+void test_fleet_topics_and_group_broadcasts() {
+  resetFirmware();
+  TEST_ASSERT_EQUAL_STRING("cb-c0ffee", deviceId);
+  TEST_ASSERT_EQUAL_STRING("carbot/cb-c0ffee/command", command_topic);
+  TEST_ASSERT_EQUAL_STRING("carbot/cb-c0ffee/status", status_topic);
+
+  mqttClient.subscriptions.clear();
+  attemptMqtt();
+  TEST_ASSERT_TRUE(mqttClient.connected());
+  TEST_ASSERT_EQUAL(2, mqttClient.subscriptions.size());  // Own + "all"
+  TEST_ASSERT_TRUE(subscribedTo("carbot/all/command"));
+
+  deliver("{\"password\":\"1234\",\"fleet\":{\"name\":\"bot7\",\"groups\":[\"lab\",\"red\"]}}");
+  TEST_ASSERT_EQUAL_STRING("carbot/bot7/sensors", sensor_topic);
+  TEST_ASSERT_TRUE(subscribedTo("carbot/group/lab/command"));
+  TEST_ASSERT_TRUE(subscribedTo("carbot/group/red/command"));
+  TEST_ASSERT_EQUAL_STRING("bot7", config.deviceName);
+
+  // Topic wildcards or separators in a name are refused as a whole
+  deliver("{\"password\":\"1234\",\"fleet\":{\"name\":\"bot/+\",\"groups\":[]}}");
+  TEST_ASSERT_EQUAL_STRING("bot7", deviceId);
+  TEST_ASSERT_EQUAL_STRING("red", config.groups[1]);
+
+  // A group "all stop" lands even though its seq is behind the operator's
+  deliver(jsonFrame({40, 40, 90, 500}, millis()));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(40, leftTarget);
+  mqttClient.inject("carbot/group/lab/command", "{\"password\":\"1234\",\"cmd\":\"S\",\"seq\":3}");
+  mqttClient.loop();
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(0, leftTarget);
+  TEST_ASSERT_EQUAL(1, groupCommandsReceived);
+  TEST_ASSERT_EQUAL(0, cmdDroppedOutOfOrder);
+
+  // Broadcasts still get the seq and age checks, per topic: a queued
+  // "all forward" replayed after a WiFi drop is refused
+  mqttClient.inject("carbot/all/command", "{\"password\":\"1234\",\"cmd\":\"S\",\"seq\":9,\"ts\":1000}");
+  mqttClient.inject("carbot/all/command", "{\"password\":\"1234\",\"cmd\":\"S\",\"seq\":9}");
+  mqttClient.loop();
+  mqttClient.loop();
+  TEST_ASSERT_EQUAL(1, cmdDroppedOutOfOrder);
+  mockAdvanceMs(1000);
+  mqttClient.inject("carbot/all/command", "{\"password\":\"1234\",\"left\":60,\"right\":60,\"seq\":10,\"ts\":1100}");
+  mqttClient.loop();
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(1, cmdDroppedStale);
+  TEST_ASSERT_EQUAL(0, leftTarget);
+  mqttClient.inject("carbot/group/red/command", "{\"password\":\"1234\",\"cmd\":\"S\",\"seq\":9}");
+  mqttClient.loop();
+  TEST_ASSERT_EQUAL(1, cmdDroppedOutOfOrder);  // Its own stream
+
+  deliver("{\"password\":\"1234\",\"fleet\":{\"name\":\"\",\"groups\":[]}}");
+  TEST_ASSERT_EQUAL_STRING("carbot/cb-c0ffee/command", command_topic);
+}
+
+// Controller side of the session handshake, straight from the protocol notes
+std::string hmacSha256(const std::string& key, const std::string& data, size_t outLen) {
+  br_hmac_key_context kc;
+  br_hmac_context ctx;
+  uint8_t out[32];
+  br_hmac_key_init(&kc, &br_sha256_vtable, key.data(), key.size());
+  br_hmac_init(&ctx, &kc, outLen);
+  br_hmac_update(&ctx, data.data(), data.size());
+  br_hmac_out(&ctx, out);
+  return std::string((const char*)out, outLen);
+}
+
+std::string fromHex(const char* hex) {
+  std::string out;
+  for (size_t i = 0; hex[i] && hex[i + 1]; i += 2) {
+    out += (char)strtol(std::string(hex + i, 2).c_str(), nullptr, 16);
+  }
+  return out;
+}
+
+std::string stretchPassword(const std::string& password, const std::string& salt) {
+  std::string u = hmacSha256(password, salt + std::string("\0\0\0\1", 4), 32);
+  std::string out = u;
+  for (uint32_t i = 1; i < AUTH_KDF_ITERATIONS; i++) {
+    u = hmacSha256(password, u, 32);
+    for (size_t j = 0; j < out.size(); j++) out[j] ^= u[j];
+  }
+  return out;
+}
+
+// Sends a hello and derives the key from its reply; secret "" = stretch "1234"
+std::string openSession(const char* clientNonce, uint8_t& sid, std::string secret = "") {
+  deliver(std::string("{\"auth\":{\"hello\":\"") + clientNonce + "\"}}");
+  JsonDocument reply;
+  deserializeJson(reply, lastMessageOn(auth_topic)->payload.c_str());
+  sid = reply["sid"].as<int>();
+  if (secret.empty()) secret = stretchPassword("1234", fromHex(reply["salt"].as<const char*>()));
+  std::string key = hmacSha256(secret, "carbot-session" + fromHex(clientNonce) +
+                                   fromHex(reply["nonce"].as<const char*>()) + deviceId, 32);
+  TEST_ASSERT_TRUE(fromHex(reply["proof"].as<const char*>()) == hmacSha256(key, "carbot-bot", 8));
+  return key;
+}
+
+std::string sessionFrame(const std::string& key, uint8_t sid, uint16_t seq, int left, uint16_t epoch) {
+  std::string f(9, '\0');
+  f[0] = (char)CMD_FRAME_MAGIC;
+  f[1] = (char)CMD_FRAME_VERSION_SESSION;
+  f[2] = (char)(seq & 0xFF);
+  f[3] = (char)(seq >> 8);
+  f[4] = f[5] = (char)left;
+  f[6] = 90;
+  f[7] = CMD_FLAG_MOTORS;
+  f[8] = (char)sid;
+  std::string epochBytes = {(char)(epoch & 0xFF), (char)(epoch >> 8)};
+  return f + hmacSha256(key, epochBytes + f, AUTH_TAG_LEN);
+}
+
+std::string sealedJson(const std::string& key, uint8_t sid, uint16_t seq, const std::string& body) {
+  std::string f = {(char)SEALED_FRAME_MAGIC, (char)sid, (char)(seq & 0xFF), (char)(seq >> 8)};
+  f += body;
+  return f + hmacSha256(key, std::string(2, '\0') + f, AUTH_TAG_LEN);
+}
+
+void test_macro_runs_on_schedule_and_yields_to_edges() {
+  resetFirmware();
+  deliver("{\"password\":\"1234\",\"macro\":{\"segments\":[[40,40,0,300],[0,0,0,5]]}}");
+  TEST_ASSERT_EQUAL(1, macroRejected);  // Below the minimum segment: nothing stored
+  TEST_ASSERT_EQUAL(0, macroLength);
+
+  deliver("{\"password\":\"1234\",\"macro\":{\"segments\":"
+          "[[50,50,120,300],[-30,30,0,200],[20,20,90,100]],\"repeat\":2}}");
+  TEST_ASSERT_EQUAL(MACRO_RUNNING, macroState);
+  TEST_ASSERT_EQUAL(50, leftTarget);
+  TEST_ASSERT_EQUAL(120, servoAngle);
+  taskStatus();
+  JsonDocument doc;
+  deserializeJson(doc, lastMessageOn(macro_topic)->payload.c_str());
+  TEST_ASSERT_EQUAL_STRING("running", doc["state"].as<const char*>());
+  TEST_ASSERT_EQUAL(3, doc["segments"].as<int>());
+
+  // A late task pass doesn't stretch the program: deadlines stay on the grid
+  mockAdvanceMs(340);
+  taskMotion();
+  TEST_ASSERT_EQUAL(1, macroSegment);
+  TEST_ASSERT_EQUAL(-30, leftTarget);
+  TEST_ASSERT_EQUAL(120, servoAngle);  // 0 keeps the head
+  mockAdvanceMs(160);
+  taskMotion();
+  TEST_ASSERT_EQUAL(2, macroSegment);
+  TEST_ASSERT_EQUAL(90, servoAngle);
+  mockAdvanceMs(100);
+  taskMotion();
+  TEST_ASSERT_EQUAL(1, macroLoop);
+  TEST_ASSERT_EQUAL(0, macroSegment);
+  mockAdvanceMs(600);
+  taskMotion();
+  TEST_ASSERT_EQUAL(MACRO_DONE, macroState);
+  TEST_ASSERT_EQUAL(0, leftTarget);
+  taskStatus();
+  deserializeJson(doc, lastMessageOn(macro_topic)->payload.c_str());
+  TEST_ASSERT_EQUAL_STRING("done", doc["state"].as<const char*>());
+  TEST_ASSERT_EQUAL(1200, doc["elapsed_ms"].as<int>());
+
+  // The edge maneuver wins, then an operator command cancels a rerun
+  autonomousMode = true;
+  deliver("{\"password\":\"1234\",\"macro\":{\"start\":true}}");
+  TEST_ASSERT_EQUAL(MACRO_RUNNING, macroState);
+  TEST_ASSERT_FALSE(powerIdleAllowed());
+  irRightEdgePending = true;
+  taskObstacles();
+  TEST_ASSERT_EQUAL(MACRO_PREEMPTED, macroState);
+  TEST_ASSERT_EQUAL(MANEUVER_BRAKE, maneuverStep);
+  mockAdvanceMs(300);
+  taskMotion();
+  TEST_ASSERT_EQUAL(0, macroSegment);  // Frozen where it stopped
+
+  deliver("{\"password\":\"1234\",\"macro\":{\"start\":true}}");
+  TEST_ASSERT_EQUAL(MANEUVER_IDLE, maneuverStep);
+  deliver(binaryFrame({10, 10, 90, 1}));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(MACRO_CANCELLED, macroState);
+  TEST_ASSERT_EQUAL(10, leftTarget);
+}
+
+void test_macro_stops_at_edges_in_manual_mode() {
+  resetFirmware();  // autonomousMode off
+  deliver("{\"password\":\"1234\",\"macro\":{\"segments\":[[50,50,0,1000]]}}");
+  TEST_ASSERT_EQUAL(MACRO_RUNNING, macroState);
+  irRightEdgePending = true;
+  taskObstacles();
+  TEST_ASSERT_EQUAL(MACRO_PREEMPTED, macroState);
+  TEST_ASSERT_EQUAL(MANEUVER_IDLE, maneuverStep);  // No back-off without autonomy
+  TEST_ASSERT_EQUAL(0, leftTarget);
+  TEST_ASSERT_EQUAL(0, leftSpeed);
+
+  // The A0 sampler runs for a macro too; a restart at the edge stops again
+  deliver("{\"password\":\"1234\",\"macro\":{\"start\":true}}");
+  TEST_ASSERT_EQUAL(MACRO_RUNNING, macroState);
+  mockSetAnalog(1023);
+  int32_t filtered = irFiltered;
+  updateStatusPublisher();
+  TEST_ASSERT_EQUAL(filtered, irFiltered);  // Left to the sampler, no double step
+  for (int i = 0; i < 8 && macroState == MACRO_RUNNING; i++) {
+    mockAdvanceMs(5);
+    taskIrSampler();
+    taskObstacles();
+  }
+  TEST_ASSERT_TRUE(irLeftBlocked);
+  TEST_ASSERT_EQUAL(MACRO_PREEMPTED, macroState);
+  TEST_ASSERT_EQUAL(0, leftTarget);
+}
+
+std::vector<FlightEvent> flightEvents(const std::string& dump) {
+  std::vector<FlightEvent> events(dump.size() / sizeof(FlightEvent) - FLIGHT_DUMP_HEADER / sizeof(FlightEvent));
+  memcpy(events.data(), dump.data() + FLIGHT_DUMP_HEADER, events.size() * sizeof(FlightEvent));
+  return events;
+}
+
+void test_flight_recorder_survives_reset_and_dumps_in_order() {
+  resetFirmware();
+  clearFlightRecorder();
+  for (uint16_t seq = 1; seq <= 3; seq++) {
+    deliver(binaryFrame({50, 50, 120, seq}));
+  }
+  applyPendingCommand();
+  autonomousMode = true;
+  mockAdvanceMs(40);
+  irRightEdgePending = true;
+  taskObstacles();
+  taskMotion();
+  mockAdvanceMs(5000);
+  ESP.resetInfo.reason = 3;  // Soft watchdog: RTC memory is kept
+  loadFlightRecorder();
+
+  deliver("{\"password\":\"1234\",\"flight\":\"dump\"}");
+  TEST_ASSERT_EQUAL(0, countPublished(flight_topic));  // Not from inside the callback
+  taskStatus();
+  std::string dump = lastMessageOn(flight_topic)->payload;
+  TEST_ASSERT_EQUAL(FLIGHT_DUMP_MAGIC, (uint8_t)dump[0]);
+  TEST_ASSERT_EQUAL(3, (uint8_t)dump[3]);
+  TEST_ASSERT_EQUAL(1, (uint8_t)dump[4]);  // Boots survived
+
+  // 3 frames share one record; the JSON dump request gets its own
+  const uint8_t expected[][3] = {
+    {FLIGHT_COMMAND, FLIGHT_SRC_FRAME, 2}, {FLIGHT_SERVO, 120, 0}, {FLIGHT_SETPOINT, 50, 50},
+    {FLIGHT_IR, 0x02, 0}, {FLIGHT_MANEUVER, MANEUVER_BRAKE, 0},
+    {FLIGHT_BOOT, 3, 0}, {FLIGHT_COMMAND, FLIGHT_SRC_JSON, 0},
+  };
+  std::vector<FlightEvent> events = flightEvents(dump);
+  TEST_ASSERT_EQUAL(7, events.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    TEST_ASSERT_EQUAL(expected[i][0], events[i].type);
+    TEST_ASSERT_EQUAL(expected[i][1], events[i].a);
+    TEST_ASSERT_EQUAL(expected[i][2], events[i].b);
+  }
+  TEST_ASSERT_EQUAL(4, events[3].dt);  // 40ms later, in 10ms ticks
+
+  // Long idle stretches cost one marker, not a lost timeline
+  mockAdvanceMs(5004);
+  recordFlightEvent(FLIGHT_SERVO, 90, 0);
+  FlightEvent gap;
+  readFlightEvent(flightHeader.count - 2, &gap);
+  TEST_ASSERT_EQUAL(FLIGHT_GAP, gap.type);
+  TEST_ASSERT_EQUAL(50, gap.a | gap.b << 8);  // 100ms units + 0 ticks
+
+  // The ring keeps the newest events; HTTP streams the same bytes
+  for (int i = 0; i < FLIGHT_EVENTS + 10; i++) {
+    recordFlightEvent(FLIGHT_SERVO, 60 + i % 100, 0);
+  }
+  flightDumpPending = true;
+  taskStatus();
+  dump = lastMessageOn(flight_topic)->payload;
+  events = flightEvents(dump);
+  TEST_ASSERT_EQUAL(FLIGHT_EVENTS, events.size());
+  TEST_ASSERT_EQUAL(60 + (FLIGHT_EVENTS + 9) % 100, events.back().a);
+  handleFlight();
+  TEST_ASSERT_TRUE(server.body == dump);
+  TEST_ASSERT_TRUE(server.chunks > 1);
+
+  deliver("{\"password\":\"1234\",\"flight\":\"clear\"}");
+  TEST_ASSERT_TRUE(flightHeader.count <= 1);
+}
+
+void slowTask() { mockAdvanceUs(12000); }
+
+void test_flight_recorder_folds_streams_and_overruns() {
+  resetFirmware();
+  clearFlightRecorder();
+  for (uint16_t seq = 1; seq <= 20; seq++) {
+    deliver(binaryFrame({(int)seq, (int)seq, 90, seq}));
+    applyPendingCommand();
+    mockAdvanceMs(50);
+  }
+  std::vector<FlightEvent> events;
+  for (int i = 0; i < flightHeader.count; i++) {
+    FlightEvent event;
+    readFlightEvent(i, &event);
+    events.push_back(event);
+  }
+  TEST_ASSERT_EQUAL(2, events.size());  // The count plus the newest setpoint
+  TEST_ASSERT_EQUAL(FLIGHT_COMMAND, events[0].type);
+  TEST_ASSERT_EQUAL(19, events[0].b);
+  TEST_ASSERT_EQUAL(FLIGHT_SETPOINT, events[1].type);
+  TEST_ASSERT_EQUAL(20, events[1].a);
+
+  // A deadman decay rewrites one setpoint instead of one per step
+  clearFlightRecorder();
+  startStreaming(20, 500);
+  deliver(binaryFrame({60, 60, 90, 21}));
+  applyPendingCommand();
+  for (int i = 0; i < 120; i++) {
+    mockAdvanceMs(5);
+    updateStreamDeadman();
+  }
+  TEST_ASSERT_EQUAL(STREAM_STOPPED, streamState);
+  TEST_ASSERT_EQUAL(2, flightHeader.count);
+  FlightEvent last;
+  readFlightEvent(1, &last);
+  TEST_ASSERT_EQUAL(FLIGHT_SETPOINT, last.type);
+  TEST_ASSERT_EQUAL(0, last.a);
+  stopStreaming();
+
+  // A task that overruns every period keeps one event for its slot
+  clearFlightRecorder();
+  taskCount = 0;
+  registerTask("slow", slowTask, 10, 1);
+  for (int i = 0; i < 4; i++) {
+    runScheduler();
+    mockAdvanceMs(10);
+  }
+  taskCount = 0;
+  TEST_ASSERT_EQUAL(4, tasks[0].overruns);
+  TEST_ASSERT_EQUAL(1, flightHeader.count);
+  FlightEvent overrun;
+  readFlightEvent(0, &overrun);
+  TEST_ASSERT_EQUAL(FLIGHT_OVERRUN, overrun.type);
+  TEST_ASSERT_EQUAL(0 | 3 << 4, overrun.a);
+  TEST_ASSERT_EQUAL(12, overrun.b);
+}
+
+void test_latency_echo_reports_seq_and_apply_time() {
+  resetFirmware();
+  deliver(binaryFrame({20, 20, 90, 1}));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(0, countPublished(latency_topic));  // Off by default
+
+  deliver("{\"password\":\"1234\",\"bench\":{\"echo\":true}}");
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(0, countPublished(latency_topic));  // Nothing actuated
+
+  // Unauthenticated packets are neither counted nor recorded
+  uint8_t flightCount = flightHeader.count;
+  std::string forged = binaryFrame({30, 30, 90, 2});
+  forged.back() ^= 1;
+  deliver(forged);
+  deliver("{\"password\":\"guess\",\"left\":30}");
+  TEST_ASSERT_EQUAL(0, latencyReceived);
+  TEST_ASSERT_EQUAL(flightCount, flightHeader.count);
+
+  deliver(binaryFrame({30, 30, 90, 2}));
+  deliver(binaryFrame({40, 40, 90, 3}));
+  mockAdvanceUs(250);
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(1, countPublished(latency_topic));  // One echo per apply
+  const std::string& echo = lastMessageOn(latency_topic)->payload;
+  TEST_ASSERT_EQUAL(LATENCY_ECHO_LEN, echo.size());
+  TEST_ASSERT_EQUAL(LATENCY_ECHO_MAGIC, (uint8_t)echo[0]);
+  uint16_t seq, received, applied;
+  uint32_t applyUs, elapsedUs;
+  memcpy(&seq, &echo[2], 2);
+  memcpy(&applyUs, &echo[4], 4);
+  memcpy(&elapsedUs, &echo[8], 4);
+  memcpy(&received, &echo[12], 2);
+  memcpy(&applied, &echo[14], 2);
+  TEST_ASSERT_EQUAL(3, seq);
+  TEST_ASSERT_EQUAL(micros(), applyUs);
+  TEST_ASSERT_EQUAL(250, elapsedUs);
+  TEST_ASSERT_EQUAL(2, received);
+  TEST_ASSERT_EQUAL(1, applied);
+
+  // JSON carries its seq too; a rejected replay is received, never applied
+  deliver(jsonFrame({10, 10, 100, 4}, millis()));
+  deliver(binaryFrame({50, 50, 90, 3}));
+  applyPendingCommand();
+  const std::string& json = lastMessageOn(latency_topic)->payload;
+  memcpy(&seq, &json[2], 2);
+  memcpy(&received, &json[12], 2);
+  memcpy(&applied, &json[14], 2);
+  TEST_ASSERT_EQUAL(4, seq);
+  TEST_ASSERT_EQUAL(10, leftTarget);
+  TEST_ASSERT_EQUAL(4, received);
+  TEST_ASSERT_EQUAL(2, applied);
+}
+
+void test_session_auth_replaces_the_password_on_the_wire() {
+  resetFirmware();
+  uint8_t sid;
+  std::string key = openSession("0011223344556677", sid);
+  TEST_ASSERT_FALSE(activeSession.valid);
+
+  deliver(sessionFrame(key, sid, 1, 30, 0));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(30, leftTarget);
+  TEST_ASSERT_TRUE(activeSession.valid);
+
+  // Replay, forged tag, unknown session: all dropped
+  deliver(sessionFrame(key, sid, 1, 90, 0));
+  deliver(sessionFrame("wrong key", sid, 2, 90, 0));
+  deliver(sessionFrame(key, sid + 1, 2, 90, 0));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(30, leftTarget);
+  TEST_ASSERT_EQUAL(1, authReplays);
+  TEST_ASSERT_EQUAL(2, authFailures);
+
+  // Any JSON command, sealed instead of carrying the password
+  deliver(sealedJson(key, sid, 2, "{\"servo\":120,\"auth\":{\"require\":true}}"));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(120, servoAngle);
+  TEST_ASSERT_EQUAL(1, config.requireSession);
+  deliver("{\"password\":\"1234\",\"left\":80,\"right\":80}");
+  deliver(binaryFrame({80, 80, 90, 9}));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(30, leftTarget);
+  TEST_ASSERT_EQUAL(2, authLegacyRefused);
+
+  // A fleet all-stop has no session to seal it, so a stop-only frame still works
+  std::string stop = binaryFrame({0, 0, 90, 1}, CMD_FLAG_STOP);
+  mqttCallback(broadcast_topic, (byte*)&stop[0], stop.size());
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(0, leftTarget);
+  TEST_ASSERT_EQUAL(2, authLegacyRefused);
+
+  // After seq wraps, a tag from the previous epoch no longer verifies
+  deliver(sessionFrame(key, sid, 30000, 31, 0));
+  deliver(sessionFrame(key, sid, 60000, 32, 0));
+  deliver(sessionFrame(key, sid, 5, 33, 0));
+  deliver(sessionFrame(key, sid, 5, 33, 1));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(33, leftTarget);
+  TEST_ASSERT_EQUAL(3, authFailures);
+
+  // A stray hello leaves the operator's session working
+  deliver("{\"auth\":{\"hello\":\"8899aabbccddeeff\"}}");
+  deliver(sessionFrame(key, sid, 6, 34, 1));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(34, leftTarget);
+  TEST_ASSERT_EQUAL(sid, activeSession.id);
+  TEST_ASSERT_EQUAL(2, authHandshakes);
+}
+
+void test_hellos_cannot_evict_a_pending_session() {
+  resetFirmware();
+  uint8_t sid;
+  std::string key = openSession("0011223344556677", sid);
+  deliver("{\"auth\":{\"hello\":\"0011223344556677\"}}");  // Resent hello
+  TEST_ASSERT_EQUAL(1, authHandshakes);
+
+  // A stranger fills the other slots, then gets refused
+  deliver("{\"auth\":{\"hello\":\"a000000000000001\"}}");
+  deliver("{\"auth\":{\"hello\":\"a000000000000002\"}}");
+  deliver("{\"auth\":{\"hello\":\"a000000000000003\"}}");
+  deliver("{\"auth\":{\"hello\":\"a000000000000004\"}}");
+  TEST_ASSERT_EQUAL(AUTH_PENDING_SLOTS, authHandshakes);
+  TEST_ASSERT_EQUAL(1, authHellosRefused);
+
+  deliver(sessionFrame(key, sid, 1, 30, 0));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(30, leftTarget);
+  TEST_ASSERT_EQUAL(sid, activeSession.id);
+
+  // Pending sessions expire, and their slots come free again
+  uint8_t lateSid;
+  std::string late = openSession("b000000000000001", lateSid);
+  mockAdvanceMs(AUTH_PENDING_TTL_MS);
+  deliver(sessionFrame(late, lateSid, 1, 50, 0));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(30, leftTarget);
+  TEST_ASSERT_EQUAL(1, authFailures);
+  openSession("b000000000000002", lateSid);
+  TEST_ASSERT_EQUAL(AUTH_PENDING_SLOTS + 2, authHandshakes);
+}
+
+void test_session_secret_is_stretched_or_provisioned() {
+  resetFirmware();
+  uint8_t out[AUTH_KEY_LEN];
+  pbkdf2Sha256("password", 8, (const uint8_t*)"salt", 4, 4096, out);
+  TEST_ASSERT_TRUE(std::string((const char*)out, 32) ==
+                   fromHex("c5e478d59288c841aa530db6845c4c8d962893a001ce4e11a4963873aa98134a"));
+
+  // Config saved before v7: derived once at boot, then kept
+  config.sessionSecretSource = SESSION_SECRET_NONE;
+  saveConfig();
+  loadCredentials();
+  TEST_ASSERT_EQUAL(SESSION_SECRET_PASSWORD, config.sessionSecretSource);
+  TEST_ASSERT_TRUE(loadConfig());
+  TEST_ASSERT_EQUAL(SESSION_SECRET_PASSWORD, config.sessionSecretSource);
+
+  // A new password gets a new salt
+  uint8_t salt[AUTH_SALT_LEN];
+  memcpy(salt, config.sessionSalt, sizeof(salt));
+  saveControlPassword("5678");
+  TEST_ASSERT_FALSE(memcmp(salt, config.sessionSalt, sizeof(salt)) == 0);
+  saveControlPassword("1234");
+
+  const char* keyHex = "00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff";
+  TEST_ASSERT_FALSE(setSessionSecret("0011"));
+  TEST_ASSERT_TRUE(setSessionSecret(keyHex));
+  saveControlPassword("5678");  // Leaves a provisioned key alone
+  uint8_t sid;
+  std::string key = openSession("0011223344556677", sid, fromHex(keyHex));
+  TEST_ASSERT_TRUE(lastMessageOn(auth_topic)->payload.find("salt") == std::string::npos);
+  deliver(sessionFrame(key, sid, 1, 30, 0));
+  applyPendingCommand();
+  TEST_ASSERT_EQUAL(30, leftTarget);
+
+  TEST_ASSERT_TRUE(setSessionSecret(""));
+  TEST_ASSERT_FALSE(activeSession.valid);
+  TEST_ASSERT_EQUAL(SESSION_SECRET_PASSWORD, config.sessionSecretSource);
+}
+
+// ==================== BENCHMARKS ====================
+void bench_json_command_decode() {
+  std::vector<TraceFrame> trace = buildTeleopTrace(2000);
+  std::vector<std::string> payloads;
+  resetFirmware();
+  for (size_t i = 0; i < trace.size(); i++) {
+    payloads.push_back(jsonFrame(trace[i], TRACE_START_MS + i * TRACE_FRAME_MS));
+  }
+
+  bench("json_decode", payloads.size(), [&](size_t i) {
+    deliver(payloads[i]);
+    applyPendingCommand();
+    mockAdvanceMs(TRACE_FRAME_MS);
+  });
+  TEST_ASSERT_EQUAL(0, cmdDroppedOutOfOrder + cmdDroppedStale);
+}
+
+void bench_binary_command_decode() {
+  std::vector<TraceFrame> trace = buildTeleopTrace(2000);
+  std::vector<std::string> payloads;
+  resetFirmware();
+  for (const TraceFrame& f : trace) {
+    payloads.push_back(binaryFrame(f));
+  }
+
+  bench("binary_decode", payloads.size(), [&](size_t i) {
+    deliver(payloads[i]);
+    applyPendingCommand();
+    mockAdvanceMs(TRACE_FRAME_MS);
+  });
+  TEST_ASSERT_EQUAL(0, cmdDroppedOutOfOrder + cmdDroppedStale);
+}
+
+void bench_session_frame_decode() {
+  std::vector<TraceFrame> trace = buildTeleopTrace(2000);
+  std::vector<std::string> payloads;
+  resetFirmware();
+  uint8_t sid;
+  std::string key = openSession("0011223344556677", sid);
+  for (const TraceFrame& f : trace) {
+    payloads.push_back(sessionFrame(key, sid, f.seq, f.left, 0));
+  }
+
+  bench("session_decode", payloads.size(), [&](size_t i) {
+    deliver(payloads[i]);
+    applyPendingCommand();
+    mockAdvanceMs(TRACE_FRAME_MS);
+  });
+  TEST_ASSERT_EQUAL(0, authFailures + authReplays);
+}
+
+void bench_set_motor_speeds() {
+  std::vector<TraceFrame> trace = buildTeleopTrace(5000);
+  resetFirmware();
+
+  bench("set_motor_speeds", trace.size(), [&](size_t i) {
+    setMotorSpeeds(trace[i].left, trace[i].right);
+  });
+}
+
+void bench_motor_driver_write() {
+  std::vector<TraceFrame> trace = buildTeleopTrace(5000);
+  resetFirmware();
+
+  bench("motor_driver_write", trace.size(), [&](size_t i) {
+    writeMotorOutputs(trace[i].left, trace[i].right);
+  });
+}
+
+void bench_motor_ramp_step() {
+  std::vector<TraceFrame> trace = buildTeleopTrace(5000);
+  resetFirmware();
+
+  bench("motor_ramp_step", trace.size(), [&](size_t i) {
+    setMotorSpeeds(trace[i].left, trace[i].right);
+    mockAdvanceMs(MOTOR_RAMP_INTERVAL_MS);
+    updateMotorRamp();
+  });
+}
+
+void bench_obstacle_state_logic() {
+  resetFirmware();
+  autonomousMode = true;
+  attachIrRightInterrupt();
+  const size_t steps = 5000;  // 1 ms ticks; an edge every 1.5 s
+
+  bench("obstacle_tick", steps, [&](size_t i) {
+    if (i % 1500 == 0) setMotorSpeeds(60, 60);
+    mockSetPin(IR_RIGHT_PIN, (i % 1500) < 20 ? HIGH : LOW);
+    taskIrSampler();
+    taskObstacles();
+    taskMotion();
+    if (i % MOTOR_RAMP_INTERVAL_MS == 0) taskMotorRamp();
+    if (i % ALERT_PUBLISH_INTERVAL_MS == 0) taskAlerts();
+    mockAdvanceMs(1);
+  });
+  TEST_ASSERT_TRUE(countPublished(sensor_topic) >= 3);
+}
+
+// ==================== RUNNER ====================
+void setUp() {}
+void tearDown() {}
+
+int main(int, char**) {
+  UNITY_BEGIN();
+
+  RUN_TEST(test_binary_frame_sets_motors_and_servo);
+  RUN_TEST(test_binary_frame_with_bad_tag_is_ignored);
+  RUN_TEST(test_json_and_binary_traces_end_in_same_state);
+  RUN_TEST(test_setpoints_coalesce_within_one_loop_pass);
+  RUN_TEST(test_reordered_and_stale_frames_are_dropped);
+  RUN_TEST(test_maneuver_steps_without_blocking);
+  RUN_TEST(test_operator_command_cancels_maneuver);
+  RUN_TEST(test_ramp_respects_accel_and_brake_limits);
+  RUN_TEST(test_driver_writes_only_changed_outputs);
+  RUN_TEST(test_servo_eases_to_target_and_detaches_when_settled);
+  RUN_TEST(test_ir_filter_rejects_spikes_and_applies_hysteresis);
+  RUN_TEST(test_ir_calibration_persists_per_surface);
+  RUN_TEST(test_config_commits_only_on_change_and_rejects_corruption);
+  RUN_TEST(test_legacy_eeprom_layout_is_migrated);
+  RUN_TEST(test_portal_page_streams_from_flash_with_etag);
+  RUN_TEST(test_scan_is_async_cached_and_escaped);
+  RUN_TEST(test_udp_frames_share_auth_and_sequence_with_mqtt);
+  RUN_TEST(test_broker_failover_is_sticky_and_latency_aware);
+  RUN_TEST(test_reconnect_stops_manual_drive_and_reuses_dns);
+  RUN_TEST(test_mdns_broker_is_used_when_configured_ones_fail);
+  RUN_TEST(test_wifi_connect_skips_mdns_when_a_broker_is_configured);
+  RUN_TEST(test_sensor_batches_are_delta_encoded_with_backpressure);
+  RUN_TEST(test_alerts_coalesce_per_type_and_never_block_the_maneuver);
+  RUN_TEST(test_idle_power_saving_keeps_wake_latency_bounded);
+  RUN_TEST(test_fleet_topics_and_group_broadcasts);
+  RUN_TEST(test_session_auth_replaces_the_password_on_the_wire);
+  RUN_TEST(test_hellos_cannot_evict_a_pending_session);
+  RUN_TEST(test_session_secret_is_stretched_or_provisioned);
+  RUN_TEST(test_macro_runs_on_schedule_and_yields_to_edges);
+  RUN_TEST(test_macro_stops_at_edges_in_manual_mode);
+  RUN_TEST(test_flight_recorder_survives_reset_and_dumps_in_order);
+  RUN_TEST(test_flight_recorder_folds_streams_and_overruns);
+  RUN_TEST(test_latency_echo_reports_seq_and_apply_time);
+  RUN_TEST(test_full_status_fits_with_counters_at_their_widest);  // Leaves counters maxed
+
+  RUN_TEST(bench_json_command_decode);
+  RUN_TEST(bench_binary_command_decode);
+  RUN_TEST(bench_session_frame_decode);
+  RUN_TEST(bench_set_motor_speeds);
+  RUN_TEST(bench_motor_driver_write);
+  RUN_TEST(bench_motor_ramp_step);
+  RUN_TEST(bench_obstacle_state_logic);
+
+  return UNITY_END();
+}
@@ -0,0 +1,262 @@
+"""
+Command-to-actuation latency bench and MQTT load generator for the bot
+
+Switches on the firmware's latency echo ({"bench": {"echo": true}}), floods
+carbot/<device>/command at each requested rate and payload format, and
+matches the echoes on carbot/<device>/latency against the send times.
+
+Requirements:
+    pip install paho-mqtt
+
+Usage:
+    python latency_bench.py --device cb-c0ffee --rates 10,50,100,200
+    python latency_bench.py --device bot7 --formats binary --duration 20
+
+Per run it reports:
+    sent/recv/applied   commands published, seen by the bot, and applied
+    lost                sent - recv (dropped between host and bot)
+    coalesced           recv - applied (superseded within one loop pass,
+                        or refused by the seq checks)
+    rtt p50/p90/p99/max publish -> echo back, ms (includes the return trip)
+    dev p50/p99         receive -> setMotorSpeeds() on the bot, ms
+
+Commands carry the password, so this needs {"auth": {"require": false}}.
+Motors are driven at --drive (default 0, safe on the bench). The stop and
+echo-off commands are sent even when interrupted.
+"""
+
+import argparse
+import hashlib
+import hmac
+import json
+import logging
+import os
+import random
+import struct
+import sys
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+# ===== CONFIGURATION =====
+MQTT_BROKER = os.getenv("MQTT_BROKER", "broker.emqx.io")
+MQTT_PORT = 1883
+BOT_PASSWORD = os.getenv("BOT_PASSWORD", "1234")
+
+DEFAULT_RATES = "10,50,100,200"   # Commands per second
+DEFAULT_DURATION = 10.0           # Seconds per run
+SETTLE_TIME = 1.0                 # Wait for late echoes after each run
+
+# Binary command frame, see CommandFrame in main.cpp
+CMD_FRAME_MAGIC = 0xC5
+CMD_FRAME_VERSION = 1
+CMD_FLAG_MOTORS = 0x01
+CMD_FLAG_SERVO = 0x02
+CMD_FRAME_TAG_LEN = 4
+
+# Latency echo frame, see LATENCY ECHO in main.cpp
+LATENCY_ECHO_MAGIC = 0xE1
+LATENCY_ECHO = struct.Struct("<BBHIIHH")
+
+# ===== LOGGING SETUP =====
+logging.basicConfig(
+    level=logging.INFO,
+    format='%(asctime)s - %(levelname)s - %(message)s'
+)
+logger = logging.getLogger(__name__)
+
+
+def binary_command(password, seq, left, right, servo):
+    body = struct.pack("<BBHbbBB", CMD_FRAME_MAGIC, CMD_FRAME_VERSION, seq & 0xFFFF,
+                       left, right, servo, CMD_FLAG_MOTORS | CMD_FLAG_SERVO)
+    return body + hmac.new(password.encode(), body, hashlib.sha256).digest()[:CMD_FRAME_TAG_LEN]
+
+
+def json_command(password, seq, left, right, servo):
+    return json.dumps({"password": password, "left": left, "right": right,
+                       "servo": servo, "seq": seq & 0xFFFF}, separators=(",", ":"))
+
+
+def percentile(samples, percent):
+    """Nearest-rank percentile; None for no samples"""
+    if not samples:
+        return None
+    ordered = sorted(samples)
+    rank = max(0, min(len(ordered) - 1, int(round(percent / 100.0 * len(ordered))) - 1))
+    return ordered[rank]
+
+
+class LatencyBench:
+    def __init__(self, args):
+        self.args = args
+        self.command_topic = "carbot/%s/command" % args.device
+        self.latency_topic = "carbot/%s/latency" % args.device
+        self.seq = random.randrange(0x10000)  # Far from the bot's last seq
+        self.lock = threading.Lock()
+        self.sent = {}       # seq -> perf_counter() at publish
+        self.rtt_ms = []
+        self.device_ms = []
+        self.last_echo = None
+        self.connected = threading.Event()
+
+        try:
+            self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION1,
+                                      client_id="carbot_bench_%d" % int(time.time()))
+        except AttributeError:  # paho-mqtt < 2.0
+            self.client = mqtt.Client(client_id="carbot_bench_%d" % int(time.time()))
+        self.client.on_connect = self.on_connect
+        self.client.on_message = self.on_message
+
+    def on_connect(self, client, userdata, flags, rc):
+        if rc != 0:
+            logger.error("MQTT connection failed with code: %s", rc)
+            return
+        client.subscribe(self.latency_topic, qos=0)
+        self.connected.set()
+
+    def on_message(self, client, userdata, msg):
+        now = time.perf_counter()
+        if len(msg.payload) != LATENCY_ECHO.size or msg.payload[0] != LATENCY_ECHO_MAGIC:
+            return
+        _, _, seq, _, elapsed_us, received, applied = LATENCY_ECHO.unpack(msg.payload)
+        with self.lock:
+            sent_at = self.sent.pop(seq, None)
+            if sent_at is None:
+                return  # From an earlier run
+            self.rtt_ms.append((now - sent_at) * 1000.0)
+            self.device_ms.append(elapsed_us / 1000.0)
+            self.last_echo = (received, applied)
+
+    def connect(self):
+        logger.info("Connecting to MQTT broker: %s:%d", self.args.broker, self.args.port)
+        self.client.connect(self.args.broker, self.args.port, 60)
+        self.client.loop_start()
+        if not self.connected.wait(10):
+            raise RuntimeError("MQTT connection timeout")
+
+    def control(self, body):
+        body["password"] = self.args.password
+        self.client.publish(self.command_topic, json.dumps(body), qos=0)
+
+    def run(self, fmt, rate):
+        """One run at a fixed rate; returns its result row"""
+        with self.lock:
+            self.sent.clear()
+            self.rtt_ms = []
+            self.device_ms = []
+            self.last_echo = None
+        self.control({"bench": {"echo": True}})  # Also zeroes the bot's counters
+        time.sleep(0.5)
+
+        build = binary_command if fmt == "binary" else json_command
+        interval = 1.0 / rate
+        count = int(rate * self.args.duration)
+        start = time.perf_counter()
+        for i in range(count):
+            deadline = start + i * interval
+            delay = deadline - time.perf_counter()
+            if delay > 0:
+                time.sleep(delay)
+            self.seq = (self.seq + 1) & 0xFFFF
+            # Alternate the sign so --drive exercises the ramp without driving off
+            left = right = self.args.drive if i % 2 == 0 else -self.args.drive
+            payload = build(self.args.password, self.seq, left, right, self.args.servo)
+            with self.lock:
+                self.sent[self.seq] = time.perf_counter()
+            self.client.publish(self.command_topic, payload, qos=0)
+        achieved = count / (time.perf_counter() - start)
+        time.sleep(SETTLE_TIME)
+
+        with self.lock:
+            received, applied = self.last_echo or (0, 0)
+            return {
+                "format": fmt, "rate": rate, "achieved": achieved, "sent": count,
+                "received": received, "applied": applied,
+                "lost": max(0, count - received), "coalesced": max(0, received - applied),
+                "echoes": len(self.rtt_ms),
+                "rtt": [percentile(self.rtt_ms, p) for p in (50, 90, 99, 100)],
+                "device": [percentile(self.device_ms, p) for p in (50, 99)],
+            }
+
+    def finish(self):
+        try:
+            self.control({"left": 0, "right": 0, "bench": {"echo": False}})
+            time.sleep(0.2)
+        finally:
+            self.client.loop_stop()
+            self.client.disconnect()
+
+
+def format_ms(value):
+    return "%7.1f" % value if value is not None else "      -"
+
+
+def print_report(rows):
+    print()
+    print("%-6s %5s %7s %6s %6s %7s %5s %6s | %7s %7s %7s %7s | %7s %7s" % (
+        "format", "rate", "actual", "sent", "recv", "applied", "lost", "coal",
+        "rtt p50", "p90", "p99", "max", "dev p50", "p99"))
+    for row in rows:
+        print("%-6s %5d %7.1f %6d %6d %7d %5d %6d | %s %s %s %s | %s %s" % (
+            row["format"], row["rate"], row["achieved"], row["sent"], row["received"],
+            row["applied"], row["lost"], row["coalesced"],
+            *[format_ms(v) for v in row["rtt"]], *[format_ms(v) for v in row["device"]]))
+        if row["sent"]:
+            print("%-6s %5s  lost %.1f%%  coalesced %.1f%%  echoes back %d" % (
+                "", "", 100.0 * row["lost"] / row["sent"],
+                100.0 * row["coalesced"] / row["sent"], row["echoes"]))
+
+
+# ===== MAIN PROGRAM =====
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--broker", default=MQTT_BROKER)
+    parser.add_argument("--port", type=int, default=MQTT_PORT)
+    parser.add_argument("--device", required=True, help="device id, e.g. cb-c0ffee or the fleet name")
+    parser.add_argument("--password", default=BOT_PASSWORD, help="control password (env BOT_PASSWORD)")
+    parser.add_argument("--formats", default="json,binary", help="json, binary or both")
+    parser.add_argument("--rates", default=DEFAULT_RATES, help="comma separated commands/s")
+    parser.add_argument("--duration", type=float, default=DEFAULT_DURATION, help="seconds per run")
+    parser.add_argument("--drive", type=int, default=0, help="motor setpoint to alternate, 0-100")
+    parser.add_argument("--servo", type=int, default=90, help="servo angle, 60-180")
+    parser.add_argument("--json-out", help="also write the results to this file")
+    args = parser.parse_args()
+
+    formats = [f.strip() for f in args.formats.split(",") if f.strip()]
+    rates = [int(r) for r in args.rates.split(",") if r.strip()]
+    if any(f not in ("json", "binary") for f in formats) or not rates:
+        parser.error("formats must be json/binary and at least one rate is needed")
+    if any(rate * args.duration >= 0x10000 for rate in rates):
+        parser.error("rate * duration must stay below 65536 (16-bit counters)")
+    args.drive = max(0, min(100, args.drive))
+    args.servo = max(60, min(180, args.servo))
+
+    bench = LatencyBench(args)
+    rows = []
+    try:
+        bench.connect()
+        for fmt in formats:
+            for rate in rates:
+                logger.info("Running %s at %d/s for %.0fs", fmt, rate, args.duration)
+                row = bench.run(fmt, rate)
+                if row["echoes"] == 0:
+                    logger.warning("No echoes - wrong device id, password, or session auth required?")
+                rows.append(row)
+    except KeyboardInterrupt:
+        logger.info("Interrupted, stopping the bot")
+    except Exception as e:
+        logger.error("Bench failed: %s", e)
+        return 1
+    finally:
+        bench.finish()
+
+    print_report(rows)
+    if args.json_out:
+        with open(args.json_out, "w") as f:
+            json.dump(rows, f, indent=2)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())